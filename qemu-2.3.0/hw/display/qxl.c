@@ -1045,6 +1045,22 @@ static int interface_client_monitors_config(QXLInstance *sin,
     return 1;
 }
 
+#if SPICE_INTERFACE_QXL_MINOR >= 4
+/* called from spice server thread context only */
+static void interface_set_display_feedback(QXLInstance *sin,
+                                           const QXLDisplayFeedback *feedback)
+{
+    PCIQXLDevice *qxl = container_of(sin, PCIQXLDevice, ssd.qxl);
+
+    /* only used while in vga mode, see qemu_spice_display_refresh; a
+     * secondary device never inits ssd, its lock included */
+    if (qxl->id != 0 || qxl->mode != QXL_MODE_VGA) {
+        return;
+    }
+    qemu_spice_display_feedback(&qxl->ssd, feedback);
+}
+#endif
+
 static const QXLInterface qxl_interface = {
     .base.type               = SPICE_INTERFACE_QXL,
     .base.description        = "qxl gpu",
@@ -1068,6 +1084,9 @@ static const QXLInterface qxl_interface = {
     .update_area_complete    = interface_update_area_complete,
     .set_client_capabilities = interface_set_client_capabilities,
     .client_monitors_config = interface_client_monitors_config,
+#if SPICE_INTERFACE_QXL_MINOR >= 4
+    .set_display_feedback    = interface_set_display_feedback,
+#endif
 };
 
 static const GraphicHwOps qxl_ops = {
@@ -1085,6 +1104,9 @@ static void qxl_enter_vga_mode(PCIQXLDevice *d) //ZZQ
 #endif
     graphic_console_set_hwops(d->ssd.dcl.con, d->vga.hw_ops, &d->vga);
     update_displaychangelistener(&d->ssd.dcl, GUI_REFRESH_INTERVAL_DEFAULT);
+    /* what the worker gave since the last time is lost, a pending count
+     * left at the max would keep the console from ever refreshing */
+    qemu_spice_display_reset_feedback(&d->ssd);
     qemu_spice_create_host_primary(&d->ssd);
     d->mode = QXL_MODE_VGA;
     vga_dirty_log_start(&d->vga);
@@ -1099,6 +1121,7 @@ static void qxl_exit_vga_mode(PCIQXLDevice *d) //ZZQ
     trace_qxl_exit_vga_mode(d->id);
     graphic_console_set_hwops(d->ssd.dcl.con, &qxl_ops, d);
     update_displaychangelistener(&d->ssd.dcl, GUI_REFRESH_INTERVAL_IDLE);
+    qemu_spice_display_reset_feedback(&d->ssd);
     vga_dirty_log_stop(&d->vga);
     qxl_destroy_primary(d, QXL_SYNC);
 }
@@ -67,9 +67,36 @@ typedef struct QXLCookie {
 
 QXLCookie *qxl_cookie_new(int type, uint64_t io);
 
+/* the damage of an update, beyond that it is its bounding box */
+#define SPICE_DISPLAY_MAX_DIRTY_RECTS 64
+
+/* released updates and framebuffers kept for reuse, of each */
+#define SPICE_DISPLAY_POOL_SIZE 4
+
+/* the refresh interval grows by INC up to MAX while the guest is idle */
+#define SPICE_REFRESH_INTERVAL_INC 20
+#define SPICE_REFRESH_INTERVAL_MAX 300
+
 typedef struct SimpleSpiceDisplay SimpleSpiceDisplay;
 typedef struct SimpleSpiceUpdate SimpleSpiceUpdate;
 typedef struct SimpleSpiceCursor SimpleSpiceCursor;
+typedef struct SimpleSpiceFramebuffer SimpleSpiceFramebuffer;
+
+/*
+ * A snapshot of the guest framebuffer shared with the spice server: the
+ * updates point into it rather than into copies of their own, and hold a
+ * reference until the server releases them. The pixels are prefaulted,
+ * hugepage backed where possible, and go back to the pool of ssd once the
+ * last reference is dropped.
+ */
+struct SimpleSpiceFramebuffer {
+    int refs; /* atomic, updates are released from the spice server thread */
+    SimpleSpiceDisplay *ssd;
+    uint32_t generation; /* pool_generation of ssd at allocation */
+    void *data;
+    size_t size;
+    pixman_image_t *image;
+};
 
 struct SimpleSpiceDisplay {
     DisplaySurface *ds;
@@ -81,6 +108,11 @@ struct SimpleSpiceDisplay {
     uint32_t unique;
     pixman_image_t *surface;
     pixman_image_t *mirror;
+    /* for 32bpp guests, mirror is the image of mirror_fb, which the updates
+     * share. spare_fb takes over while the server still reads mirror_fb. */
+    SimpleSpiceFramebuffer *mirror_fb;
+    SimpleSpiceFramebuffer *spare_fb;
+    QXLRect spare_stale; /* what changed in mirror_fb and not in spare_fb */
     int32_t num_surfaces;
 
     QXLRect dirty;
@@ -94,6 +126,24 @@ struct SimpleSpiceDisplay {
     QemuMutex lock;
     QTAILQ_HEAD(, SimpleSpiceUpdate) updates;
 
+    /* the spice worker's demand for frames, see qemu_spice_display_feedback */
+    uint32_t frame_interval_ms;
+    uint32_t pending_frames;
+    uint32_t max_pending_frames;
+
+    /*
+     * The pool of released updates and framebuffers. pool_lock is taken on
+     * its own or within lock, never the other way around. Framebuffers
+     * allocated before the last mode switch, of an older pool_generation,
+     * are freed rather than pooled.
+     */
+    QemuMutex pool_lock;
+    QTAILQ_HEAD(, SimpleSpiceUpdate) free_updates;
+    int n_free_updates;
+    SimpleSpiceFramebuffer *free_fbs[SPICE_DISPLAY_POOL_SIZE];
+    int n_free_fbs;
+    uint32_t pool_generation;
+
     /* cursor (without qxl): displaychangelistener -> spice server */
     SimpleSpiceCursor *ptr_define;
     SimpleSpiceCursor *ptr_move;
@@ -110,6 +160,12 @@ struct SimpleSpiceUpdate {
     QXLImage image;
     QXLCommandExt ext;
     uint8_t *bitmap;
+    size_t bitmap_size; /* kept along with bitmap when the update is reused */
+    SimpleSpiceFramebuffer *fb; /* instead of bitmap, see SimpleSpiceFramebuffer */
+    /* the clip of drawable, i.e. the damage: the rects are the data of
+     * clip.chunk */
+    QXLClipRects clip;
+    QXLRect clip_rects[SPICE_DISPLAY_MAX_DIRTY_RECTS];
     QTAILQ_ENTRY(SimpleSpiceUpdate) next;
 };
 
@@ -135,6 +191,11 @@ void qemu_spice_display_update(SimpleSpiceDisplay *ssd,
 void qemu_spice_display_switch(SimpleSpiceDisplay *ssd,
                                DisplaySurface *surface);
 void qemu_spice_display_refresh(SimpleSpiceDisplay *ssd);
+#if SPICE_INTERFACE_QXL_MINOR >= 4
+void qemu_spice_display_feedback(SimpleSpiceDisplay *ssd,
+                                 const QXLDisplayFeedback *feedback);
+#endif
+void qemu_spice_display_reset_feedback(SimpleSpiceDisplay *ssd);
 void qemu_spice_cursor_refresh_bh(void *opaque);
 
 void qemu_spice_add_memslot(SimpleSpiceDisplay *ssd, QXLDevMemSlot *memslot,
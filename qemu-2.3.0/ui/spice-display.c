@@ -19,6 +19,7 @@
 #include "ui/qemu-spice.h"
 #include "qemu/timer.h"
 #include "qemu/queue.h"
+#include "qemu/atomic.h"
 #include "monitor/monitor.h"
 #include "ui/console.h"
 #include "sysemu/sysemu.h"
@@ -126,8 +127,168 @@ void qemu_spice_wakeup(SimpleSpiceDisplay *ssd)
     spice_qxl_wakeup(&ssd->qxl);
 }
 
+static void qemu_spice_framebuffer_free(SimpleSpiceFramebuffer *fb)
+{
+    pixman_image_unref(fb->image);
+    qemu_anon_ram_free(fb->data, fb->size);
+    g_free(fb);
+}
+
+/*
+ * A framebuffer of the size of the guest surface, from the pool when it has
+ * one. Its pixels are undefined then.
+ */
+static SimpleSpiceFramebuffer *qemu_spice_framebuffer_new(SimpleSpiceDisplay *ssd)
+{
+    SimpleSpiceFramebuffer *fb = NULL;
+    int width = pixman_image_get_width(ssd->surface);
+    int height = pixman_image_get_height(ssd->surface);
+    int stride = pixman_image_get_stride(ssd->surface);
+
+    qemu_mutex_lock(&ssd->pool_lock);
+    if (ssd->n_free_fbs) {
+        fb = ssd->free_fbs[--ssd->n_free_fbs];
+    }
+    qemu_mutex_unlock(&ssd->pool_lock);
+    if (fb) {
+        return fb;
+    }
+
+    fb = g_new0(SimpleSpiceFramebuffer, 1);
+    fb->refs = 1;
+    fb->ssd = ssd;
+    fb->generation = ssd->pool_generation;
+    fb->size = (size_t)stride * height;
+    fb->data = qemu_oom_check(qemu_anon_ram_alloc(fb->size, NULL));
+    qemu_madvise(fb->data, fb->size, QEMU_MADV_HUGEPAGE);
+    /* fault the pages in now rather than on the next refreshes */
+    memset(fb->data, 0, fb->size);
+    fb->image = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+                                         fb->data, stride);
+    return fb;
+}
+
+/* may be called from spice server thread context, see qemu_spice_destroy_update */
+static void qemu_spice_framebuffer_unref(SimpleSpiceFramebuffer *fb)
+{
+    SimpleSpiceDisplay *ssd;
+
+    if (!fb || atomic_fetch_dec(&fb->refs) != 1) {
+        return;
+    }
+    ssd = fb->ssd;
+    qemu_mutex_lock(&ssd->pool_lock);
+    if (fb->generation == ssd->pool_generation &&
+        ssd->n_free_fbs < SPICE_DISPLAY_POOL_SIZE) {
+        fb->refs = 1;
+        ssd->free_fbs[ssd->n_free_fbs++] = fb;
+        fb = NULL;
+    }
+    qemu_mutex_unlock(&ssd->pool_lock);
+    if (fb) {
+        qemu_spice_framebuffer_free(fb);
+    }
+}
+
+/* a cleared update, reusing a released one and its bitmap if any */
+static SimpleSpiceUpdate *qemu_spice_update_new(SimpleSpiceDisplay *ssd)
+{
+    SimpleSpiceUpdate *update;
+    uint8_t *bitmap;
+    size_t bitmap_size;
+
+    qemu_mutex_lock(&ssd->pool_lock);
+    update = QTAILQ_FIRST(&ssd->free_updates);
+    if (update) {
+        QTAILQ_REMOVE(&ssd->free_updates, update, next);
+        ssd->n_free_updates--;
+    }
+    qemu_mutex_unlock(&ssd->pool_lock);
+    if (!update) {
+        return g_malloc0(sizeof(*update));
+    }
+
+    bitmap = update->bitmap;
+    bitmap_size = update->bitmap_size;
+    memset(update, 0, sizeof(*update));
+    update->bitmap = bitmap;
+    update->bitmap_size = bitmap_size;
+    return update;
+}
+
+/*
+ * Empty the pool on a mode switch. The framebuffers still in use are freed
+ * once released, they no longer have the size of the surface.
+ */
+static void qemu_spice_pool_flush(SimpleSpiceDisplay *ssd)
+{
+    SimpleSpiceFramebuffer *fbs[SPICE_DISPLAY_POOL_SIZE];
+    QTAILQ_HEAD(, SimpleSpiceUpdate) updates = QTAILQ_HEAD_INITIALIZER(updates);
+    SimpleSpiceUpdate *update;
+    int n_fbs, i;
+
+    qemu_mutex_lock(&ssd->pool_lock);
+    ssd->pool_generation++;
+    n_fbs = ssd->n_free_fbs;
+    memcpy(fbs, ssd->free_fbs, n_fbs * sizeof(fbs[0]));
+    ssd->n_free_fbs = 0;
+    while ((update = QTAILQ_FIRST(&ssd->free_updates)) != NULL) {
+        QTAILQ_REMOVE(&ssd->free_updates, update, next);
+        QTAILQ_INSERT_TAIL(&updates, update, next);
+    }
+    ssd->n_free_updates = 0;
+    qemu_mutex_unlock(&ssd->pool_lock);
+
+    for (i = 0; i < n_fbs; i++) {
+        qemu_spice_framebuffer_free(fbs[i]);
+    }
+    while ((update = QTAILQ_FIRST(&updates)) != NULL) {
+        QTAILQ_REMOVE(&updates, update, next);
+        g_free(update->bitmap);
+        g_free(update);
+    }
+}
+
+/*
+ * Make the mirror writable for this refresh. While updates still read it,
+ * the spare takes over: it is brought up to date with what changed in the
+ * mirror since the two were last swapped.
+ */
+static void qemu_spice_mirror_prepare(SimpleSpiceDisplay *ssd)
+{
+    SimpleSpiceFramebuffer *fb = ssd->spare_fb;
+    QXLRect stale = ssd->spare_stale;
+
+    if (!ssd->mirror_fb || atomic_read(&ssd->mirror_fb->refs) == 1) {
+        return;
+    }
+    if (!fb || atomic_read(&fb->refs) != 1) {
+        qemu_spice_framebuffer_unref(fb);
+        fb = qemu_spice_framebuffer_new(ssd);
+        stale.left = stale.top = 0;
+        stale.right = pixman_image_get_width(ssd->mirror);
+        stale.bottom = pixman_image_get_height(ssd->mirror);
+    }
+    if (!qemu_spice_rect_is_empty(&stale)) {
+        pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, fb->image,
+                               stale.left, stale.top, 0, 0,
+                               stale.left, stale.top,
+                               stale.right - stale.left, stale.bottom - stale.top);
+    }
+    memset(&ssd->spare_stale, 0, sizeof(ssd->spare_stale));
+    ssd->spare_fb = ssd->mirror_fb;
+    ssd->mirror_fb = fb;
+    ssd->mirror = fb->image;
+}
+
+/*
+ * Copy the guest pixels of rect to the mirror, and queue an update of the
+ * whole screen whose clip is the n_rects rects of the damage. The worker
+ * then draws, or encodes, only what changed, while the bitmap is always a
+ * whole frame.
+ */
 static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd, //ZZQ, one update is from rect
-                                         QXLRect *rect)
+                                         QXLRect *rect, const QXLRect *rects, int n_rects)
 {
     SimpleSpiceUpdate *update;
     QXLDrawable *drawable;
@@ -136,22 +297,44 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd, //ZZQ, one upd
     int bw, bh;
     struct timespec time_space;
     pixman_image_t *dest;
+    uint8_t *data;
+    int stride;
+    int i;
+
+    QEMU_BUILD_BUG_ON(offsetof(SimpleSpiceUpdate, clip_rects) !=
+                      offsetof(SimpleSpiceUpdate, clip) + sizeof(QXLClipRects));
+    assert(n_rects <= SPICE_DISPLAY_MAX_DIRTY_RECTS);
 
     trace_qemu_spice_create_update(
            rect->left, rect->right,
            rect->top, rect->bottom);
 
-    update   = g_malloc0(sizeof(*update));
+    update   = qemu_spice_update_new(ssd);
     drawable = &update->drawable;
     image    = &update->image;
     cmd      = &update->ext.cmd;
 
     bw       = rect->right - rect->left;
     bh       = rect->bottom - rect->top;
-    update->bitmap = g_malloc(bw * bh * 4);
+    if (ssd->mirror_fb) {
+        update->fb = ssd->mirror_fb;
+        atomic_inc(&update->fb->refs);
+        stride = pixman_image_get_stride(ssd->mirror);
+        data = (uint8_t *)pixman_image_get_data(ssd->mirror) +
+               rect->top * stride + rect->left * 4;
+    } else {
+        if (update->bitmap_size < bw * bh * 4) {
+            g_free(update->bitmap);
+            update->bitmap_size = bw * bh * 4;
+            update->bitmap = g_malloc(update->bitmap_size);
+        }
+        stride = bw * 4;
+        data = update->bitmap;
+    }
 
     drawable->bbox            = *rect;
-    drawable->clip.type       = SPICE_CLIP_TYPE_NONE;
+    drawable->clip.type       = SPICE_CLIP_TYPE_RECTS;
+    drawable->clip.data       = (uintptr_t)&update->clip;
     drawable->effect          = QXL_EFFECT_OPAQUE;
     drawable->release_info.id = (uintptr_t)(&update->ext);
     drawable->type            = QXL_DRAW_COPY;
@@ -163,6 +346,10 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd, //ZZQ, one upd
     drawable->mm_time = time_space.tv_sec * 1000
                       + time_space.tv_nsec / 1000 / 1000;
 
+    update->clip.num_rects = n_rects;
+    update->clip.chunk.data_size = n_rects * sizeof(QXLRect);
+    memcpy(update->clip_rects, rects, n_rects * sizeof(QXLRect));
+
     drawable->u.copy.rop_descriptor  = SPICE_ROPD_OP_PUT;
     drawable->u.copy.src_bitmap      = (uintptr_t)image;
     drawable->u.copy.src_area.right  = bw;
@@ -171,22 +358,31 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd, //ZZQ, one upd
     QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_DEVICE, ssd->unique++);
     image->descriptor.type   = SPICE_IMAGE_TYPE_BITMAP;
     image->bitmap.flags      = QXL_BITMAP_DIRECT | QXL_BITMAP_TOP_DOWN;
-    image->bitmap.stride     = bw * 4;
+    image->bitmap.stride     = stride;
     image->descriptor.width  = image->bitmap.x = bw;
     image->descriptor.height = image->bitmap.y = bh;
-    image->bitmap.data = (uintptr_t)(update->bitmap);
+    image->bitmap.data = (uintptr_t)data;
     image->bitmap.palette = 0;
     image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
 
-    dest = pixman_image_create_bits(PIXMAN_x8r8g8b8, bw, bh,
-                                    (void *)update->bitmap, bw * 4);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, ssd->mirror,
-                           rect->left, rect->top, 0, 0,
-                           rect->left, rect->top, bw, bh);
-    pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, dest,
-                           rect->left, rect->top, 0, 0,
-                           0, 0, bw, bh);
-    pixman_image_unref(dest);
+    for (i = 0; i < n_rects; i++) {
+        pixman_image_composite(PIXMAN_OP_SRC, ssd->surface, NULL, ssd->mirror,
+                               rects[i].left, rects[i].top, 0, 0,
+                               rects[i].left, rects[i].top,
+                               rects[i].right - rects[i].left,
+                               rects[i].bottom - rects[i].top);
+        if (ssd->mirror_fb) {
+            qemu_spice_rect_union(&ssd->spare_stale, &rects[i]);
+        }
+    }
+    if (!update->fb) {
+        dest = pixman_image_create_bits(PIXMAN_x8r8g8b8, bw, bh,
+                                        (void *)update->bitmap, bw * 4);
+        pixman_image_composite(PIXMAN_OP_SRC, ssd->mirror, NULL, dest,
+                               rect->left, rect->top, 0, 0,
+                               0, 0, bw, bh);
+        pixman_image_unref(dest);
+    }
 
     cmd->type = QXL_CMD_DRAW;
     cmd->data = (uintptr_t)drawable;
@@ -194,45 +390,96 @@ static void qemu_spice_create_one_update(SimpleSpiceDisplay *ssd, //ZZQ, one upd
     QTAILQ_INSERT_TAIL(&ssd->updates, update, next);
 }
 
-static void qemu_spice_create_update(SimpleSpiceDisplay *ssd) //ZZQ
+/*
+ * The dirty scan compares a line of a block of the guest with the mirror.
+ * Aligned lines, the common case, are compared a vector at a time.
+ */
+static bool qemu_spice_pixels_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    const VECTYPE *va = (const VECTYPE *)a;
+    const VECTYPE *vb = (const VECTYPE *)b;
+    const VECTYPE zero = (VECTYPE){0};
+    size_t n = len / sizeof(VECTYPE);
+    size_t i;
+
+    if (((uintptr_t)a | (uintptr_t)b | len) % sizeof(VECTYPE)) {
+        return memcmp(a, b, len) == 0;
+    }
+    for (i = 0; i + 4 <= n; i += 4) {
+        VECTYPE diff = (va[i + 0] ^ vb[i + 0]) | (va[i + 1] ^ vb[i + 1]) |
+                       (va[i + 2] ^ vb[i + 2]) | (va[i + 3] ^ vb[i + 3]);
+        if (!ALL_EQ(diff, zero)) {
+            return false;
+        }
+    }
+    for (; i < n; i++) {
+        if (!ALL_EQ(va[i], vb[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* beyond SPICE_DISPLAY_MAX_DIRTY_RECTS, the damage is its bounding box */
+static void qemu_spice_add_dirty_rect(QXLRect *rects, int *n_rects, QXLRect *bbox,
+                                      const QXLRect *rect)
+{
+    qemu_spice_rect_union(bbox, rect);
+    if (*n_rects < SPICE_DISPLAY_MAX_DIRTY_RECTS) {
+        rects[*n_rects] = *rect;
+    }
+    (*n_rects)++;
+}
+
+/*
+ * Find the blocks of the area the guest reported dirty that actually changed,
+ * comparing it with the mirror. Nothing is queued when nothing changed, so
+ * an idle guest causes no work in the spice worker.
+ */
+static bool qemu_spice_create_update(SimpleSpiceDisplay *ssd) //ZZQ
 {
     static const int blksize = 32;
     int blocks = (surface_width(ssd->ds) + blksize - 1) / blksize;
     int dirty_top[blocks];
-    int y, yoff, x, xoff, blk, bw;
+    int y, x, blk, bw;
     int bpp = surface_bytes_per_pixel(ssd->ds);
+    int guest_stride = surface_stride(ssd->ds);
+    int mirror_stride;
+    int open = 0; /* blocks with a dirty_top */
     uint8_t *guest, *mirror;
+    QXLRect rects[SPICE_DISPLAY_MAX_DIRTY_RECTS];
+    int n_rects = 0;
+    QXLRect bbox = { 0, };
 
     if (qemu_spice_rect_is_empty(&ssd->dirty)) {
-        return;
+        return false;
     };
 
     for (blk = 0; blk < blocks; blk++) {
         dirty_top[blk] = -1;
     }
 
+    qemu_spice_mirror_prepare(ssd);
     guest = surface_data(ssd->ds);
     mirror = (void *)pixman_image_get_data(ssd->mirror);
-#if 1
-    //ZZQ update full screen other than a small picture 
-    QXLRect update = {
-        .top    = 0,
-        .bottom = surface_height(ssd->ds),
-        .left   = 0,
-        .right  = surface_width(ssd->ds),
-     };
-    qemu_spice_create_one_update(ssd, &update);
-#endif
-#if 0
-    for (y = ssd->dirty.top; y < ssd->dirty.bottom; y++) {
-        yoff = y * surface_stride(ssd->ds);
-        for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
-            xoff = x * bpp;
+    mirror_stride = pixman_image_get_stride(ssd->mirror);
+    for (y = ssd->dirty.top; y <= ssd->dirty.bottom; y++) {
+        uint8_t *guest_line = guest + y * guest_stride;
+        uint8_t *mirror_line = mirror + y * mirror_stride;
+
+        /* most lines are unchanged as a whole: one compare covers them */
+        if (y < ssd->dirty.bottom && !open &&
+            qemu_spice_pixels_equal(guest_line + ssd->dirty.left * bpp,
+                                    mirror_line + ssd->dirty.left * bpp,
+                                    (ssd->dirty.right - ssd->dirty.left) * bpp)) {
+            continue;
+        }
+        for (x = ssd->dirty.left; x < ssd->dirty.right; x += bw) {
             blk = x / blksize;
-            bw = MIN(blksize, ssd->dirty.right - x);
-            if (memcmp(guest + yoff + xoff,
-                       mirror + yoff + xoff,
-                       bw * bpp) == 0) {
+            bw = MIN(blksize - x % blksize, ssd->dirty.right - x);
+            if (y == ssd->dirty.bottom ||
+                qemu_spice_pixels_equal(guest_line + x * bpp,
+                                        mirror_line + x * bpp, bw * bpp)) {
                 if (dirty_top[blk] != -1) {
                     QXLRect update = {
                         .top    = dirty_top[blk],
@@ -240,34 +487,35 @@ static void qemu_spice_create_update(SimpleSpiceDisplay *ssd) //ZZQ
                         .left   = x,
                         .right  = x + bw,
                     };
-                    qemu_spice_create_one_update(ssd, &update);
+                    qemu_spice_add_dirty_rect(rects, &n_rects, &bbox, &update);
                     dirty_top[blk] = -1;
+                    open--;
                 }
-            } else {
-                if (dirty_top[blk] == -1) {
-                    dirty_top[blk] = y;
-                }
+            } else if (dirty_top[blk] == -1) {
+                dirty_top[blk] = y;
+                open++;
             }
         }
     }
+    memset(&ssd->dirty, 0, sizeof(ssd->dirty));
 
-    for (x = ssd->dirty.left; x < ssd->dirty.right; x += blksize) {
-        blk = x / blksize;
-        bw = MIN(blksize, ssd->dirty.right - x);
-        if (dirty_top[blk] != -1) {
-            QXLRect update = {
-                .top    = dirty_top[blk],
-                .bottom = ssd->dirty.bottom,
-                .left   = x,
-                .right  = x + bw,
-            };
-            qemu_spice_create_one_update(ssd, &update);
-            dirty_top[blk] = -1;
-        }
+    if (n_rects == 0) {
+        return false;
+    }
+    if (n_rects > SPICE_DISPLAY_MAX_DIRTY_RECTS) {
+        rects[0] = bbox;
+        n_rects = 1;
     }
 
-    memset(&ssd->dirty, 0, sizeof(ssd->dirty));
-#endif
+    /* update the full screen rather than a small picture */
+    QXLRect update = {
+        .top    = 0,
+        .bottom = surface_height(ssd->ds),
+        .left   = 0,
+        .right  = surface_width(ssd->ds),
+     };
+    qemu_spice_create_one_update(ssd, &update, rects, n_rects);
+    return true;
 }
 
 static SimpleSpiceCursor*
@@ -318,11 +566,26 @@ qemu_spice_create_cursor_update(SimpleSpiceDisplay *ssd,
  * We do *not* hold the global qemu mutex here, so extra care is needed
  * when calling qemu functions.  QEMU interfaces used:
  *    - g_free (underlying glibc free is re-entrant).
+ *    - pixman_image_unref and qemu_anon_ram_free, on a framebuffer no
+ *      other thread references.
+ *    - qemu_mutex_lock of pool_lock, which no other lock nests in.
  */
 void qemu_spice_destroy_update(SimpleSpiceDisplay *sdpy, SimpleSpiceUpdate *update)
 {
-    g_free(update->bitmap);
-    g_free(update);
+    qemu_spice_framebuffer_unref(update->fb);
+    update->fb = NULL;
+
+    qemu_mutex_lock(&sdpy->pool_lock);
+    if (sdpy->n_free_updates < SPICE_DISPLAY_POOL_SIZE) {
+        QTAILQ_INSERT_HEAD(&sdpy->free_updates, update, next);
+        sdpy->n_free_updates++;
+        update = NULL;
+    }
+    qemu_mutex_unlock(&sdpy->pool_lock);
+    if (update) {
+        g_free(update->bitmap);
+        g_free(update);
+    }
 }
 
 void qemu_spice_create_host_memslot(SimpleSpiceDisplay *ssd)
@@ -382,6 +645,8 @@ void qemu_spice_display_init_common(SimpleSpiceDisplay *ssd)
 {
     qemu_mutex_init(&ssd->lock);
     QTAILQ_INIT(&ssd->updates);
+    qemu_mutex_init(&ssd->pool_lock);
+    QTAILQ_INIT(&ssd->free_updates);
     ssd->mouse_x = -1;
     ssd->mouse_y = -1;
     if (ssd->num_surfaces == 0) {
@@ -440,10 +705,19 @@ void qemu_spice_display_switch(SimpleSpiceDisplay *ssd, //ZZQ
            surface ? surface_height(surface) : 0);
 
     memset(&ssd->dirty, 0, sizeof(ssd->dirty));
+    qemu_spice_pool_flush(ssd);
     if (ssd->surface) {
         pixman_image_unref(ssd->surface);
         ssd->surface = NULL;
-        pixman_image_unref(ssd->mirror);
+        if (ssd->mirror_fb) {
+            qemu_spice_framebuffer_unref(ssd->mirror_fb);
+            qemu_spice_framebuffer_unref(ssd->spare_fb);
+            ssd->mirror_fb = NULL;
+            ssd->spare_fb = NULL;
+            memset(&ssd->spare_stale, 0, sizeof(ssd->spare_stale));
+        } else {
+            pixman_image_unref(ssd->mirror);
+        }
         ssd->mirror = NULL;
     }
 
@@ -460,8 +734,16 @@ void qemu_spice_display_switch(SimpleSpiceDisplay *ssd, //ZZQ
     }
     if (ssd->ds) {
         ssd->surface = pixman_image_ref(ssd->ds->image);
-        ssd->mirror  = qemu_pixman_mirror_create(ssd->ds->format,
-                                                 ssd->ds->image);
+        if (ssd->ds->format == PIXMAN_x8r8g8b8) {
+            /* the updates can point into the mirror as it is. Both are
+             * blank, the spare is ready for the first busy refresh. */
+            ssd->mirror_fb = qemu_spice_framebuffer_new(ssd);
+            ssd->spare_fb = qemu_spice_framebuffer_new(ssd);
+            ssd->mirror = ssd->mirror_fb->image;
+        } else {
+            ssd->mirror = qemu_pixman_mirror_create(ssd->ds->format,
+                                                    ssd->ds->image);
+        }
         qemu_spice_create_host_primary(ssd);
     }
 
@@ -494,18 +776,49 @@ void qemu_spice_cursor_refresh_bh(void *opaque)
     qemu_mutex_unlock(&ssd->lock);
 }
 
+/*
+ * Refresh at the frame rate the spice worker encodes at while the guest
+ * draws, and back off while it does not. The guest is not even scanned
+ * while the worker has no room for another frame. Without feedback from the
+ * worker, the rate is the default one.
+ */
 void qemu_spice_display_refresh(SimpleSpiceDisplay *ssd)
 {
+    uint64_t base, interval;
+    bool busy, updated = false;
+
     dprint(3, "%s/%d:\n", __func__, ssd->qxl.id);
-    graphic_hw_update(ssd->dcl.con);
 
     qemu_mutex_lock(&ssd->lock);
-    if (QTAILQ_EMPTY(&ssd->updates) && ssd->ds) {
-        qemu_spice_create_update(ssd);
-        ssd->notify++;
-    }
+    base = ssd->frame_interval_ms ?
+        ssd->frame_interval_ms : GUI_REFRESH_INTERVAL_DEFAULT;
+    busy = !QTAILQ_EMPTY(&ssd->updates) ||
+           (ssd->frame_interval_ms &&
+            ssd->pending_frames >= ssd->max_pending_frames);
     qemu_mutex_unlock(&ssd->lock);
 
+    if (!busy) {
+        graphic_hw_update(ssd->dcl.con);
+
+        qemu_mutex_lock(&ssd->lock);
+        if (QTAILQ_EMPTY(&ssd->updates) && ssd->ds) {
+            updated = qemu_spice_create_update(ssd);
+            ssd->notify++;
+        }
+        qemu_mutex_unlock(&ssd->lock);
+    }
+
+    interval = ssd->dcl.update_interval ?
+        ssd->dcl.update_interval : GUI_REFRESH_INTERVAL_DEFAULT;
+    if (updated || busy) {
+        /* a busy worker lowers its frame rate, i.e. raises base, itself */
+        interval = base;
+    } else {
+        interval = MIN(interval + SPICE_REFRESH_INTERVAL_INC,
+                       SPICE_REFRESH_INTERVAL_MAX);
+    }
+    update_displaychangelistener(&ssd->dcl, interval);
+
     if (ssd->notify) {
         ssd->notify = 0;
         qemu_spice_wakeup(ssd);
@@ -513,6 +826,32 @@ void qemu_spice_display_refresh(SimpleSpiceDisplay *ssd)
     }
 }
 
+#if SPICE_INTERFACE_QXL_MINOR >= 4
+/* called from spice server thread context */
+void qemu_spice_display_feedback(SimpleSpiceDisplay *ssd,
+                                 const QXLDisplayFeedback *feedback)
+{
+    qemu_mutex_lock(&ssd->lock);
+    ssd->frame_interval_ms = feedback->frame_interval_ms;
+    ssd->pending_frames = feedback->pending_frames;
+    ssd->max_pending_frames = feedback->max_pending_frames;
+    qemu_mutex_unlock(&ssd->lock);
+}
+#endif
+
+/*
+ * Forget the worker's feedback, for the default rate until it gives more.
+ * The feedback it gives while it is not used is dropped, and it gives it
+ * again on changes only: what was left of it is stale by the next use.
+ */
+void qemu_spice_display_reset_feedback(SimpleSpiceDisplay *ssd)
+{
+    qemu_mutex_lock(&ssd->lock);
+    ssd->frame_interval_ms = 0;
+    ssd->pending_frames = 0;
+    qemu_mutex_unlock(&ssd->lock);
+}
+
 /* spice display interface callbacks */
 
 static void interface_attach_worker(QXLInstance *sin, QXLWorker *qxl_worker)
@@ -694,6 +1033,16 @@ static int interface_client_monitors_config(QXLInstance *sin,
     }
 }
 
+#if SPICE_INTERFACE_QXL_MINOR >= 4
+static void interface_set_display_feedback(QXLInstance *sin,
+                                           const QXLDisplayFeedback *feedback)
+{
+    SimpleSpiceDisplay *ssd = container_of(sin, SimpleSpiceDisplay, qxl);
+
+    qemu_spice_display_feedback(ssd, feedback);
+}
+#endif
+
 static const QXLInterface dpy_interface = {
     .base.type               = SPICE_INTERFACE_QXL,
     .base.description        = "qemu simple display",
@@ -717,6 +1066,9 @@ static const QXLInterface dpy_interface = {
     .update_area_complete    = interface_update_area_complete,
     .set_client_capabilities = interface_set_client_capabilities,
     .client_monitors_config  = interface_client_monitors_config,
+#if SPICE_INTERFACE_QXL_MINOR >= 4
+    .set_display_feedback    = interface_set_display_feedback,
+#endif
 };
 
 static void display_update(DisplayChangeListener *dcl,
@@ -66,6 +66,8 @@ mfxStatus va_to_mfx_status(VAStatus va_res)
 VADisplay m_va_dpy = NULL;
 // gfx card file descriptor
 int m_fd = -1;
+// sessions sharing the display, the callers serialize the calls below
+int m_va_refs = 0;
 // decoder surfaces chain shared between app and MSDK
 
 mfxStatus CreateVAEnvDRM(mfxHDL* displayHandle)
@@ -74,6 +76,12 @@ mfxStatus CreateVAEnvDRM(mfxHDL* displayHandle)
     mfxStatus sts = MFX_ERR_NONE;
     int major_version = 0, minor_version = 0;
 
+    if (m_va_refs > 0) {
+        *displayHandle = m_va_dpy;
+        m_va_refs++;
+        return MFX_ERR_NONE;
+    }
+
     m_fd = open("/dev/dri/card0", O_RDWR);
 
     if (m_fd < 0)
@@ -99,15 +107,23 @@ mfxStatus CreateVAEnvDRM(mfxHDL* displayHandle)
     }
     if (MFX_ERR_NONE != sts)
         throw std::bad_alloc();
+
+    m_va_refs = 1;
+    return sts;
 }
 
 void CleanupVAEnvDRM()
 {
+    if (m_va_refs == 0 || --m_va_refs > 0) {
+        return;
+    }
     if (m_va_dpy) {
         vaTerminate(m_va_dpy);
+        m_va_dpy = NULL;
     }
     if (m_fd >= 0) {
         close(m_fd);
+        m_fd = -1;
     }
 }
 
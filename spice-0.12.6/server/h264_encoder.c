@@ -0,0 +1,636 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "red_common.h"
+#include "h264_encoder.h"
+#include "yuv_converter.h"
+#include "red_time.h"
+#include <x264.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* Macroblocks outside the damage get this qp offset, so x264 codes them as
+ * P_SKIP almost for free instead of spending bits on unchanged pixels */
+#define H264_STATIC_MB_QP_OFFSET 20.0f
+
+/* variance aq strength, only there to keep aq and with it the offsets on */
+#define H264_AQ_STRENGTH 0.01f
+
+/* qp of refine frames, about visually lossless for desktop content */
+#define H264_REFINE_QP 18
+
+/* the vbv holds this many frames worth of the target rate */
+#define H264_VBV_FRAMES 2
+
+/* SPICE_H264_INTRA_REFRESH, in frames per refresh wave */
+#define H264_MAX_INTRA_REFRESH 600
+
+/* slices per frame when they are handed out as they are coded, x264 makes
+ * it at least one per thread */
+#define H264_SLICE_COUNT 4
+
+/* a slice coded by x264 and not handed out yet */
+typedef struct H264PendingSlice {
+    uint8_t *buffer; /* NULL for a free entry */
+    int size;
+    int first_mb;
+    int last_mb;
+} H264PendingSlice;
+
+struct H264Encoder {
+    x264_t *x264;
+    x264_picture_t pic;
+    int pic_allocated;
+
+    int width;
+    int height;
+    int mb_width;
+    int mb_height;
+    float *quant_offsets;
+    uint8_t *dirty_row_pairs; /* one entry per two lines of the picture */
+
+    int64_t frame_num;
+    int force_idr;
+    uint64_t convert_time; /* ns */
+
+    /* intra refresh, see h264_encoder_update_refresh() */
+    int intra_refresh; /* frames per wave, 0 to recover with IDRs */
+    float refresh_position; /* macroblock column the wave is at */
+    int frames_since_refresh;
+    int refresh_queued;
+    int refresh_start; /* columns refreshed by the last frame, none if start > end */
+    int refresh_end;
+
+    /* rate control, bit_rate == 0 for constant quality */
+    uint64_t bit_rate;
+    uint32_t fps;
+    uint32_t open_fps; /* the fps x264 was opened with, see h264_encoder_rate_params() */
+
+    /* slices, see h264_encoder_nalu_process() */
+    const H264SliceOutput *slice_output;
+    void *slice_opaque;
+    pthread_mutex_t slice_lock;
+    H264PendingSlice *slices;
+    int n_slices;
+    int next_mb; /* first macroblock of the next slice to hand out */
+    uint8_t *last_slice; /* the frame, once handed out */
+    int last_slice_size;
+};
+
+static int h264_encoder_get_intra_refresh(void)
+{
+    char *env_intra_refresh_str;
+    long intra_refresh;
+
+    env_intra_refresh_str = getenv("SPICE_H264_INTRA_REFRESH");
+    if (env_intra_refresh_str == NULL) {
+        return 0;
+    }
+    errno = 0;
+    intra_refresh = strtol(env_intra_refresh_str, NULL, 10);
+    if (errno != 0 || intra_refresh < 0 || intra_refresh == 1 ||
+        intra_refresh > H264_MAX_INTRA_REFRESH) {
+        spice_warning("invalid SPICE_H264_INTRA_REFRESH %s, expected 0 or 2-%d",
+                      env_intra_refresh_str, H264_MAX_INTRA_REFRESH);
+        return 0;
+    }
+    return intra_refresh;
+}
+
+H264Encoder *h264_encoder_new(void)
+{
+    H264Encoder *encoder = spice_new0(H264Encoder, 1);
+
+    encoder->intra_refresh = h264_encoder_get_intra_refresh();
+    pthread_mutex_init(&encoder->slice_lock, NULL);
+    return encoder;
+}
+
+static void h264_encoder_free_resources(H264Encoder *encoder)
+{
+    if (encoder->x264) {
+        x264_encoder_close(encoder->x264);
+        encoder->x264 = NULL;
+    }
+    if (encoder->pic_allocated) {
+        x264_picture_clean(&encoder->pic);
+        encoder->pic_allocated = FALSE;
+    }
+    free(encoder->quant_offsets);
+    encoder->quant_offsets = NULL;
+    free(encoder->dirty_row_pairs);
+    encoder->dirty_row_pairs = NULL;
+    encoder->width = 0;
+    encoder->height = 0;
+}
+
+void h264_encoder_destroy(H264Encoder *encoder)
+{
+    int i;
+
+    h264_encoder_free_resources(encoder);
+    for (i = 0; i < encoder->n_slices; i++) {
+        if (encoder->slices[i].buffer) {
+            encoder->slice_output->release_buffer(encoder->slice_opaque,
+                                                  encoder->slices[i].buffer);
+        }
+    }
+    free(encoder->slices);
+    pthread_mutex_destroy(&encoder->slice_lock);
+    free(encoder);
+}
+
+/* slice_lock held */
+static void h264_encoder_put_slice(H264Encoder *encoder, H264PendingSlice *slice, int last)
+{
+    encoder->slice_output->put_slice(encoder->slice_opaque, slice->buffer, slice->size, last);
+    if (last) {
+        encoder->last_slice = slice->buffer;
+        encoder->last_slice_size = slice->size;
+    }
+    encoder->next_mb = slice->last_mb + 1;
+    slice->buffer = NULL;
+}
+
+/* slice_lock held: hands out the slices that come next in picture order */
+static void h264_encoder_flush_slices(H264Encoder *encoder)
+{
+    int last_mb = encoder->mb_width * encoder->mb_height - 1;
+    int i;
+
+    for (i = 0; i < encoder->n_slices; i++) {
+        H264PendingSlice *slice = &encoder->slices[i];
+
+        if (!slice->buffer || slice->first_mb != encoder->next_mb) {
+            continue;
+        }
+        h264_encoder_put_slice(encoder, slice, slice->last_mb == last_mb);
+        /* a slice waiting for this one may be before it in the array */
+        i = -1;
+    }
+}
+
+/*
+ * Called by x264 for each nal as soon as it is coded, from its slice threads,
+ * so not in picture order. x264 escapes the nal straight into a buffer of the
+ * output, which then goes out as it is. The parameter sets and seis come
+ * first, from the encoding thread, and are handed out right away.
+ */
+static void h264_encoder_nalu_process(x264_t *x264, x264_nal_t *nal, void *opaque)
+{
+    H264Encoder *encoder = opaque;
+    H264PendingSlice *slice;
+    uint8_t *buffer;
+    int i;
+
+    pthread_mutex_lock(&encoder->slice_lock);
+    /* the room x264 asks for the escaped nal */
+    buffer = encoder->slice_output->get_buffer(encoder->slice_opaque,
+                                               nal->i_payload * 3 / 2 + 5 + 64);
+    x264_nal_encode(x264, buffer, nal);
+    if (nal->i_type != NAL_SLICE && nal->i_type != NAL_SLICE_IDR) {
+        encoder->slice_output->put_slice(encoder->slice_opaque, buffer, nal->i_payload, FALSE);
+        pthread_mutex_unlock(&encoder->slice_lock);
+        return;
+    }
+
+    for (i = 0; i < encoder->n_slices && encoder->slices[i].buffer; i++);
+    if (i == encoder->n_slices) {
+        encoder->slices = spice_renew(H264PendingSlice, encoder->slices, ++encoder->n_slices);
+    }
+    slice = &encoder->slices[i];
+    slice->buffer = buffer;
+    slice->size = nal->i_payload;
+    slice->first_mb = nal->i_first_mb;
+    slice->last_mb = nal->i_last_mb;
+    h264_encoder_flush_slices(encoder);
+    pthread_mutex_unlock(&encoder->slice_lock);
+}
+
+/* what a failed frame left is not handed out with the next one */
+static void h264_encoder_reset_slices(H264Encoder *encoder)
+{
+    int i;
+
+    pthread_mutex_lock(&encoder->slice_lock);
+    for (i = 0; i < encoder->n_slices; i++) {
+        if (encoder->slices[i].buffer) {
+            encoder->slice_output->release_buffer(encoder->slice_opaque,
+                                                  encoder->slices[i].buffer);
+            encoder->slices[i].buffer = NULL;
+        }
+    }
+    encoder->next_mb = 0;
+    encoder->last_slice = NULL;
+    encoder->last_slice_size = 0;
+    pthread_mutex_unlock(&encoder->slice_lock);
+}
+
+/* once x264 is done with the frame, what is left goes out in picture order,
+ * and the last slice is the frame */
+static void h264_encoder_finish_slices(H264Encoder *encoder, uint8_t **frame, int *frame_size)
+{
+    H264PendingSlice *first;
+    int pending;
+    int i;
+
+    pthread_mutex_lock(&encoder->slice_lock);
+    for (;;) {
+        first = NULL;
+        pending = 0;
+        for (i = 0; i < encoder->n_slices; i++) {
+            if (!encoder->slices[i].buffer) {
+                continue;
+            }
+            pending++;
+            if (!first || encoder->slices[i].first_mb < first->first_mb) {
+                first = &encoder->slices[i];
+            }
+        }
+        if (!first) {
+            break;
+        }
+        h264_encoder_put_slice(encoder, first, pending == 1);
+    }
+    *frame = encoder->last_slice;
+    *frame_size = encoder->last_slice_size;
+    pthread_mutex_unlock(&encoder->slice_lock);
+}
+
+/*
+ * x264 cannot change the fps of an open encoder, and its rate control spends
+ * bit_rate / fps per frame. Frames come at the current fps, so the bit rate
+ * is scaled to the fps the encoder was opened with.
+ */
+static void h264_encoder_rate_params(H264Encoder *encoder, x264_param_t *param)
+{
+    int kbps = encoder->bit_rate * encoder->open_fps / encoder->fps / 1000;
+
+    kbps = MAX(kbps, 1);
+    param->rc.i_rc_method = X264_RC_ABR;
+    param->rc.i_bitrate = kbps;
+    param->rc.i_vbv_max_bitrate = kbps;
+    param->rc.i_vbv_buffer_size = MAX(kbps * H264_VBV_FRAMES / encoder->open_fps, 1);
+}
+
+static x264_t *h264_encoder_open_x264(H264Encoder *encoder, int width, int height)
+{
+    x264_param_t param;
+    x264_t *x264;
+
+    spice_debug("width %d height %d", width, height);
+
+    /* Get default params for preset/tuning */
+    if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0) {
+        spice_warning("failed to get default x264 params");
+        return NULL;
+    }
+    /* x264 only reads prop.quant_offsets with aq on, and ultrafast turns it
+     * off. A zero strength would turn it off again when the params are
+     * validated, so the variance aq of its own is kept just above zero */
+    param.rc.i_aq_mode = X264_AQ_VARIANCE;
+    param.rc.f_aq_strength = H264_AQ_STRENGTH;
+
+    /* Configure non-default param */
+    param.i_csp = X264_CSP_I420;
+    param.i_width = width;
+    param.i_height = height;
+    param.b_vfr_input = 0;
+    param.b_repeat_headers = 1;
+    param.b_annexb = 1;
+    if (encoder->bit_rate) {
+        encoder->open_fps = encoder->fps;
+        param.i_fps_num = encoder->fps;
+        param.i_fps_den = 1;
+        h264_encoder_rate_params(encoder, &param);
+    }
+    if (encoder->slice_output) {
+        param.i_slice_count = H264_SLICE_COUNT;
+        param.nalu_process = h264_encoder_nalu_process;
+    }
+    /* Rather than with IDRs, the picture is refreshed by a column of intra
+     * macroblocks moving across it, a wave every intra_refresh frames */
+    if (encoder->intra_refresh) {
+        param.b_intra_refresh = 1;
+        param.i_keyint_max = encoder->intra_refresh;
+    }
+
+    /* Apply profile restrictions */
+    if (x264_param_apply_profile(&param, "baseline") < 0) {
+        spice_warning("failed to apply x264 profile");
+        return NULL;
+    }
+
+    x264 = x264_encoder_open(&param);
+    if (x264) {
+        x264_encoder_parameters(x264, &param);
+        if (param.rc.i_aq_mode == X264_AQ_NONE) {
+            spice_warning("x264 turned aq off, the damage won't lower the frame size");
+        }
+    }
+    return x264;
+}
+
+static int h264_encoder_reset(H264Encoder *encoder, int width, int height)
+{
+    h264_encoder_free_resources(encoder);
+
+    encoder->x264 = h264_encoder_open_x264(encoder, width, height);
+    if (!encoder->x264) {
+        goto fail;
+    }
+    if (x264_picture_alloc(&encoder->pic, X264_CSP_I420, width, height) < 0) {
+        spice_warning("failed to allocate x264 picture");
+        goto fail;
+    }
+    encoder->pic_allocated = TRUE;
+    encoder->pic.opaque = encoder;
+
+    encoder->width = width;
+    encoder->height = height;
+    encoder->mb_width = (width + 15) / 16;
+    encoder->mb_height = (height + 15) / 16;
+    encoder->quant_offsets = spice_new(float, encoder->mb_width * encoder->mb_height);
+    encoder->dirty_row_pairs = spice_new(uint8_t, height / 2);
+    encoder->frame_num = 0;
+    return TRUE;
+
+fail:
+    h264_encoder_free_resources(encoder);
+    return FALSE;
+}
+
+void h264_encoder_set_rate(H264Encoder *encoder, uint64_t bit_rate, uint32_t fps)
+{
+    x264_param_t param;
+    int had_rate = encoder->bit_rate != 0;
+
+    spice_return_if_fail(bit_rate > 0 && fps > 0);
+
+    encoder->bit_rate = bit_rate;
+    encoder->fps = fps;
+    if (!encoder->x264) {
+        return;
+    }
+    /* the vbv cannot be turned on in an open encoder */
+    if (!had_rate) {
+        h264_encoder_free_resources(encoder);
+        return;
+    }
+    x264_encoder_parameters(encoder->x264, &param);
+    h264_encoder_rate_params(encoder, &param);
+    if (x264_encoder_reconfig(encoder->x264, &param) < 0) {
+        spice_warning("failed to change the x264 bit rate");
+    }
+}
+
+void h264_encoder_set_slice_output(H264Encoder *encoder, const H264SliceOutput *output,
+                                   void *opaque)
+{
+    spice_return_if_fail(encoder->slice_output == NULL);
+
+    encoder->slice_output = output;
+    encoder->slice_opaque = opaque;
+    /* x264 is opened again, with the slices, for the next frame */
+    h264_encoder_free_resources(encoder);
+}
+
+void h264_encoder_request_keyframe(H264Encoder *encoder)
+{
+    encoder->force_idr = TRUE;
+}
+
+/*
+ * x264 doesn't tell which columns it refreshes, this follows its intra
+ * refresh (encoder.c) with the same float steps: a wave starts with the
+ * first P frame, then every intra_refresh frames or, once the current one
+ * is over, after x264_encoder_intra_refresh(). Each P frame codes intra the
+ * columns the wave moves over, about mb_width / intra_refresh of them.
+ */
+static void h264_encoder_update_refresh(H264Encoder *encoder)
+{
+    float increment = MAX((float)(encoder->mb_width - 1) / encoder->intra_refresh, 1);
+
+    if (encoder->frame_num == 0) {
+        encoder->refresh_position = 0;
+        encoder->frames_since_refresh = 0;
+        encoder->refresh_queued = FALSE;
+        encoder->refresh_start = 1;
+        encoder->refresh_end = 0;
+        return;
+    }
+
+    encoder->frames_since_refresh++;
+    if (encoder->frames_since_refresh >= encoder->intra_refresh ||
+        (encoder->refresh_queued &&
+         encoder->refresh_position + 0.5f >= encoder->mb_width)) {
+        encoder->refresh_position = 0;
+        encoder->frames_since_refresh = 0;
+        encoder->refresh_queued = FALSE;
+    }
+    encoder->refresh_start = encoder->refresh_position + 0.5f;
+    encoder->refresh_position += increment;
+    encoder->refresh_end = encoder->refresh_position + 0.5f;
+    if (encoder->refresh_end >= encoder->mb_width - 1) {
+        encoder->refresh_position = encoder->mb_width;
+        encoder->refresh_end = encoder->mb_width - 1;
+    }
+}
+
+int h264_encoder_get_refresh_area(H264Encoder *encoder, SpiceRect *area)
+{
+    if (!encoder->intra_refresh || encoder->refresh_start > encoder->refresh_end) {
+        return FALSE;
+    }
+    area->left = encoder->refresh_start * 16;
+    area->right = MIN((encoder->refresh_end + 1) * 16, encoder->width);
+    area->top = 0;
+    area->bottom = encoder->height;
+    return TRUE;
+}
+
+/* the lines of rgb a damage box covers, see h264_encoder_encode() */
+static void h264_encoder_box_lines(H264Encoder *encoder, uint8_t flags,
+                                   const pixman_box32_t *box, int *top, int *bottom)
+{
+    if (flags & SPICE_BITMAP_FLAGS_TOP_DOWN) {
+        *top = MAX(box->y1, 0);
+        *bottom = MIN(box->y2, encoder->height);
+    } else {
+        *top = MAX(encoder->height - box->y2, 0);
+        *bottom = MIN(encoder->height - box->y1, encoder->height);
+    }
+}
+
+static void h264_encoder_fill_quant_offsets(H264Encoder *encoder, uint8_t flags,
+                                            const QRegion *damage)
+{
+    pixman_box32_t *boxes;
+    int n_boxes;
+    int i, x, y;
+
+    for (i = 0; i < encoder->mb_width * encoder->mb_height; i++) {
+        encoder->quant_offsets[i] = H264_STATIC_MB_QP_OFFSET;
+    }
+
+    boxes = pixman_region32_rectangles((pixman_region32_t *)damage, &n_boxes);
+    for (i = 0; i < n_boxes; i++) {
+        int mb_left = MAX(boxes[i].x1, 0) / 16;
+        int mb_right = (MIN(boxes[i].x2, encoder->width) + 15) / 16;
+        int mb_top, mb_bottom;
+
+        h264_encoder_box_lines(encoder, flags, &boxes[i], &mb_top, &mb_bottom);
+        mb_top /= 16;
+        mb_bottom = (mb_bottom + 15) / 16;
+        for (y = mb_top; y < mb_bottom; y++) {
+            for (x = mb_left; x < mb_right; x++) {
+                encoder->quant_offsets[y * encoder->mb_width + x] = 0;
+            }
+        }
+    }
+
+    /* the intra columns are coded at the quality of the damage */
+    for (y = 0; encoder->intra_refresh && y < encoder->mb_height; y++) {
+        for (x = encoder->refresh_start; x <= encoder->refresh_end; x++) {
+            encoder->quant_offsets[y * encoder->mb_width + x] = 0;
+        }
+    }
+}
+
+/* Only the lines touched by the damage are converted, the rest of the
+ * input picture still holds the previous frame */
+static void h264_encoder_convert(H264Encoder *encoder, const uint8_t *rgb, int stride,
+                                 uint8_t flags, const QRegion *damage)
+{
+    int n_pairs = encoder->height / 2;
+    pixman_box32_t *boxes;
+    int n_boxes;
+    int i, start;
+
+    if (damage == NULL || encoder->frame_num == 0) {
+        yuv_convert_bgrx_to_i420(rgb, stride, encoder->width, encoder->height,
+                                 0, encoder->height,
+                                 encoder->pic.img.plane, encoder->pic.img.i_stride);
+        return;
+    }
+
+    memset(encoder->dirty_row_pairs, 0, n_pairs);
+    boxes = pixman_region32_rectangles((pixman_region32_t *)damage, &n_boxes);
+    for (i = 0; i < n_boxes; i++) {
+        int top, bottom;
+
+        h264_encoder_box_lines(encoder, flags, &boxes[i], &top, &bottom);
+        top /= 2;
+        bottom = (bottom + 1) / 2;
+        if (top < bottom) {
+            memset(encoder->dirty_row_pairs + top, 1, bottom - top);
+        }
+    }
+
+    for (i = 0; i < n_pairs; i++) {
+        if (!encoder->dirty_row_pairs[i]) {
+            continue;
+        }
+        for (start = i; i < n_pairs && encoder->dirty_row_pairs[i]; i++);
+        yuv_convert_bgrx_to_i420(rgb, stride, encoder->width, encoder->height,
+                                 start * 2, (i - start) * 2,
+                                 encoder->pic.img.plane, encoder->pic.img.i_stride);
+    }
+}
+
+int h264_encoder_encode(H264Encoder *encoder, const uint8_t *rgb,
+                        int width, int height, int stride, uint8_t flags,
+                        const QRegion *damage, int refine,
+                        uint8_t **frame, int *frame_size)
+{
+    x264_picture_t pic_out;
+    x264_nal_t *nal;
+    int i_nal;
+    int size;
+    uint64_t start;
+
+    *frame = NULL;
+    *frame_size = 0;
+
+    if (width % 2 != 0 || height % 2 != 0) {
+        return 0;
+    }
+
+    if (width != encoder->width || height != encoder->height) {
+        if (!h264_encoder_reset(encoder, width, height)) {
+            return -1;
+        }
+    }
+
+    start = red_now();
+    h264_encoder_convert(encoder, rgb, stride, flags, damage);
+    encoder->convert_time += red_now() - start;
+
+    /* a keyframe request starts a new wave instead, the stream keeps
+     * its first IDR only */
+    if (encoder->intra_refresh) {
+        if (encoder->force_idr && encoder->frame_num != 0) {
+            x264_encoder_intra_refresh(encoder->x264);
+            encoder->refresh_queued = TRUE;
+            encoder->force_idr = FALSE;
+        }
+        h264_encoder_update_refresh(encoder);
+    }
+
+    encoder->pic.i_pts = encoder->frame_num;
+    encoder->pic.prop.quant_offsets = NULL;
+    encoder->pic.prop.quant_offsets_free = NULL;
+    /* a forced qp is a base the aq offsets still add to, as long as aq is
+     * on: outside the damage a refine frame codes at H264_REFINE_QP +
+     * H264_STATIC_MB_QP_OFFSET, and unchanged macroblocks are skipped */
+    encoder->pic.i_qpplus1 = refine ? H264_REFINE_QP + 1 : X264_QP_AUTO;
+    encoder->pic.i_type = encoder->force_idr ? X264_TYPE_IDR : X264_TYPE_AUTO;
+    /* the first frame of an encoder is an IDR and must be coded whole */
+    if (damage != NULL && encoder->frame_num != 0 && !encoder->force_idr) {
+        h264_encoder_fill_quant_offsets(encoder, flags, damage);
+        encoder->pic.prop.quant_offsets = encoder->quant_offsets;
+    }
+
+    if (encoder->slice_output) {
+        h264_encoder_reset_slices(encoder);
+    }
+    size = x264_encoder_encode(encoder->x264, &nal, &i_nal, &encoder->pic, &pic_out);
+    if (size < 0) {
+        spice_warning("x264 failed to encode a frame");
+        return -1;
+    }
+    encoder->frame_num++;
+    encoder->force_idr = FALSE;
+
+    if (encoder->slice_output) {
+        h264_encoder_finish_slices(encoder, frame, frame_size);
+    } else if (size > 0) {
+        /* x264 guarantees the payloads of a frame are contiguous */
+        *frame = nal[0].p_payload;
+        *frame_size = size;
+    }
+    return 0;
+}
+
+uint64_t h264_encoder_get_convert_time(H264Encoder *encoder)
+{
+    return encoder->convert_time;
+}
@@ -0,0 +1,115 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_H264_ENCODER
+#define _H_H264_ENCODER
+
+#include "red_common.h"
+#include "common/region.h"
+
+typedef struct H264Encoder H264Encoder;
+
+/*
+ * Where the coded slices go, so that they are written once, into buffers the
+ * consumer then sends as they are.
+ *
+ * get_buffer     : a buffer of at least size bytes to code a nal into
+ * put_slice      : buffer now holds size bytes of whole annex-b nals, and
+ *                  belongs to the consumer. last is set for the last slice of
+ *                  the frame, which is also returned as the frame and thus
+ *                  must stay valid until the next encode.
+ * release_buffer : give back a buffer that will not be put
+ */
+typedef struct H264SliceOutput {
+    uint8_t *(*get_buffer)(void *opaque, int size);
+    void (*put_slice)(void *opaque, uint8_t *buffer, int size, int last);
+    void (*release_buffer)(void *opaque, uint8_t *buffer);
+} H264SliceOutput;
+
+/*
+ * The encoder owns the x264 handle and the input picture. They are
+ * (re)allocated only when the frame size changes, so encoding a steady
+ * stream of frames performs no allocation.
+ *
+ * With SPICE_H264_INTRA_REFRESH=<frames> set, the stream has no IDR after its
+ * first frame: a column of intra macroblocks sweeps the picture every that
+ * many frames, each wave starting with a recovery point SEI. Frames stay
+ * about the same size, where IDRs burst well above the link.
+ */
+H264Encoder *h264_encoder_new(void);
+void h264_encoder_destroy(H264Encoder *encoder);
+
+/*
+ * Switch to bit rate (bits per second) targeted coding, with a vbv buffer of a
+ * couple of frames so that no frame bursts far above the link. Takes effect
+ * from the next frame, without an IDR when the encoder is already open.
+ * By default the encoder codes at constant quality.
+ */
+void h264_encoder_set_rate(H264Encoder *encoder, uint64_t bit_rate, uint32_t fps);
+
+/*
+ * Code each frame as several slices, straight into buffers of output, and put
+ * them as x264 finishes them, in picture order, so that they can go out while
+ * the rest of the frame is still encoding. output is called from the x264
+ * threads, one call at a time, and never after h264_encoder_encode()
+ * returned. Can only be set once. The encoder starts a new stream.
+ */
+void h264_encoder_set_slice_output(H264Encoder *encoder, const H264SliceOutput *output,
+                                   void *opaque);
+
+/* code the next frame as an IDR, whole whatever its damage. With intra
+ * refresh, start a new wave instead once the current one is over. */
+void h264_encoder_request_keyframe(H264Encoder *encoder);
+
+/*
+ * rgb     : 32bpp pixels of the frame, the first line is the top of the picture
+ * stride  : bytes per line of rgb
+ * flags   : SPICE_BITMAP_FLAGS_* of rgb. Without SPICE_BITMAP_FLAGS_TOP_DOWN its
+ *           lines are the surface lines bottom-up, as the worker hands its canvas
+ *           over.
+ * damage  : the part of the frame that changed since the previous call, or NULL
+ *           to code the whole frame. The region is in surface coordinates, i.e.
+ *           vertically mirrored with respect to rgb unless flags has
+ *           SPICE_BITMAP_FLAGS_TOP_DOWN.
+ * refine  : code the damage at a fixed low qp, whatever the rate control says.
+ *           For the still picture after motion stops, whose text would
+ *           otherwise stay at the quality it had mid-motion.
+ * frame   : set to the annex-b encoded frame. It points into the encoder, or to
+ *           the last slice put with a slice output, and is only valid until the
+ *           next call.
+ *
+ * return: 0 on success, -1 on failure. *frame_size is 0 if no frame was produced.
+ */
+int h264_encoder_encode(H264Encoder *encoder, const uint8_t *rgb,
+                        int width, int height, int stride, uint8_t flags,
+                        const QRegion *damage, int refine,
+                        uint8_t **frame, int *frame_size);
+
+/*
+ * With intra refresh, the columns the last frame coded intra whatever its
+ * damage, in canvas coordinates. Their pixels change slightly on the decoder
+ * side too.
+ *
+ * return: FALSE if the last frame refreshed none
+ */
+int h264_encoder_get_refresh_area(H264Encoder *encoder, SpiceRect *area);
+
+/* total time spent converting the frames to yuv, in ns */
+uint64_t h264_encoder_get_convert_time(H264Encoder *encoder);
+
+#endif
@@ -0,0 +1,128 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <time.h>
+
+#include "red_common.h"
+#include "spice_timer_queue.h"
+#include "h264_pacer.h"
+
+struct H264Pacer {
+    SpiceTimer *timer;
+    H264PacerTickFunc tick;
+    void *opaque;
+
+    uint32_t interval_ms;
+    uint32_t settle_delay_ms;
+    uint64_t last_frame_ms; /* when the last tick took a frame */
+    int has_last_frame;
+    int pending; /* damage kicked since the last frame */
+    int settle_pending;
+};
+
+static uint64_t h264_pacer_now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000 / 1000;
+}
+
+static uint32_t h264_pacer_settle_delay(H264Pacer *pacer)
+{
+    return MAX(pacer->settle_delay_ms, pacer->interval_ms);
+}
+
+/* (re)arm the timer for the frame tick, one interval after the last frame */
+static void h264_pacer_schedule_frame(H264Pacer *pacer)
+{
+    uint64_t now = h264_pacer_now_ms();
+    uint64_t due = pacer->has_last_frame ? pacer->last_frame_ms + pacer->interval_ms : now;
+
+    spice_timer_set(pacer->timer, due > now ? due - now : 0);
+}
+
+static void h264_pacer_timer_func(void *opaque)
+{
+    H264Pacer *pacer = opaque;
+
+    if (pacer->pending) {
+        if (!pacer->tick(pacer->opaque, FALSE)) {
+            spice_timer_set(pacer->timer, pacer->interval_ms);
+            return;
+        }
+        pacer->pending = FALSE;
+        pacer->settle_pending = TRUE;
+        pacer->last_frame_ms = h264_pacer_now_ms();
+        pacer->has_last_frame = TRUE;
+        spice_timer_set(pacer->timer, h264_pacer_settle_delay(pacer));
+    } else if (pacer->settle_pending) {
+        if (!pacer->tick(pacer->opaque, TRUE)) {
+            spice_timer_set(pacer->timer, pacer->interval_ms);
+            return;
+        }
+        pacer->settle_pending = FALSE;
+        pacer->last_frame_ms = h264_pacer_now_ms();
+        pacer->has_last_frame = TRUE;
+    }
+}
+
+H264Pacer *h264_pacer_new(uint32_t fps, uint32_t settle_delay_ms,
+                          H264PacerTickFunc tick, void *opaque)
+{
+    H264Pacer *pacer;
+
+    spice_return_val_if_fail(tick != NULL, NULL);
+
+    pacer = spice_new0(H264Pacer, 1);
+    pacer->timer = spice_timer_queue_add(h264_pacer_timer_func, pacer);
+    if (!pacer->timer) {
+        free(pacer);
+        return NULL;
+    }
+    pacer->tick = tick;
+    pacer->opaque = opaque;
+    pacer->settle_delay_ms = settle_delay_ms;
+    h264_pacer_set_fps(pacer, fps);
+    return pacer;
+}
+
+void h264_pacer_destroy(H264Pacer *pacer)
+{
+    spice_timer_remove(pacer->timer);
+    free(pacer);
+}
+
+void h264_pacer_set_fps(H264Pacer *pacer, uint32_t fps)
+{
+    pacer->interval_ms = 1000 / MAX(fps, 1);
+    /* a tick that is already armed keeps its time, the next one follows the new rate */
+}
+
+void h264_pacer_kick(H264Pacer *pacer)
+{
+    if (pacer->pending) {
+        /* coalesced into the frame tick that is already armed */
+        return;
+    }
+    pacer->pending = TRUE;
+    h264_pacer_schedule_frame(pacer);
+}
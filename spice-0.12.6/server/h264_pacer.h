@@ -0,0 +1,54 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_H264_PACER
+#define _H_H264_PACER
+
+#include "red_common.h"
+
+/*
+ * Decides when a client's next h264 frame is taken, on the worker's timer
+ * queue (monotonic clock).
+ *
+ * Damage only kicks the pacer; all the damage kicked before a tick goes into
+ * the frame of that tick, and ticks are at least 1/fps apart. When no
+ * damage came for settle_delay_ms, one more "settle" tick follows, so the
+ * last picture is always coded once more after the burst that produced it.
+ *
+ * Must be used from the thread of the timer queue.
+ */
+
+typedef struct H264Pacer H264Pacer;
+
+/*
+ * settle : TRUE for the trailing tick after the damage stopped
+ * return : FALSE if no frame could be taken now (e.g. the encoder or the
+ *          link is busy), the tick is retried one interval later
+ */
+typedef int (*H264PacerTickFunc)(void *opaque, int settle);
+
+H264Pacer *h264_pacer_new(uint32_t fps, uint32_t settle_delay_ms,
+                          H264PacerTickFunc tick, void *opaque);
+void h264_pacer_destroy(H264Pacer *pacer);
+
+void h264_pacer_set_fps(H264Pacer *pacer, uint32_t fps);
+
+/* new damage, a frame is due at the next tick */
+void h264_pacer_kick(H264Pacer *pacer);
+
+#endif
@@ -0,0 +1,735 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "red_common.h"
+#include "h264_pipeline.h"
+#include "video_encoder.h"
+
+/* frames given back, kept for reuse; beyond that they are freed */
+#define H264_FRAME_POOL_SIZE 16
+/* frame buffers grow by that much, so that frames whose size varies a bit
+ * reuse the same ones */
+#define H264_FRAME_ALIGN (16 * 1024)
+
+/* shared by the encoder thread, which takes frames, and the worker, which
+ * gives them back */
+typedef struct H264FramePool {
+    pthread_mutex_t lock;
+    int refs; /* the pipeline, and every frame out of the pool */
+    Ring free_frames; /* most recently given back first */
+    int n_free;
+} H264FramePool;
+
+typedef struct H264Snapshot {
+    /* owned by the encoder thread while busy */
+    uint8_t *pixels; /* packed, first line is the top of the picture */
+    int width;
+    int height;
+    uint32_t frame_id;
+    uint32_t surface_id;
+    uint8_t flags;
+    QRegion damage;
+    int has_damage;
+    int refine;
+    uint32_t generation;
+    int busy; /* protected by the pipeline lock */
+
+    /* worker only: damage that is not yet copied into pixels */
+    QRegion stale;
+} H264Snapshot;
+
+struct H264Pipeline {
+    H264PipelineCodec codec;
+    H264FramePool *pool;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int notify_fd[2];
+
+    H264Snapshot *snapshots;
+    int n_snapshots;
+
+    /* protected by lock */
+    int *queue; /* indices of the snapshots waiting for the encoder, oldest first */
+    int queue_head;
+    int queue_len;
+    Ring frames;
+    uint32_t generation;
+    uint64_t bit_rate;
+    uint32_t fps;
+    uint32_t rate_serial; /* bumped on every h264_pipeline_set_rate() */
+    int keyframe_requested;
+    int slices;
+    int quit;
+
+    /* encoder thread: the snapshot the slices belong to, how many of them
+     * were queued, and the last slice of the frame, once the codec put it */
+    H264Snapshot *encoding;
+    int queued_slices;
+    H264Frame *last_slice;
+};
+
+static H264FramePool *h264_frame_pool_new(void)
+{
+    H264FramePool *pool = spice_new0(H264FramePool, 1);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->refs = 1;
+    ring_init(&pool->free_frames);
+    return pool;
+}
+
+/* frame, if not NULL, is given back to the pool */
+static void h264_frame_pool_unref(H264FramePool *pool, H264Frame *frame)
+{
+    RingItem *item;
+    int refs;
+
+    pthread_mutex_lock(&pool->lock);
+    if (frame && pool->n_free < H264_FRAME_POOL_SIZE) {
+        ring_add(&pool->free_frames, &frame->link);
+        pool->n_free++;
+        frame = NULL;
+    }
+    refs = --pool->refs;
+    pthread_mutex_unlock(&pool->lock);
+    free(frame);
+    if (refs) {
+        return;
+    }
+
+    while ((item = ring_get_tail(&pool->free_frames))) {
+        ring_remove(item);
+        free(SPICE_CONTAINEROF(item, H264Frame, link));
+    }
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/* a frame with room for size bytes of data, the first one given back that
+ * is big enough */
+static H264Frame *h264_frame_pool_get(H264FramePool *pool, int size)
+{
+    H264Frame *frame = NULL;
+    H264Frame *oldest = NULL;
+    RingItem *item;
+
+    pthread_mutex_lock(&pool->lock);
+    RING_FOREACH(item, &pool->free_frames) {
+        H264Frame *free_frame = SPICE_CONTAINEROF(item, H264Frame, link);
+
+        if (free_frame->capacity >= size) {
+            frame = free_frame;
+            break;
+        }
+    }
+    if (frame) {
+        ring_remove(&frame->link);
+        pool->n_free--;
+    } else if ((item = ring_get_tail(&pool->free_frames))) {
+        /* none is big enough: the oldest makes room for a bigger one */
+        ring_remove(item);
+        pool->n_free--;
+        oldest = SPICE_CONTAINEROF(item, H264Frame, link);
+    }
+    pool->refs++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!frame) {
+        int capacity = (size + H264_FRAME_ALIGN - 1) & ~(H264_FRAME_ALIGN - 1);
+
+        free(oldest);
+        frame = spice_malloc(sizeof(H264Frame) + capacity);
+        frame->pool = pool;
+        frame->capacity = capacity;
+    }
+    ring_item_init(&frame->link);
+    frame->refs = 1;
+    frame->size = 0;
+    return frame;
+}
+
+H264Frame *h264_frame_ref(H264Frame *frame)
+{
+    frame->refs++;
+    return frame;
+}
+
+void h264_frame_unref(H264Frame *frame)
+{
+    if (--frame->refs == 0) {
+        h264_frame_pool_unref(frame->pool, frame);
+    }
+}
+
+/* The damage is in surface coordinates, and the lines of pixels are the
+ * surface lines bottom-up unless the frame is top down, see h264_encoder.h.
+ * Maps the lines [y1, y2) from one to the other, either way */
+static void h264_snapshot_map_lines(H264Snapshot *snapshot, int y1, int y2,
+                                    int *top, int *bottom)
+{
+    if (snapshot->flags & SPICE_BITMAP_FLAGS_TOP_DOWN) {
+        *top = y1;
+        *bottom = y2;
+    } else {
+        *top = snapshot->height - y2;
+        *bottom = snapshot->height - y1;
+    }
+}
+
+/* The decoded picture changes by whole macroblocks, and the deblocking
+ * filter reaches 3 pixels into the unchanged ones around: the area is
+ * grown to cover that, on the macroblock grid of the coded picture */
+static void h264_snapshot_add_dirty(H264Snapshot *snapshot, QRegion *region,
+                                    int x1, int y1, int x2, int y2)
+{
+    int left = MAX(x1 - 3, 0) & ~15;
+    int right = MIN((x2 + 3 + 15) & ~15, snapshot->width);
+    int top, bottom;
+    SpiceRect r;
+
+    h264_snapshot_map_lines(snapshot, y1, y2, &top, &bottom);
+    top = MAX(top - 3, 0) & ~15;
+    bottom = MIN((bottom + 3 + 15) & ~15, snapshot->height);
+    if (left >= right || top >= bottom) {
+        return;
+    }
+    r.left = left;
+    r.right = right;
+    h264_snapshot_map_lines(snapshot, top, bottom, &top, &bottom);
+    r.top = top;
+    r.bottom = bottom;
+    region_add(region, &r);
+}
+
+/* refresh: the area the codec refreshed outside the damage, or NULL */
+static void h264_snapshot_get_dirty(H264Snapshot *snapshot, const SpiceRect *refresh,
+                                    H264Frame *frame)
+{
+    SpiceClipRects *dirty = &frame->dirty_space.rects;
+    pixman_box32_t *boxes;
+    QRegion region;
+    int n_boxes;
+    int i;
+
+    region_init(&region);
+    boxes = pixman_region32_rectangles(&snapshot->damage, &n_boxes);
+    for (i = 0; i < n_boxes; i++) {
+        h264_snapshot_add_dirty(snapshot, &region,
+                                boxes[i].x1, boxes[i].y1, boxes[i].x2, boxes[i].y2);
+    }
+    if (refresh) {
+        h264_snapshot_add_dirty(snapshot, &region,
+                                refresh->left, refresh->top, refresh->right, refresh->bottom);
+    }
+
+    n_boxes = pixman_region32_n_rects(&region);
+    if (n_boxes > H264_MAX_DIRTY_RECTS) {
+        dirty->num_rects = 1;
+        region_extents(&region, &dirty->rects[0]);
+    } else {
+        dirty->num_rects = n_boxes;
+        region_ret_rects(&region, dirty->rects, n_boxes);
+    }
+    region_destroy(&region);
+    frame->dirty = dirty;
+}
+
+static void h264_frame_init(H264Frame *frame, H264Snapshot *snapshot, int size)
+{
+    frame->frame_id = snapshot->frame_id;
+    frame->surface_id = snapshot->surface_id;
+    frame->width = snapshot->width;
+    frame->height = snapshot->height;
+    frame->flags = snapshot->flags;
+    frame->slice = FALSE;
+    frame->dirty = NULL;
+    frame->size = size;
+}
+
+/* lock held: frames of a snapshot taken before a reset are dropped */
+static int h264_pipeline_queue_frame(H264Pipeline *pipeline, H264Frame *frame,
+                                     uint32_t generation)
+{
+    uint8_t notify = 0;
+
+    if (generation != pipeline->generation) {
+        h264_frame_unref(frame);
+        return FALSE;
+    }
+    ring_add(&pipeline->frames, &frame->link);
+    /* a full pipe means the worker has a wakeup pending already */
+    if (write(pipeline->notify_fd[1], &notify, 1) < 0 && errno != EAGAIN) {
+        spice_warning("failed to notify the worker, %s", strerror(errno));
+    }
+    return TRUE;
+}
+
+/* The slice output of the codec, called from its threads while the snapshot
+ * encodes: the slices are coded straight into frames of the pool */
+static uint8_t *h264_pipeline_get_buffer(void *opaque, int size)
+{
+    H264Pipeline *pipeline = opaque;
+
+    return h264_frame_pool_get(pipeline->pool, size)->data;
+}
+
+static void h264_pipeline_put_slice(void *opaque, uint8_t *buffer, int size, int last)
+{
+    H264Pipeline *pipeline = opaque;
+    H264Frame *frame = SPICE_CONTAINEROF(buffer, H264Frame, data);
+
+    h264_frame_init(frame, pipeline->encoding, size);
+    /* completes the frame, once the codec is done with it */
+    if (last) {
+        pipeline->last_slice = frame;
+        return;
+    }
+    frame->slice = TRUE;
+    pthread_mutex_lock(&pipeline->lock);
+    if (h264_pipeline_queue_frame(pipeline, frame, pipeline->encoding->generation)) {
+        pipeline->queued_slices++;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void h264_pipeline_release_buffer(void *opaque, uint8_t *buffer)
+{
+    h264_frame_unref(SPICE_CONTAINEROF(buffer, H264Frame, data));
+}
+
+static const H264SliceOutput h264_pipeline_slice_output = {
+    .get_buffer = h264_pipeline_get_buffer,
+    .put_slice = h264_pipeline_put_slice,
+    .release_buffer = h264_pipeline_release_buffer,
+};
+
+static void h264_pipeline_drop_last_slice(H264Pipeline *pipeline)
+{
+    if (pipeline->last_slice) {
+        h264_frame_unref(pipeline->last_slice);
+        pipeline->last_slice = NULL;
+    }
+}
+
+/*
+ * The frame failed after some of its leading slices were queued: the ones
+ * the worker did not take yet are dropped, they are the most recent frames
+ * of the ring. The client may have some already, whatever it decodes of
+ * them is replaced by the keyframe that comes next.
+ */
+static void h264_pipeline_drop_slices(H264Pipeline *pipeline)
+{
+    RingItem *item;
+
+    h264_pipeline_drop_last_slice(pipeline);
+    if (!pipeline->queued_slices) {
+        return;
+    }
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->queued_slices && (item = ring_get_head(&pipeline->frames))) {
+        ring_remove(item);
+        h264_frame_unref(SPICE_CONTAINEROF(item, H264Frame, link));
+        pipeline->queued_slices--;
+    }
+    pipeline->queued_slices = 0;
+    pipeline->keyframe_requested = TRUE;
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static H264Frame *h264_pipeline_encode(H264Pipeline *pipeline, void *codec,
+                                       H264Snapshot *snapshot)
+{
+    H264Frame *frame;
+    SpiceRect refresh;
+    int has_refresh;
+    uint8_t *data;
+    int size;
+
+    pipeline->encoding = snapshot;
+    pipeline->queued_slices = 0;
+    if (pipeline->codec.encode(codec, snapshot->pixels, snapshot->width, snapshot->height,
+                               snapshot->width * 4, snapshot->flags,
+                               snapshot->has_damage ? &snapshot->damage : NULL,
+                               snapshot->refine,
+                               &data, &size) != 0) {
+        spice_warning("failed to encode a h264 frame");
+        h264_pipeline_drop_slices(pipeline);
+        return NULL;
+    }
+    if (size <= 0) {
+        h264_pipeline_drop_slices(pipeline);
+        return NULL;
+    }
+    has_refresh = pipeline->codec.get_refresh_area &&
+                  pipeline->codec.get_refresh_area(codec, &refresh);
+
+    if (pipeline->last_slice && pipeline->last_slice->data == data) {
+        frame = pipeline->last_slice;
+        pipeline->last_slice = NULL;
+    } else {
+        /* coded whole, into the buffer of the codec */
+        h264_pipeline_drop_last_slice(pipeline);
+        frame = h264_frame_pool_get(pipeline->pool, size);
+        h264_frame_init(frame, snapshot, size);
+        memcpy(frame->data, data, size);
+    }
+    /* keyframes code the whole picture */
+    if (snapshot->has_damage && !video_encoder_frame_is_keyframe(data, size)) {
+        h264_snapshot_get_dirty(snapshot, has_refresh ? &refresh : NULL, frame);
+    }
+    return frame;
+}
+
+static void *h264_pipeline_thread(void *opaque)
+{
+    H264Pipeline *pipeline = opaque;
+    H264Snapshot *snapshot;
+    H264Frame *frame;
+    void *codec = NULL;
+    uint32_t codec_generation = 0;
+    uint32_t codec_rate_serial = 0;
+    uint64_t bit_rate;
+    uint32_t fps;
+    uint32_t rate_serial;
+    int keyframe;
+    int slices;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (;;) {
+        while (!pipeline->quit && pipeline->queue_len == 0) {
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+        }
+        if (pipeline->quit) {
+            break;
+        }
+        snapshot = &pipeline->snapshots[pipeline->queue[pipeline->queue_head]];
+        pipeline->queue_head = (pipeline->queue_head + 1) % pipeline->n_snapshots;
+        pipeline->queue_len--;
+        bit_rate = pipeline->bit_rate;
+        fps = pipeline->fps;
+        rate_serial = pipeline->rate_serial;
+        keyframe = pipeline->keyframe_requested;
+        pipeline->keyframe_requested = FALSE;
+        slices = pipeline->slices;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        /* a reset asks for a fresh codec, i.e. an IDR */
+        if (codec && codec_generation != snapshot->generation) {
+            pipeline->codec.destroy(codec);
+            codec = NULL;
+        }
+        if (!codec) {
+            codec = pipeline->codec.create();
+            codec_generation = snapshot->generation;
+            codec_rate_serial = 0;
+            if (codec && slices && pipeline->codec.set_slice_output) {
+                pipeline->codec.set_slice_output(codec, &h264_pipeline_slice_output, pipeline);
+            }
+        }
+        if (codec && rate_serial != codec_rate_serial && pipeline->codec.set_rate) {
+            pipeline->codec.set_rate(codec, bit_rate, fps);
+            codec_rate_serial = rate_serial;
+        }
+        if (codec && keyframe && pipeline->codec.request_keyframe) {
+            pipeline->codec.request_keyframe(codec);
+        }
+        frame = codec ? h264_pipeline_encode(pipeline, codec, snapshot) : NULL;
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (frame) {
+            h264_pipeline_queue_frame(pipeline, frame, snapshot->generation);
+        }
+        snapshot->busy = FALSE;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    if (codec) {
+        pipeline->codec.destroy(codec);
+    }
+    return NULL;
+}
+
+H264Pipeline *h264_pipeline_new(const H264PipelineCodec *codec, int max_pending)
+{
+    H264Pipeline *pipeline;
+    int i;
+
+    spice_return_val_if_fail(max_pending > 0, NULL);
+
+    pipeline = spice_new0(H264Pipeline, 1);
+    pipeline->codec = *codec;
+    pipeline->pool = h264_frame_pool_new();
+    pipeline->n_snapshots = max_pending;
+    pipeline->snapshots = spice_new0(H264Snapshot, max_pending);
+    pipeline->queue = spice_new0(int, max_pending);
+    for (i = 0; i < max_pending; i++) {
+        region_init(&pipeline->snapshots[i].damage);
+        region_init(&pipeline->snapshots[i].stale);
+    }
+    ring_init(&pipeline->frames);
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+
+    if (pipe(pipeline->notify_fd) == -1) {
+        spice_warning("pipe failed, %s", strerror(errno));
+        goto error;
+    }
+    for (i = 0; i < 2; i++) {
+        if (fcntl(pipeline->notify_fd[i], F_SETFL, O_NONBLOCK) == -1) {
+            spice_warning("fcntl failed, %s", strerror(errno));
+            goto error_pipe;
+        }
+    }
+
+    if ((i = pthread_create(&pipeline->thread, NULL, h264_pipeline_thread, pipeline))) {
+        spice_warning("create h264 encoder thread failed %d", i);
+        goto error_pipe;
+    }
+    return pipeline;
+
+error_pipe:
+    close(pipeline->notify_fd[0]);
+    close(pipeline->notify_fd[1]);
+error:
+    for (i = 0; i < max_pending; i++) {
+        region_destroy(&pipeline->snapshots[i].damage);
+        region_destroy(&pipeline->snapshots[i].stale);
+    }
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->lock);
+    h264_frame_pool_unref(pipeline->pool, NULL);
+    free(pipeline->queue);
+    free(pipeline->snapshots);
+    free(pipeline);
+    return NULL;
+}
+
+static void h264_pipeline_drop_frames(H264Pipeline *pipeline)
+{
+    RingItem *item;
+
+    while ((item = ring_get_tail(&pipeline->frames))) {
+        ring_remove(item);
+        h264_frame_unref(SPICE_CONTAINEROF(item, H264Frame, link));
+    }
+}
+
+void h264_pipeline_destroy(H264Pipeline *pipeline)
+{
+    int i;
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->quit = TRUE;
+    pthread_cond_signal(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+    pthread_join(pipeline->thread, NULL);
+
+    h264_pipeline_drop_frames(pipeline);
+    close(pipeline->notify_fd[0]);
+    close(pipeline->notify_fd[1]);
+    for (i = 0; i < pipeline->n_snapshots; i++) {
+        free(pipeline->snapshots[i].pixels);
+        region_destroy(&pipeline->snapshots[i].damage);
+        region_destroy(&pipeline->snapshots[i].stale);
+    }
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->lock);
+    /* the frames the clients still hold keep it */
+    h264_frame_pool_unref(pipeline->pool, NULL);
+    free(pipeline->queue);
+    free(pipeline->snapshots);
+    free(pipeline);
+}
+
+void h264_pipeline_enable_slices(H264Pipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->slices = TRUE;
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+int h264_pipeline_get_fd(H264Pipeline *pipeline)
+{
+    return pipeline->notify_fd[0];
+}
+
+static void h264_snapshot_copy_stale(H264Snapshot *snapshot, const uint8_t *rgb, int stride)
+{
+    pixman_box32_t *boxes;
+    int n_boxes;
+    int last_y1 = -1;
+    int last_y2 = -1;
+    int line_size = snapshot->width * 4;
+    int i, y;
+
+    boxes = pixman_region32_rectangles(&snapshot->stale, &n_boxes);
+    for (i = 0; i < n_boxes; i++) {
+        int top, bottom;
+
+        /* the boxes of a band share their lines */
+        if (boxes[i].y1 == last_y1 && boxes[i].y2 == last_y2) {
+            continue;
+        }
+        last_y1 = boxes[i].y1;
+        last_y2 = boxes[i].y2;
+
+        h264_snapshot_map_lines(snapshot, boxes[i].y1, boxes[i].y2, &top, &bottom);
+        top = MAX(top, 0);
+        bottom = MIN(bottom, snapshot->height);
+        for (y = top; y < bottom; y++) {
+            memcpy(snapshot->pixels + y * line_size, rgb + y * stride, line_size);
+        }
+    }
+    region_clear(&snapshot->stale);
+}
+
+int h264_pipeline_submit(H264Pipeline *pipeline, uint32_t frame_id, uint32_t surface_id,
+                         const uint8_t *rgb, int width, int height, int stride,
+                         uint8_t flags, const QRegion *damage, int refine)
+{
+    H264Snapshot *snapshot = NULL;
+    SpiceRect all = {0, 0, width, height};
+    int i;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (i = 0; i < pipeline->n_snapshots; i++) {
+        if (!pipeline->snapshots[i].busy) {
+            snapshot = &pipeline->snapshots[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    if (!snapshot) {
+        return FALSE;
+    }
+
+    if (damage) {
+        for (i = 0; i < pipeline->n_snapshots; i++) {
+            region_or(&pipeline->snapshots[i].stale, damage);
+        }
+    }
+    if (snapshot->width != width || snapshot->height != height) {
+        free(snapshot->pixels);
+        snapshot->pixels = spice_malloc_n(width * 4, height);
+        snapshot->width = width;
+        snapshot->height = height;
+        region_clear(&snapshot->stale);
+        region_add(&snapshot->stale, &all);
+    } else if (!damage || snapshot->flags != flags) {
+        /* the stale lines of other flags are elsewhere in pixels */
+        region_add(&snapshot->stale, &all);
+    }
+    snapshot->flags = flags;
+    h264_snapshot_copy_stale(snapshot, rgb, stride);
+
+    snapshot->frame_id = frame_id;
+    snapshot->surface_id = surface_id;
+    region_clear(&snapshot->damage);
+    if (damage) {
+        region_or(&snapshot->damage, damage);
+    }
+    snapshot->has_damage = damage != NULL;
+    snapshot->refine = refine;
+
+    pthread_mutex_lock(&pipeline->lock);
+    snapshot->busy = TRUE;
+    snapshot->generation = pipeline->generation;
+    pipeline->queue[(pipeline->queue_head + pipeline->queue_len) % pipeline->n_snapshots] =
+        snapshot - pipeline->snapshots;
+    pipeline->queue_len++;
+    pthread_cond_signal(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+    return TRUE;
+}
+
+void h264_pipeline_set_rate(H264Pipeline *pipeline, uint64_t bit_rate, uint32_t fps)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->bit_rate = bit_rate;
+    pipeline->fps = fps;
+    /* 0 stands for "never set" on the encoder thread */
+    if (++pipeline->rate_serial == 0) {
+        pipeline->rate_serial = 1;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+int h264_pipeline_get_pending(H264Pipeline *pipeline)
+{
+    int pending = 0;
+    int i;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (i = 0; i < pipeline->n_snapshots; i++) {
+        pending += pipeline->snapshots[i].busy;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return pending;
+}
+
+void h264_pipeline_request_keyframe(H264Pipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->keyframe_requested = TRUE;
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static void h264_pipeline_drain_fd(H264Pipeline *pipeline)
+{
+    uint8_t buf[64];
+
+    while (read(pipeline->notify_fd[0], buf, sizeof(buf)) > 0);
+}
+
+H264Frame *h264_pipeline_get_frame(H264Pipeline *pipeline)
+{
+    RingItem *item;
+
+    h264_pipeline_drain_fd(pipeline);
+    pthread_mutex_lock(&pipeline->lock);
+    item = ring_get_tail(&pipeline->frames);
+    if (item) {
+        ring_remove(item);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return item ? SPICE_CONTAINEROF(item, H264Frame, link) : NULL;
+}
+
+void h264_pipeline_reset(H264Pipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->generation++;
+    while (pipeline->queue_len) {
+        pipeline->snapshots[pipeline->queue[pipeline->queue_head]].busy = FALSE;
+        pipeline->queue_head = (pipeline->queue_head + 1) % pipeline->n_snapshots;
+        pipeline->queue_len--;
+    }
+    h264_pipeline_drop_frames(pipeline);
+    pthread_mutex_unlock(&pipeline->lock);
+    h264_pipeline_drain_fd(pipeline);
+}
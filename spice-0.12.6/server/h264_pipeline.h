@@ -0,0 +1,141 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_H264_PIPELINE
+#define _H_H264_PIPELINE
+
+#include "red_common.h"
+#include "common/region.h"
+#include "common/ring.h"
+#include "h264_encoder.h"
+
+/*
+ * Runs the h264 codec on a dedicated thread, so that the red worker never
+ * waits for an encode.
+ *
+ * The worker submits snapshots of the surface, at most max_pending of them
+ * can be queued or encoding at a time. Encoded frames are queued back and
+ * the pipeline fd becomes readable; the worker then collects them with
+ * h264_pipeline_get_frame() and pushes them to its clients.
+ *
+ * Frames come from a pool of the pipeline and are coded straight into it
+ * when the codec supports a slice output, so that a frame is written once
+ * and sent from there. The pool keeps the buffers of the frames released,
+ * which makes a steady stream of frames allocation free.
+ *
+ * All the functions are called from the worker thread.
+ */
+
+typedef struct H264Pipeline H264Pipeline;
+
+/* beyond that, the client redraws the bounding box of the damage */
+#define H264_MAX_DIRTY_RECTS 64
+
+/* The codec state is created, used and destroyed on the encoder thread only */
+typedef struct H264PipelineCodec {
+    void *(*create)(void);
+    /* same contract as h264_encoder_encode() */
+    int (*encode)(void *codec, const uint8_t *rgb, int width, int height, int stride,
+                  uint8_t flags, const QRegion *damage, int refine,
+                  uint8_t **frame, int *frame_size);
+    void (*destroy)(void *codec);
+    /* optional, bit_rate in bits per second */
+    void (*set_rate)(void *codec, uint64_t bit_rate, uint32_t fps);
+    /* the next frame is an IDR */
+    void (*request_keyframe)(void *codec);
+    /* optional, see video_encoder_get_refresh_area() */
+    int (*get_refresh_area)(void *codec, SpiceRect *area);
+    /* optional, see video_encoder_set_slice_output() */
+    void (*set_slice_output)(void *codec, const H264SliceOutput *output, void *opaque);
+} H264PipelineCodec;
+
+typedef struct H264Frame {
+    RingItem link;
+    int refs;
+    uint32_t frame_id; /* as submitted */
+    uint32_t surface_id;
+    int width;
+    int height;
+    uint8_t flags;
+    /* leading slices of the next frame that is not a slice, which holds the
+     * rest of the picture; they are queued while it still encodes */
+    int slice;
+    /* the area of the surface the frame changes, NULL for the whole picture.
+     * Points into dirty_space. */
+    SpiceClipRects *dirty;
+    union {
+        SpiceClipRects rects;
+        uint8_t space[sizeof(SpiceClipRects) + H264_MAX_DIRTY_RECTS * sizeof(SpiceRect)];
+    } dirty_space;
+    struct H264FramePool *pool; /* private */
+    int capacity;
+    int size;
+    uint8_t data[0];
+} H264Frame;
+
+H264Pipeline *h264_pipeline_new(const H264PipelineCodec *codec, int max_pending);
+void h264_pipeline_destroy(H264Pipeline *pipeline);
+
+/* Queue the slices of the frames as they are coded, when the codec can.
+ * Call it before the first h264_pipeline_submit(). */
+void h264_pipeline_enable_slices(H264Pipeline *pipeline);
+
+/* readable when encoded frames are waiting to be collected */
+int h264_pipeline_get_fd(H264Pipeline *pipeline);
+
+/*
+ * Copy the frame and queue it for encoding.
+ *
+ * rgb/stride/flags/damage/refine are as for h264_encoder_encode(). Only the lines that
+ * changed since the snapshot buffer was last used are copied. frame_id is
+ * handed back in the frame, for the caller to find what it keeps about it.
+ *
+ * return: FALSE if max_pending snapshots are already in flight, the caller
+ *         should keep its damage and submit again later.
+ */
+int h264_pipeline_submit(H264Pipeline *pipeline, uint32_t frame_id, uint32_t surface_id,
+                         const uint8_t *rgb, int width, int height, int stride,
+                         uint8_t flags, const QRegion *damage, int refine);
+
+/* Target rate of the frames encoded from now on, it also applies to codec
+ * states created by later resets */
+void h264_pipeline_set_rate(H264Pipeline *pipeline, uint64_t bit_rate, uint32_t fps);
+
+/* the number of snapshots submitted and not encoded yet, at most max_pending */
+int h264_pipeline_get_pending(H264Pipeline *pipeline);
+
+/* returns the next encoded frame, with a reference owned by the caller, or NULL */
+H264Frame *h264_pipeline_get_frame(H264Pipeline *pipeline);
+
+/* The next frame encoded is an IDR. Unlike h264_pipeline_reset(), the frames
+ * in flight are kept and the codec state is not rebuilt */
+void h264_pipeline_request_keyframe(H264Pipeline *pipeline);
+
+/*
+ * Drop the queued snapshots and the frames not collected yet, and start over
+ * with a new codec state, i.e. the next frame is an IDR. A frame that is
+ * being encoded at the time of the call is discarded when it completes.
+ */
+void h264_pipeline_reset(H264Pipeline *pipeline);
+
+/* Frames are only referenced from the worker thread. The last reference gives
+ * the frame back to the pool, which may outlive its pipeline. */
+H264Frame *h264_frame_ref(H264Frame *frame);
+void h264_frame_unref(H264Frame *frame);
+
+#endif
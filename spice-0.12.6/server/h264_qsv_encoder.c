@@ -0,0 +1,533 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <mfx/mfxvideo.h>
+
+#include "red_common.h"
+#include "video_encoder.h"
+
+/*
+ * The Intel Media SDK backend: the frame is uploaded as RGB4, converted to
+ * NV12 by the VPP and encoded by the gpu, all in video memory.
+ */
+
+#define MSDK_SLEEP(X)                   { usleep(1000*(X)); }
+
+#define MSDK_PRINT_RET_MSG(ERR)         {PrintErrString(ERR, __FILE__, __LINE__);}
+#define MSDK_CHECK_RESULT(P, X, ERR)    {if ((X) > (P)) {MSDK_PRINT_RET_MSG(ERR); return ERR;}}
+#define MSDK_CHECK_POINTER(P, ERR)      {if (!(P)) {MSDK_PRINT_RET_MSG(ERR); return ERR;}}
+#define MSDK_CHECK_ERROR(P, X, ERR)     {if ((X) == (P)) {MSDK_PRINT_RET_MSG(ERR); return ERR;}}
+#define MSDK_IGNORE_MFX_STS(P, X)       {if ((X) == (P)) {P = MFX_ERR_NONE;}}
+#define MSDK_BREAK_ON_ERROR(P)          {if (MFX_ERR_NONE != (P)) break;}
+
+#define MSDK_ALIGN32(X)                 (((mfxU32)((X)+31)) & (~ (mfxU32)31))
+#define MSDK_ALIGN16(value)             (((value + 15) >> 4) << 4)
+
+#define H264_QSV_DEFAULT_KBPS 6000
+#define H264_QSV_FPS 30
+
+/* from common_utils.cpp, whose header is C++ only */
+void PrintErrString(int err, const char *filestr, int line);
+mfxStatus LoadRawRGBFrameFromRGB(mfxFrameSurface1 *pSurface, const unsigned char *rgb,
+                                 const int size);
+void ClearRGBSurfaceVMem(mfxMemId memId);
+int GetFreeSurfaceIndex(mfxFrameSurface1 **pSurfacesPool, mfxU16 nPoolSize);
+mfxStatus Initialize(mfxIMPL impl, mfxVersion ver, mfxSession *pSession,
+                     mfxFrameAllocator *pmfxAllocator, bool bCreateSharedHandles);
+void Release(void);
+
+typedef struct {
+    mfxSession session;
+
+    mfxFrameAllocator mfxAllocator;
+
+    mfxU16 nSurfNumVPPIn;
+    mfxU16 nSurfNumVPPOutEnc;
+
+    mfxFrameAllocResponse mfxResponseVPPIn;
+    mfxFrameAllocResponse mfxResponseVPPOutEnc;
+
+    mfxFrameSurface1** pmfxSurfacesVPPIn;
+    mfxFrameSurface1** pVPPSurfacesVPPOutEnc;
+
+    mfxBitstream mfxBS;
+
+    int width;
+    int height;
+    mfxU16 target_kbps;
+} h264_qsv_ctx;
+
+static int h264_qsv_encoder_init(h264_qsv_ctx **pctx, const int width, const int height,
+                          const mfxU16 target_kbps)
+{
+    mfxStatus sts;
+    int i;
+    h264_qsv_ctx *pCtx;
+
+    sts = MFX_ERR_NONE;
+
+    pCtx = malloc(sizeof(h264_qsv_ctx));
+    MSDK_CHECK_POINTER(pCtx, MFX_ERR_MEMORY_ALLOC);
+    *pctx = pCtx;
+    pCtx->width = width;
+    pCtx->height = height;
+    pCtx->target_kbps = target_kbps;
+
+    // Initialize Intel Media SDK pCtx->session
+    // - MFX_IMPL_AUTO_ANY selects HW acceleration if available (on any adapter)
+    mfxIMPL impl = MFX_IMPL_AUTO_ANY;
+    mfxVersion ver = { {0, 1} };
+    sts = Initialize(impl, ver, &pCtx->session, &pCtx->mfxAllocator, false);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    // Initialize encoder parameters
+    // - In this example we are encoding an AVC (H.264) stream
+    mfxVideoParam mfxEncParams;
+    memset(&mfxEncParams, 0, sizeof(mfxEncParams));
+    mfxEncParams.mfx.CodecId = MFX_CODEC_AVC;
+    mfxEncParams.mfx.TargetUsage = MFX_TARGETUSAGE_BEST_SPEED;
+    //mfxEncParams.mfx.TargetUsage = MFX_TARGETUSAGE_BALANCED;
+    mfxEncParams.mfx.TargetKbps = target_kbps;
+    mfxEncParams.mfx.RateControlMethod = MFX_RATECONTROL_VBR;
+    mfxEncParams.mfx.FrameInfo.FrameRateExtN = H264_QSV_FPS;
+    mfxEncParams.mfx.FrameInfo.FrameRateExtD = 1;
+    mfxEncParams.mfx.FrameInfo.FourCC = MFX_FOURCC_NV12;
+    mfxEncParams.mfx.FrameInfo.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
+    mfxEncParams.mfx.FrameInfo.PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
+    mfxEncParams.mfx.FrameInfo.CropX = 0;
+    mfxEncParams.mfx.FrameInfo.CropY = 0;
+    mfxEncParams.mfx.FrameInfo.CropW = width;
+    mfxEncParams.mfx.FrameInfo.CropH = height;
+    // Width must be a multiple of 16
+    // Height must be a multiple of 16 in case of frame picture and a multiple of 32 in case of field picture
+    mfxEncParams.mfx.FrameInfo.Width = MSDK_ALIGN16(width);
+    mfxEncParams.mfx.FrameInfo.Height =
+        (MFX_PICSTRUCT_PROGRESSIVE == mfxEncParams.mfx.FrameInfo.PicStruct) ?
+        MSDK_ALIGN16(height) :
+        MSDK_ALIGN32(height);
+
+    mfxEncParams.IOPattern = MFX_IOPATTERN_IN_VIDEO_MEMORY;
+
+    // Configuration for low latency
+    mfxEncParams.AsyncDepth = 1;    //1 is best for low latency
+    mfxEncParams.mfx.GopRefDist = 1;        //1 is best for low latency, I and P frames only
+
+    mfxExtCodingOption extendedCodingOptions;
+    memset(&extendedCodingOptions, 0, sizeof(extendedCodingOptions));
+    extendedCodingOptions.Header.BufferId = MFX_EXTBUFF_CODING_OPTION;
+    extendedCodingOptions.Header.BufferSz = sizeof(extendedCodingOptions);
+    extendedCodingOptions.MaxDecFrameBuffering = 1;
+    mfxExtBuffer* extendedBuffers[1];
+    extendedBuffers[0] = (mfxExtBuffer*) & extendedCodingOptions;
+    mfxEncParams.ExtParam = extendedBuffers;
+    mfxEncParams.NumExtParam = 1;
+
+    // Validate video encode parameters (optional)
+    // - In this example the validation result is written to same structure
+    // - MFX_WRN_INCOMPATIBLE_VIDEO_PARAM is returned if some of the video parameters are not supported,
+    //   instead the encoder will select suitable parameters closest matching the requested configuration
+    sts = MFXVideoENCODE_Query(pCtx->session, &mfxEncParams, &mfxEncParams);
+    MSDK_IGNORE_MFX_STS(sts, MFX_WRN_INCOMPATIBLE_VIDEO_PARAM);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    // Initialize VPP parameters
+    mfxVideoParam VPPParams;
+    memset(&VPPParams, 0, sizeof(VPPParams));
+    // Input data
+    VPPParams.vpp.In.FourCC = MFX_FOURCC_RGB4;
+    VPPParams.vpp.In.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
+    VPPParams.vpp.In.CropX = 0;
+    VPPParams.vpp.In.CropY = 0;
+    VPPParams.vpp.In.CropW = width;
+    VPPParams.vpp.In.CropH = height;
+    VPPParams.vpp.In.PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
+    VPPParams.vpp.In.FrameRateExtN = 30;
+    VPPParams.vpp.In.FrameRateExtD = 1;
+    // width must be a multiple of 16
+    // height must be a multiple of 16 in case of frame picture and a multiple of 32 in case of field picture
+    VPPParams.vpp.In.Width = MSDK_ALIGN16(width);
+    VPPParams.vpp.In.Height =
+        (MFX_PICSTRUCT_PROGRESSIVE == VPPParams.vpp.In.PicStruct) ?
+        MSDK_ALIGN16(height) :
+        MSDK_ALIGN32(height);
+    // Output data
+    VPPParams.vpp.Out.FourCC = MFX_FOURCC_NV12;
+    VPPParams.vpp.Out.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
+    VPPParams.vpp.Out.CropX = 0;
+    VPPParams.vpp.Out.CropY = 0;
+    VPPParams.vpp.Out.CropW = width;
+    VPPParams.vpp.Out.CropH = height;
+    VPPParams.vpp.Out.PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
+    VPPParams.vpp.Out.FrameRateExtN = 30;
+    VPPParams.vpp.Out.FrameRateExtD = 1;
+    // width must be a multiple of 16
+    // height must be a multiple of 16 in case of frame picture and a multiple of 32 in case of field picture
+    VPPParams.vpp.Out.Width = MSDK_ALIGN16(VPPParams.vpp.Out.CropW);
+    VPPParams.vpp.Out.Height =
+        (MFX_PICSTRUCT_PROGRESSIVE == VPPParams.vpp.Out.PicStruct) ?
+        MSDK_ALIGN16(VPPParams.vpp.Out.CropH) :
+        MSDK_ALIGN32(VPPParams.vpp.Out.CropH);
+
+    VPPParams.IOPattern = MFX_IOPATTERN_IN_VIDEO_MEMORY | MFX_IOPATTERN_OUT_VIDEO_MEMORY;
+
+    // Query number of required surfaces for encoder
+    mfxFrameAllocRequest EncRequest;
+    memset(&EncRequest, 0, sizeof(EncRequest));
+    sts = MFXVideoENCODE_QueryIOSurf(pCtx->session, &mfxEncParams, &EncRequest);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    // Query number of required surfaces for VPP
+    mfxFrameAllocRequest VPPRequest[2];     // [0] - in, [1] - out
+    memset(&VPPRequest, 0, sizeof(mfxFrameAllocRequest) * 2);
+    sts = MFXVideoVPP_QueryIOSurf(pCtx->session, &VPPParams, VPPRequest);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    EncRequest.Type |= MFX_MEMTYPE_FROM_VPPOUT;     // surfaces are shared between VPP output and encode input
+
+    // Determine the required number of surfaces for VPP input and for VPP output (encoder input)
+    pCtx->nSurfNumVPPIn = VPPRequest[0].NumFrameSuggested;
+    pCtx->nSurfNumVPPOutEnc = EncRequest.NumFrameSuggested + VPPRequest[1].NumFrameSuggested;
+
+    EncRequest.NumFrameSuggested = pCtx->nSurfNumVPPOutEnc;
+
+    // Allocate required surfaces
+    sts = pCtx->mfxAllocator.Alloc(pCtx->mfxAllocator.pthis, &VPPRequest[0], &pCtx->mfxResponseVPPIn);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+    sts = pCtx->mfxAllocator.Alloc(pCtx->mfxAllocator.pthis, &EncRequest, &pCtx->mfxResponseVPPOutEnc);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    // Allocate required surfaces
+    mfxFrameAllocResponse mfxResponse ;
+    sts = pCtx->mfxAllocator.Alloc(pCtx->mfxAllocator.pthis, &EncRequest, &mfxResponse);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    // Allocate surface headers (mfxFrameSurface1) for VPPIn
+    pCtx->pmfxSurfacesVPPIn = (mfxFrameSurface1**)malloc(sizeof(mfxFrameSurface1*) * pCtx->nSurfNumVPPIn);
+    MSDK_CHECK_POINTER(pCtx->pmfxSurfacesVPPIn, MFX_ERR_MEMORY_ALLOC);
+    for (i = 0; i < pCtx->nSurfNumVPPIn; i++) {
+        pCtx->pmfxSurfacesVPPIn[i] = (mfxFrameSurface1*)malloc(sizeof(mfxFrameSurface1));
+        MSDK_CHECK_POINTER(pCtx->pmfxSurfacesVPPIn[i], MFX_ERR_MEMORY_ALLOC);
+        memset(pCtx->pmfxSurfacesVPPIn[i], 0, sizeof(mfxFrameSurface1));
+        memcpy(&(pCtx->pmfxSurfacesVPPIn[i]->Info), &(VPPParams.vpp.In), sizeof(mfxFrameInfo));
+        pCtx->pmfxSurfacesVPPIn[i]->Data.MemId = pCtx->mfxResponseVPPIn.mids[i];
+        ClearRGBSurfaceVMem(pCtx->pmfxSurfacesVPPIn[i]->Data.MemId);
+    }
+
+    pCtx->pVPPSurfacesVPPOutEnc = (mfxFrameSurface1**)malloc(sizeof(mfxFrameSurface1*) * pCtx->nSurfNumVPPOutEnc);
+    MSDK_CHECK_POINTER(pCtx->pVPPSurfacesVPPOutEnc, MFX_ERR_MEMORY_ALLOC);
+    for (i = 0; i < pCtx->nSurfNumVPPOutEnc; i++) {
+        pCtx->pVPPSurfacesVPPOutEnc[i] = (mfxFrameSurface1*)malloc(sizeof(mfxFrameSurface1));
+        MSDK_CHECK_POINTER(pCtx->pVPPSurfacesVPPOutEnc[i], MFX_ERR_MEMORY_ALLOC);
+        memset(pCtx->pVPPSurfacesVPPOutEnc[i], 0, sizeof(mfxFrameSurface1));
+        memcpy(&(pCtx->pVPPSurfacesVPPOutEnc[i]->Info), &(VPPParams.vpp.Out), sizeof(mfxFrameInfo));
+        pCtx->pVPPSurfacesVPPOutEnc[i]->Data.MemId = pCtx->mfxResponseVPPOutEnc.mids[i];
+    }
+
+    // Disable default VPP operations
+    mfxExtVPPDoNotUse extDoNotUse;
+    memset(&extDoNotUse, 0, sizeof(mfxExtVPPDoNotUse));
+    extDoNotUse.Header.BufferId = MFX_EXTBUFF_VPP_DONOTUSE;
+    extDoNotUse.Header.BufferSz = sizeof(mfxExtVPPDoNotUse);
+    extDoNotUse.NumAlg = 4;
+    extDoNotUse.AlgList = malloc(sizeof(mfxU32) * extDoNotUse.NumAlg);
+    MSDK_CHECK_POINTER(extDoNotUse.AlgList, MFX_ERR_MEMORY_ALLOC);
+    extDoNotUse.AlgList[0] = MFX_EXTBUFF_VPP_DENOISE;       // turn off denoising (on by default)
+    extDoNotUse.AlgList[1] = MFX_EXTBUFF_VPP_SCENE_ANALYSIS;        // turn off scene analysis (on by default)
+    extDoNotUse.AlgList[2] = MFX_EXTBUFF_VPP_DETAIL;        // turn off detail enhancement (on by default)
+    extDoNotUse.AlgList[3] = MFX_EXTBUFF_VPP_PROCAMP;       // turn off processing amplified (on by default)
+
+    // Add extended VPP buffers
+    mfxExtBuffer* extBuffers[1];
+    extBuffers[0] = (mfxExtBuffer*) & extDoNotUse;
+    VPPParams.ExtParam = extBuffers;
+    VPPParams.NumExtParam = 1;
+
+    // Initialize the Media SDK encoder
+    sts = MFXVideoENCODE_Init(pCtx->session, &mfxEncParams);
+    MSDK_IGNORE_MFX_STS(sts, MFX_WRN_PARTIAL_ACCELERATION);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    // Initialize Media SDK VPP
+    sts = MFXVideoVPP_Init(pCtx->session, &VPPParams);
+    MSDK_IGNORE_MFX_STS(sts, MFX_WRN_PARTIAL_ACCELERATION);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    // Retrieve video parameters selected by encoder.
+    // - BufferSizeInKB parameter is required to set bit stream buffer size
+    mfxVideoParam par;
+    memset(&par, 0, sizeof(par));
+    sts = MFXVideoENCODE_GetVideoParam(pCtx->session, &par);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    // Prepare Media SDK bit stream buffer
+    memset(&pCtx->mfxBS, 0, sizeof(pCtx->mfxBS));
+    pCtx->mfxBS.MaxLength = par.mfx.BufferSizeInKB * 1000;
+    pCtx->mfxBS.Data = (mfxU8 *)malloc(sizeof(mfxU8) * pCtx->mfxBS.MaxLength);
+    MSDK_CHECK_POINTER(pCtx->mfxBS.Data, MFX_ERR_MEMORY_ALLOC);
+
+    free(extDoNotUse.AlgList);
+    extDoNotUse.AlgList = NULL;
+
+    return MFX_ERR_NONE;
+}
+
+static int h264_qsv_encoder_fini(h264_qsv_ctx *pCtx)
+{
+    int i;
+    // ===================================================================
+    // Clean up resources
+    //  - It is recommended to close Media SDK components first, before releasing allocated surfaces, since
+    //    some surfaces may still be locked by internal Media SDK resources.
+
+    MFXVideoENCODE_Close(pCtx->session);
+    MFXVideoVPP_Close(pCtx->session);
+    // pCtx->session closed automatically on destruction
+
+    for (i = 0; i < pCtx->nSurfNumVPPIn; i++) {
+        free(pCtx->pmfxSurfacesVPPIn[i]);
+        pCtx->pmfxSurfacesVPPIn[i] = NULL;
+    }
+    free(pCtx->pmfxSurfacesVPPIn);
+    pCtx->pmfxSurfacesVPPIn = NULL;
+    for (i = 0; i < pCtx->nSurfNumVPPOutEnc; i++) {
+        free(pCtx->pVPPSurfacesVPPOutEnc[i]);
+        pCtx->pVPPSurfacesVPPOutEnc[i] = NULL;
+    }
+    free(pCtx->pVPPSurfacesVPPOutEnc);
+    pCtx->pVPPSurfacesVPPOutEnc = NULL;
+    free(pCtx->mfxBS.Data);
+    pCtx->mfxBS.Data = NULL;
+
+    pCtx->mfxAllocator.Free(pCtx->mfxAllocator.pthis, &pCtx->mfxResponseVPPIn);
+    pCtx->mfxAllocator.Free(pCtx->mfxAllocator.pthis, &pCtx->mfxResponseVPPOutEnc);
+
+    Release();
+
+    free(pCtx);
+
+    return 0;
+}
+
+/* retune the running encoder, the other parameters are kept as they are */
+static int h264_qsv_encoder_set_bit_rate(h264_qsv_ctx *pCtx, const mfxU16 target_kbps)
+{
+    mfxStatus sts;
+    mfxVideoParam par;
+
+    memset(&par, 0, sizeof(par));
+    sts = MFXVideoENCODE_GetVideoParam(pCtx->session, &par);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    par.mfx.TargetKbps = target_kbps;
+    par.mfx.MaxKbps = 0;
+    sts = MFXVideoENCODE_Reset(pCtx->session, &par);
+    MSDK_IGNORE_MFX_STS(sts, MFX_WRN_INCOMPATIBLE_VIDEO_PARAM);
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    pCtx->target_kbps = target_kbps;
+    return MFX_ERR_NONE;
+}
+
+static int h264_qsv_encoder_encode(h264_qsv_ctx **pctx, const int width,
+                    const int height, const mfxU16 target_kbps, const int force_idr,
+                    const unsigned char *rgb,
+                    unsigned char **pFrame, int *pFrameSize)
+{
+    mfxStatus sts;
+    mfxEncodeCtrl ctrl;
+    int nEncSurfIdx;
+    int nVPPSurfIdx;
+    mfxSyncPoint syncpVPP, syncpEnc;
+    h264_qsv_ctx *pCtx;
+
+    sts = MFX_ERR_NONE;
+    nEncSurfIdx = 0;
+    nVPPSurfIdx = 0;
+
+    if (*pctx == NULL || width != (*pctx)->width || height != (*pctx)->height) {
+        if (*pctx != NULL) {
+            h264_qsv_encoder_fini(*pctx);
+            *pctx = NULL;
+        }
+        sts = h264_qsv_encoder_init(pctx, width, height, target_kbps);
+        MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+    }
+
+    pCtx = *pctx;
+
+    if (target_kbps != pCtx->target_kbps) {
+        sts = h264_qsv_encoder_set_bit_rate(pCtx, target_kbps);
+        MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+    }
+
+    nVPPSurfIdx = GetFreeSurfaceIndex(pCtx->pmfxSurfacesVPPIn, pCtx->nSurfNumVPPIn);    // Find free input frame surface
+    MSDK_CHECK_ERROR(MFX_ERR_NOT_FOUND, nVPPSurfIdx, MFX_ERR_MEMORY_ALLOC);
+
+        // Surface locking required when read/write video surfaces
+    sts = pCtx->mfxAllocator.Lock(pCtx->mfxAllocator.pthis, pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx]->Data.MemId, &(pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx]->Data));
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    sts = LoadRawRGBFrameFromRGB(pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx], rgb, 4 * width * height);  // Load frame from file into surface
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    sts = pCtx->mfxAllocator.Unlock(pCtx->mfxAllocator.pthis, pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx]->Data.MemId, &(pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx]->Data));
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    nEncSurfIdx = GetFreeSurfaceIndex(pCtx->pVPPSurfacesVPPOutEnc, pCtx->nSurfNumVPPOutEnc);    // Find free output frame surface
+    MSDK_CHECK_ERROR(MFX_ERR_NOT_FOUND, nEncSurfIdx, MFX_ERR_MEMORY_ALLOC);
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    ctrl.FrameType = MFX_FRAMETYPE_I | MFX_FRAMETYPE_IDR | MFX_FRAMETYPE_REF;
+
+    for (;;) {
+        // Process a frame asychronously (returns immediately)
+        sts = MFXVideoVPP_RunFrameVPPAsync(pCtx->session, pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx], pCtx->pVPPSurfacesVPPOutEnc[nEncSurfIdx], NULL, &syncpVPP);
+        if (MFX_WRN_DEVICE_BUSY == sts) {
+            MSDK_SLEEP(1);  // Wait if device is busy, then repeat the same call
+        } else
+            break;
+    }
+
+    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+    for (;;) {
+        // Encode a frame asychronously (returns immediately)
+        sts = MFXVideoENCODE_EncodeFrameAsync(pCtx->session, force_idr ? &ctrl : NULL, pCtx->pVPPSurfacesVPPOutEnc[nEncSurfIdx], &pCtx->mfxBS, &syncpEnc);
+
+        if (MFX_ERR_NONE < sts && !syncpEnc) {  // Repeat the call if warning and no output
+            if (MFX_WRN_DEVICE_BUSY == sts)
+                MSDK_SLEEP(1);  // Wait if device is busy, then repeat the same call
+        } else if (MFX_ERR_NONE < sts && syncpEnc) {
+            sts = MFX_ERR_NONE;     // Ignore warnings if output is available
+            break;
+        } else if (MFX_ERR_NOT_ENOUGH_BUFFER == sts) {
+            // Allocate more bitstream buffer memory here if needed...
+            break;
+        } else
+            break;
+    }
+
+    if (MFX_ERR_NONE == sts) {
+        sts = MFXVideoCORE_SyncOperation(pCtx->session, syncpEnc, 60000);   // Synchronize. Wait until encoded frame is ready
+        MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+
+        *pFrame = pCtx->mfxBS.Data + pCtx->mfxBS.DataOffset;
+        *pFrameSize = pCtx->mfxBS.DataLength;
+        pCtx->mfxBS.DataLength = 0;  //FIXME ZZQ must reset length here
+    }
+
+    return MFX_ERR_NONE;
+}
+
+/* The media sdk helpers keep global state (the va display, the allocations),
+ * so the sessions of the different clients take turns */
+static pthread_mutex_t h264_qsv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the session is (re)created by h264_qsv_encoder_encode() */
+typedef struct H264QsvCodec {
+    h264_qsv_ctx *ctx;
+    mfxU16 target_kbps;
+    int force_idr;
+} H264QsvCodec;
+
+static void *h264_qsv_codec_create(void)
+{
+    mfxVersion ver = { {0, 1} };
+    mfxSession session;
+    H264QsvCodec *qsv;
+
+    /* only probe for the hardware here, the session is opened with the first
+     * frame, once its size is known */
+    if (MFXInit(MFX_IMPL_HARDWARE_ANY, &ver, &session) != MFX_ERR_NONE) {
+        return NULL;
+    }
+    MFXClose(session);
+
+    qsv = spice_new0(H264QsvCodec, 1);
+
+    qsv->target_kbps = H264_QSV_DEFAULT_KBPS;
+    return qsv;
+}
+
+/* The pipeline hands in packed snapshots, as the qsv path expects. The VBR
+ * session has no per frame qp, refine frames are coded as the others */
+static int h264_qsv_codec_encode(void *codec, const uint8_t *rgb, int width, int height,
+                                 SPICE_GNUC_UNUSED int stride,
+                                 SPICE_GNUC_UNUSED uint8_t flags,
+                                 SPICE_GNUC_UNUSED const QRegion *damage,
+                                 SPICE_GNUC_UNUSED int refine,
+                                 uint8_t **frame, int *frame_size)
+{
+    H264QsvCodec *qsv = codec;
+    int ret;
+
+    *frame_size = 0;
+    pthread_mutex_lock(&h264_qsv_lock);
+    ret = h264_qsv_encoder_encode(&qsv->ctx, width, height, qsv->target_kbps,
+                                  qsv->force_idr, rgb, frame, frame_size);
+    pthread_mutex_unlock(&h264_qsv_lock);
+    if (ret == MFX_ERR_NONE) {
+        qsv->force_idr = FALSE;
+    }
+    return ret;
+}
+
+static void h264_qsv_codec_destroy(void *codec)
+{
+    H264QsvCodec *qsv = codec;
+
+    if (qsv->ctx != NULL) {
+        pthread_mutex_lock(&h264_qsv_lock);
+        h264_qsv_encoder_fini(qsv->ctx);
+        pthread_mutex_unlock(&h264_qsv_lock);
+    }
+    free(qsv);
+}
+
+/* The encoder is opened at H264_QSV_FPS; frames come at fps, so the
+ * bit rate is scaled for the per frame budget to match */
+static void h264_qsv_codec_set_rate(void *codec, uint64_t bit_rate, uint32_t fps)
+{
+    H264QsvCodec *qsv = codec;
+    uint64_t kbps = bit_rate * H264_QSV_FPS / MAX(fps, 1) / 1000;
+
+    qsv->target_kbps = MAX(1, MIN(kbps, UINT16_MAX));
+}
+
+static void h264_qsv_codec_request_keyframe(void *codec)
+{
+    H264QsvCodec *qsv = codec;
+
+    qsv->force_idr = TRUE;
+}
+
+const VideoEncoderBackend video_encoder_qsv_backend = {
+    .name = "qsv",
+    .init = h264_qsv_codec_create,
+    .encode = h264_qsv_codec_encode,
+    .reconfigure = h264_qsv_codec_set_rate,
+    .request_keyframe = h264_qsv_codec_request_keyframe,
+    .destroy = h264_qsv_codec_destroy,
+};
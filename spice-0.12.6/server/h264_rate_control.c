@@ -0,0 +1,154 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <time.h>
+
+#include "red_common.h"
+#include "h264_rate_control.h"
+
+#define H264_RC_PERIOD_NS ((uint64_t)1000 * 1000 * 1000)
+#define H264_RC_MIN_BIT_RATE (256 * 1024)
+#define H264_RC_MAX_BIT_RATE (40 * 1024 * 1024)
+/* on skips, the new rate is this fraction of what the link carried */
+#define H264_RC_DECREASE_FACTOR 0.8
+/* #periods without skips before the rate is raised, by 1/H264_RC_INCREASE_DIV */
+#define H264_RC_INCREASE_PERIODS 3
+#define H264_RC_INCREASE_DIV 10
+
+#define H264_RC_MIN_FPS 5
+/* below this bit rate the fps is reduced proportionally from max_fps */
+#define H264_RC_FULL_FPS_BIT_RATE (4 * 1024 * 1024)
+
+struct H264RateControl {
+    uint64_t bit_rate;
+    uint32_t fps;
+    uint32_t max_fps;
+
+    uint64_t period_start;
+    uint64_t period_sent_bytes;
+    uint32_t period_drops;
+    uint32_t clean_periods;
+};
+
+static uint64_t h264_rate_control_now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((uint64_t) time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+static uint32_t h264_rate_control_fps_for_bit_rate(H264RateControl *rc, uint64_t bit_rate)
+{
+    uint64_t fps = rc->max_fps * bit_rate / H264_RC_FULL_FPS_BIT_RATE;
+
+    return MAX(MIN(H264_RC_MIN_FPS, rc->max_fps), MIN(rc->max_fps, fps));
+}
+
+H264RateControl *h264_rate_control_new(uint64_t starting_bit_rate, uint32_t max_fps)
+{
+    H264RateControl *rc = spice_new0(H264RateControl, 1);
+
+    rc->max_fps = MAX(max_fps, 1);
+    rc->bit_rate = MAX(H264_RC_MIN_BIT_RATE, MIN(H264_RC_MAX_BIT_RATE, starting_bit_rate));
+    rc->fps = h264_rate_control_fps_for_bit_rate(rc, rc->bit_rate);
+    rc->period_start = h264_rate_control_now();
+    spice_debug("starting bit rate %.2f (Mbps) fps %u",
+                rc->bit_rate / 1024.0 / 1024.0, rc->fps);
+    return rc;
+}
+
+void h264_rate_control_destroy(H264RateControl *rc)
+{
+    free(rc);
+}
+
+void h264_rate_control_notify_frame_sent(H264RateControl *rc, uint32_t frame_size)
+{
+    rc->period_sent_bytes += frame_size;
+}
+
+void h264_rate_control_notify_server_frame_drop(H264RateControl *rc)
+{
+    rc->period_drops++;
+}
+
+void h264_rate_control_notify_client_report(H264RateControl *rc, uint32_t num_frames,
+                                            uint32_t num_drops, int32_t last_frame_delay)
+{
+    /* frames that reach the client too late to be played are skips too */
+    rc->period_drops += num_drops;
+    if (num_frames && last_frame_delay < 0) {
+        rc->period_drops++;
+    }
+}
+
+int h264_rate_control_update(H264RateControl *rc)
+{
+    uint64_t now = h264_rate_control_now();
+    uint64_t elapsed = now - rc->period_start;
+    uint64_t sent_bit_rate;
+    uint64_t bit_rate = rc->bit_rate;
+    uint32_t fps;
+
+    if (elapsed < H264_RC_PERIOD_NS) {
+        return FALSE;
+    }
+    sent_bit_rate = rc->period_sent_bytes * 8 * H264_RC_PERIOD_NS / elapsed;
+
+    if (rc->period_drops) {
+        /* frames are waiting for the socket: what left is what the link
+         * carries, stay below it so that the queue drains */
+        bit_rate = MIN(bit_rate, sent_bit_rate) * H264_RC_DECREASE_FACTOR;
+        rc->clean_periods = 0;
+    } else if (++rc->clean_periods >= H264_RC_INCREASE_PERIODS &&
+               sent_bit_rate >= bit_rate / 2) {
+        /* only probe for more bandwidth while the stream uses what it has */
+        bit_rate += bit_rate / H264_RC_INCREASE_DIV;
+        rc->clean_periods = 0;
+    }
+    bit_rate = MAX(H264_RC_MIN_BIT_RATE, MIN(H264_RC_MAX_BIT_RATE, bit_rate));
+    fps = h264_rate_control_fps_for_bit_rate(rc, bit_rate);
+
+    rc->period_start = now;
+    rc->period_sent_bytes = 0;
+    rc->period_drops = 0;
+
+    if (bit_rate == rc->bit_rate && fps == rc->fps) {
+        return FALSE;
+    }
+    spice_debug("bit rate %.2f -> %.2f (Mbps), sent %.2f (Mbps), fps %u -> %u",
+                rc->bit_rate / 1024.0 / 1024.0, bit_rate / 1024.0 / 1024.0,
+                sent_bit_rate / 1024.0 / 1024.0, rc->fps, fps);
+    rc->bit_rate = bit_rate;
+    rc->fps = fps;
+    return TRUE;
+}
+
+uint64_t h264_rate_control_get_bit_rate(H264RateControl *rc)
+{
+    return rc->bit_rate;
+}
+
+uint32_t h264_rate_control_get_fps(H264RateControl *rc)
+{
+    return rc->fps;
+}
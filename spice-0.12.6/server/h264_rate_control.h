@@ -0,0 +1,63 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_H264_RATE_CONTROL
+#define _H_H264_RATE_CONTROL
+
+#include "red_common.h"
+
+/*
+ * Bit rate and frame rate of a client's h264 stream.
+ *
+ * Unlike mjpeg streams, the full screen h264 stream carries no stream id or
+ * mm time and the client does not report on it, so the only signal is the
+ * server side one: the frames skipped because the previous ones are still
+ * waiting for the socket, and the rate at which frames actually leave. The
+ * h264 coded video streams of the hybrid mode add the drops of the client
+ * stream reports. When frames are skipped the bit rate drops below what the
+ * link carried; after a few periods without skips it grows back, as long as
+ * the stream uses it.
+ *
+ * Lower bit rates also get a lower frame rate, to keep some quality per frame.
+ */
+
+typedef struct H264RateControl H264RateControl;
+
+H264RateControl *h264_rate_control_new(uint64_t starting_bit_rate, uint32_t max_fps);
+void h264_rate_control_destroy(H264RateControl *rc);
+
+/* a frame of frame_size bytes was written to the socket */
+void h264_rate_control_notify_frame_sent(H264RateControl *rc, uint32_t frame_size);
+/* a frame was skipped since the client has not received the previous ones yet */
+void h264_rate_control_notify_server_frame_drop(H264RateControl *rc);
+/* the client dropped num_drops of the last num_frames frames it got, and the
+ * last one was late if last_frame_delay < 0 */
+void h264_rate_control_notify_client_report(H264RateControl *rc, uint32_t num_frames,
+                                            uint32_t num_drops, int32_t last_frame_delay);
+
+/*
+ * Re-evaluate the rate once per period, to be called before each frame.
+ *
+ * return: TRUE if the bit rate or the fps changed
+ */
+int h264_rate_control_update(H264RateControl *rc);
+
+uint64_t h264_rate_control_get_bit_rate(H264RateControl *rc);
+uint32_t h264_rate_control_get_fps(H264RateControl *rc);
+
+#endif
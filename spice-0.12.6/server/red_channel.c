@@ -1370,6 +1370,27 @@ int red_channel_client_get_roundtrip_ms(RedChannelClient *rcc)
     return rcc->latency_monitor.roundtrip / 1000 / 1000;
 }
 
+uint64_t red_channel_client_get_out_queue_size(RedChannelClient *rcc)
+{
+    uint64_t size = 0;
+
+    if (rcc->outgoing.size) {
+        size = rcc->outgoing.size - rcc->outgoing.pos;
+    }
+#ifdef HAVE_LINUX_SOCKIOS_H /* SIOCOUTQ is a Linux only ioctl on sockets. */
+    if (rcc->stream) {
+        int so_unsent_size = 0;
+
+        if (ioctl(rcc->stream->socket, SIOCOUTQ, &so_unsent_size) == -1) {
+            spice_printerr("ioctl(SIOCOUTQ) failed, %s", strerror(errno));
+        } else {
+            size += so_unsent_size;
+        }
+    }
+#endif
+    return size;
+}
+
 static void red_channel_client_init_outgoing_messages_window(RedChannelClient *rcc)
 {
     rcc->ack_data.messages_window = 0;
@@ -452,6 +452,12 @@ SpiceMarshaller *red_channel_client_switch_to_urgent_sender(RedChannelClient *rc
 /* returns -1 if we don't have an estimation */
 int red_channel_client_get_roundtrip_ms(RedChannelClient *rcc);
 
+/*
+ * Bytes sent that did not reach the client yet: the rest of the message being
+ * written, and on Linux what the socket holds, unsent or not acked by the peer.
+ */
+uint64_t red_channel_client_get_out_queue_size(RedChannelClient *rcc);
+
 /*
  * Checks periodically if the connection is still alive
  */
@@ -1155,6 +1155,7 @@ void red_dispatcher_init(QXLInstance *qxl)
         red_channel_set_cap(display_channel, SPICE_DISPLAY_CAP_MONITORS_CONFIG);
         red_channel_set_cap(display_channel, SPICE_DISPLAY_CAP_PREF_COMPRESSION);
         red_channel_set_cap(display_channel, SPICE_DISPLAY_CAP_STREAM_REPORT);
+        red_channel_set_cap(display_channel, SPICE_DISPLAY_CAP_H264_KEYFRAME_REQUEST);
         reds_register_channel(display_channel);
     }
 
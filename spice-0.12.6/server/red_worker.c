@@ -48,23 +48,6 @@
 #include <inttypes.h>
 #include <glib.h>
 
-#include <libswscale/swscale.h>
-#include <x264.h>
-
-#include <mfx/mfxvideo.h>
-
-#define MSDK_SLEEP(X)                   { usleep(1000*(X)); }
-
-#define MSDK_PRINT_RET_MSG(ERR)         {PrintErrString(ERR, __FILE__, __LINE__);}
-#define MSDK_CHECK_RESULT(P, X, ERR)    {if ((X) > (P)) {MSDK_PRINT_RET_MSG(ERR); return ERR;}}
-#define MSDK_CHECK_POINTER(P, ERR)      {if (!(P)) {MSDK_PRINT_RET_MSG(ERR); return ERR;}}
-#define MSDK_CHECK_ERROR(P, X, ERR)     {if ((X) == (P)) {MSDK_PRINT_RET_MSG(ERR); return ERR;}}
-#define MSDK_IGNORE_MFX_STS(P, X)       {if ((X) == (P)) {P = MFX_ERR_NONE;}}
-#define MSDK_BREAK_ON_ERROR(P)          {if (MFX_ERR_NONE != (P)) break;}
-
-#define MSDK_ALIGN32(X)                 (((mfxU32)((X)+31)) & (~ (mfxU32)31))
-#define MSDK_ALIGN16(value)             (((value + 15) >> 4) << 4)
-
 #include <spice/protocol.h>
 #include <spice/qxl_dev.h>
 #include "common/lz.h"
@@ -89,6 +72,10 @@
 #include "stat.h"
 #include "reds.h"
 #include "mjpeg_encoder.h"
+#include "video_encoder.h"
+#include "h264_pipeline.h"
+#include "h264_rate_control.h"
+#include "h264_pacer.h"
 #include "red_memslots.h"
 #include "red_parse_qxl.h"
 #include "red_record_qxl.h"
@@ -126,7 +113,23 @@
 #define DRAW_ALL
 #endif
 
-#define USE_H264_QSV
+/* surface snapshots that can be queued or encoding at a time */
+#define H264_MAX_PENDING_FRAMES 2
+/* frames pushed to a client and not written to its socket yet, beyond this
+ * new frames are skipped and the rate control backs off */
+#define H264_MAX_UNSENT_FRAMES 2
+/* beyond a round trip, the data a client socket holds may take that long to
+ * drain at the stream's bit rate before new frames are skipped */
+#define H264_MAX_SOCKET_QUEUE_MS 100
+/* the frame rate cap, SPICE_H264_MAX_FPS overrides the default */
+#define H264_DEFAULT_MAX_FPS 30
+#define H264_MAX_MAX_FPS 60
+/* without damage for this long, the client gets a refine frame of what it
+ * holds at motion quality */
+#define H264_REFINE_DELAY_MS 300
+/* what a hybrid stream keeps about the frames it submitted, more than can
+ * be coded and not collected yet */
+#define H264_STREAM_FRAME_INFOS 8
 
 #define CMD_RING_POLL_TIMEOUT 10 //milli
 #define CMD_RING_POLL_RETRIES 200
@@ -329,6 +332,7 @@ enum {
     PIPE_ITEM_TYPE_DESTROY_SURFACE,
     PIPE_ITEM_TYPE_MONITORS_CONFIG,
     PIPE_ITEM_TYPE_STREAM_ACTIVATE_REPORT,
+    PIPE_ITEM_TYPE_H264_FRAME,
 };
 
 typedef struct VerbItem {
@@ -437,6 +441,14 @@ typedef struct LocalCursor {
 #define PALETTE_CACHE_HASH_MASK (PALETTE_CACHE_HASH_SIZE - 1)
 #define PALETTE_CACHE_HASH_KEY(id) ((id) & PALETTE_CACHE_HASH_MASK)
 
+#define COMPRESSED_IMAGE_HASH_SHIFT 6
+#define COMPRESSED_IMAGE_HASH_SIZE (1 << COMPRESSED_IMAGE_HASH_SHIFT)
+#define COMPRESSED_IMAGE_HASH_MASK (COMPRESSED_IMAGE_HASH_SIZE - 1)
+/* the low half of an image id is its group, see QXL_SET_IMAGE_ID */
+#define COMPRESSED_IMAGE_HASH_KEY(id) (((id) ^ ((id) >> 32)) & COMPRESSED_IMAGE_HASH_MASK)
+#define COMPRESSED_IMAGE_CACHE_ITEMS 64
+#define COMPRESSED_IMAGE_CACHE_BYTES (16 * 1024 * 1024)
+
 typedef struct ImageItem {
     PipeItem link;
     int refs;
@@ -452,6 +464,27 @@ typedef struct ImageItem {
     uint8_t data[0];
 } ImageItem;
 
+typedef struct H264FrameItem {
+    PipeItem link;
+    int refs;
+    int sent; /* marshalled, released once it is written to the socket */
+    H264Frame *frame;
+    /* the hybrid stream the frame belongs to, NULL for the full screen one */
+    struct StreamAgent *stream_agent;
+    uint32_t stream_serial;
+    uint32_t mm_time;
+    int sized;
+    SpiceRect dest;
+} H264FrameItem;
+
+/* a frame of a hybrid stream, from its submission till it is coded */
+typedef struct H264StreamFrameInfo {
+    uint32_t frame_id;
+    uint32_t mm_time;
+    int sized;
+    SpiceRect dest;
+} H264StreamFrameInfo;
+
 typedef struct Drawable Drawable;
 
 typedef struct DisplayChannel DisplayChannel;
@@ -508,7 +541,19 @@ typedef struct StreamAgent {
     PipeItem destroy_item;
     Stream *stream;
     uint64_t last_send_time;
+    uint8_t codec_type;
     MJpegEncoder *mjpeg_encoder;
+    /* SPICE_AVC_MODE_HYBRID, instead of the mjpeg encoder. The frames are
+     * coded on the pipeline thread and pushed by handle_stream_h264_frames() */
+    H264Pipeline *h264_pipeline;
+    SpiceWatch *h264_watch;
+    H264RateControl *h264_rate_control;
+    uint32_t h264_serial; /* tells the frame items of this stream from older ones */
+    int h264_unsent_frames;
+    uint32_t h264_next_frame_id;
+    H264StreamFrameInfo h264_frame_infos[H264_STREAM_FRAME_INFOS];
+    uint8_t *h264_frame_buf; /* a chunked frame, packed for the pipeline */
+    size_t h264_frame_buf_size;
     DisplayChannelClient *dcc;
 
     int frames;
@@ -537,6 +582,33 @@ struct RedCompressBuf {
     RedCompressBuf *send_next;
 };
 
+typedef enum {
+    COMPRESSED_IMAGE_QUIC,
+    COMPRESSED_IMAGE_LZ,
+    COMPRESSED_IMAGE_LZ4,
+    COMPRESSED_IMAGE_JPEG, /* the only lossy one */
+} CompressedImageCodec;
+
+/*
+ * The output of a codec for a bitmap, shared by the clients of the display
+ * channel so that the bitmap is compressed once however many clients watch.
+ * Only codecs whose output does not depend on the client qualify: not glz,
+ * whose dictionary is per client, nor lz of palette bitmaps, whose palette is
+ * cached per client.
+ */
+typedef struct RedCompressedImage RedCompressedImage;
+struct RedCompressedImage {
+    RingItem lru_link;
+    RedCompressedImage *hash_next;
+    int refs; /* the cache's, and one per message being sent with it */
+    uint64_t id;
+    CompressedImageCodec codec;
+    SpiceImage image; /* descriptor.type and u, as set by the codec */
+    RedCompressBuf *bufs; /* linked by send_next */
+    uint32_t size;
+    int is_lossy;
+};
+
 static const int BITMAP_FMT_IS_PLT[] = {0, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
 static const int BITMAP_FMP_BYTES_PER_PIXEL[] = {0, 0, 0, 0, 0, 1, 2, 3, 4, 4, 1};
 
@@ -728,6 +800,8 @@ struct DisplayChannelClient {
         uint8_t *stream_outbuf; // caution stream buffer is also used as compress bufs!!!
 
         RedCompressBuf *used_compress_bufs;
+        RedCompressedImage *compressed_images[MAX_DRAWABLE_PIXMAP_CACHE_ITEMS];
+        int num_compressed_images;
 
         FreeList free_list;
         uint64_t pixmap_cache_items[MAX_DRAWABLE_PIXMAP_CACHE_ITEMS];
@@ -750,6 +824,19 @@ struct DisplayChannelClient {
     int use_mjpeg_encoder_rate_control;
     uint32_t streams_max_latency;
     uint64_t streams_max_bit_rate;
+
+    /* every client has its own h264 encoder: its own reference chain, an IDR
+     * when it connects, and a frame rate that follows its own pace */
+    H264Pipeline *h264_pipeline;
+    SpiceWatch *h264_watch;
+    QRegion h264_dirty_region; /* damage not yet submitted to h264_pipeline */
+    H264RateControl *h264_rate_control;
+    uint32_t h264_unsent_frames; /* H264FrameItems not written to the socket yet */
+#ifndef USE_VGA_MODE
+    H264Pacer *h264_pacer;
+    /* coded at motion quality since the last refine frame */
+    QRegion h264_lossy_region;
+#endif
 };
 
 struct DisplayChannel {
@@ -762,11 +849,18 @@ struct DisplayChannel {
 
     RedCompressBuf *free_compress_bufs;
 
+    /* see RedCompressedImage, only used with several clients */
+    RedCompressedImage *compressed_images[COMPRESSED_IMAGE_HASH_SIZE];
+    Ring compressed_images_lru;
+    int num_compressed_images;
+    uint32_t compressed_images_size;
+
 #ifdef RED_STATISTICS
     StatNodeRef stat;
     uint64_t *cache_hits_counter;
     uint64_t *add_to_cache_counter;
     uint64_t *non_cache_counter;
+    uint64_t *compressed_image_hits_counter;
 #endif
 #ifdef COMPRESS_STAT
     stat_info_t lz_stat;
@@ -930,6 +1024,7 @@ typedef struct RedSurface {
 
     Ring depend_on_me;
     QRegion draw_dirty_region;
+    QRegion h264_dirty_region; /* damage not yet handed to the clients' h264 encoders */
 
     //fix me - better handling here
     QXLReleaseInfoExt create, destroy;
@@ -952,23 +1047,6 @@ typedef struct ItemTrace {
 #define NUM_DRAWABLES 1000
 #define NUM_CURSORS 100
 
-typedef struct {
-    mfxSession session;
-
-    mfxFrameAllocator mfxAllocator;
-
-    mfxU16 nSurfNumVPPIn;
-    mfxU16 nSurfNumVPPOutEnc;
-
-    mfxFrameAllocResponse mfxResponseVPPIn;
-    mfxFrameAllocResponse mfxResponseVPPOutEnc;
-
-    mfxFrameSurface1** pmfxSurfacesVPPIn;
-    mfxFrameSurface1** pVPPSurfacesVPPOutEnc;
-
-    mfxBitstream mfxBS;
-} h264_qsv_ctx;
-
 typedef struct RedWorker {
     DisplayChannel *display_channel;
     CursorChannel *cursor_channel;
@@ -1028,10 +1106,7 @@ typedef struct RedWorker {
     spice_wan_compression_t zlib_glz_state;
 
     uint8_t enable_avc;
-#ifndef USE_VGA_MODE
-    uint8_t last_drop;
-    struct timeval last_time;
-#endif
+    uint32_t h264_max_fps;
     uint32_t mouse_mode;
 
     uint32_t streaming_video;
@@ -1051,8 +1126,6 @@ typedef struct RedWorker {
     JpegData jpeg_data;
     JpegEncoderContext *jpeg;
 
-    x264_t *x264_h;
-    h264_qsv_ctx *qsv_ctx;
 #ifdef USE_LZ4
     Lz4Data lz4_data;
     Lz4EncoderContext *lz4;
@@ -1080,6 +1153,7 @@ typedef struct RedWorker {
 
     int driver_cap_monitors_config;
     int set_client_capabilities_pending;
+    QXLDisplayFeedback display_feedback; /* as last given to the device */
 
     FILE *record_fd;
 } RedWorker;
@@ -1142,6 +1216,8 @@ static void cursor_channel_client_release_item_after_push(CursorChannelClient *c
                                                           PipeItem *item);
 
 static void red_push_monitors_config(DisplayChannelClient *dcc);
+static SpiceWatch *worker_watch_add(int fd, int event_mask, SpiceWatchFunc func, void *opaque);
+static void worker_watch_remove(SpiceWatch *watch);
 
 /*
  * Macros to make iterating over stuff easier
@@ -1813,6 +1889,7 @@ static inline void red_destroy_surface(RedWorker *worker, uint32_t surface_id)
         }
 
         region_destroy(&surface->draw_dirty_region);
+        region_destroy(&surface->h264_dirty_region);
         surface->context.canvas = NULL;
         WORKER_FOREACH_DCC_SAFE(worker, link, next, dcc) {
             red_destroy_surface_item(worker, dcc, surface_id);
@@ -2742,6 +2819,16 @@ static void red_stop_stream(RedWorker *worker, Stream *stream)
                 dcc->streams_max_bit_rate = stream_bit_rate;
             }
         }
+        if (stream_agent->h264_pipeline) {
+            H264RateControl *rate_control = stream_agent->h264_rate_control;
+            uint64_t stream_bit_rate = h264_rate_control_get_bit_rate(rate_control);
+
+            /* a frame coded from now on would come after the destroy */
+            h264_pipeline_reset(stream_agent->h264_pipeline);
+            if (stream_bit_rate > dcc->streams_max_bit_rate) {
+                dcc->streams_max_bit_rate = stream_bit_rate;
+            }
+        }
         stream->refs++;
         red_channel_client_pipe_add(&dcc->common.base, &stream_agent->destroy_item);
         red_print_stream_stats(dcc, stream_agent);
@@ -2992,8 +3079,8 @@ static inline Stream *red_alloc_stream(RedWorker *worker)
     return stream;
 }
 
-static uint64_t red_stream_get_initial_bit_rate(DisplayChannelClient *dcc,
-                                                Stream *stream)
+/* the bit rate available to the client's video, before it is shared */
+static uint64_t red_display_client_get_initial_bit_rate(DisplayChannelClient *dcc)
 {
     char *env_bit_rate_str;
     uint64_t bit_rate = 0;
@@ -3034,6 +3121,14 @@ static uint64_t red_stream_get_initial_bit_rate(DisplayChannelClient *dcc,
     }
 
     spice_debug("base-bit-rate %.2f (Mbps)", bit_rate / 1024.0 / 1024.0);
+    return bit_rate;
+}
+
+static uint64_t red_stream_get_initial_bit_rate(DisplayChannelClient *dcc,
+                                                Stream *stream)
+{
+    uint64_t bit_rate = red_display_client_get_initial_bit_rate(dcc);
+
     /* dividing the available bandwidth among the active streams, and saving
      * (1-RED_STREAM_CHANNEL_CAPACITY) of it for other messages */
     return (RED_STREAM_CHANNEL_CAPACITY * bit_rate *
@@ -3094,6 +3189,22 @@ static void red_display_update_streams_max_latency(DisplayChannelClient *dcc, St
     dcc->streams_max_latency = new_max_latency;
 }
 
+static void red_display_stream_agent_free_h264(StreamAgent *agent)
+{
+    if (agent->h264_pipeline) {
+        worker_watch_remove(agent->h264_watch);
+        agent->h264_watch = NULL;
+        /* waits for the frame being encoded, if any */
+        h264_pipeline_destroy(agent->h264_pipeline);
+        agent->h264_pipeline = NULL;
+        h264_rate_control_destroy(agent->h264_rate_control);
+        agent->h264_rate_control = NULL;
+    }
+    free(agent->h264_frame_buf);
+    agent->h264_frame_buf = NULL;
+    agent->h264_frame_buf_size = 0;
+}
+
 static void red_display_stream_agent_stop(DisplayChannelClient *dcc, StreamAgent *agent)
 {
     red_display_update_streams_max_latency(dcc, agent);
@@ -3101,6 +3212,7 @@ static void red_display_stream_agent_stop(DisplayChannelClient *dcc, StreamAgent
         mjpeg_encoder_destroy(agent->mjpeg_encoder);
         agent->mjpeg_encoder = NULL;
     }
+    red_display_stream_agent_free_h264(agent);
 }
 
 static void red_stream_update_client_playback_latency(void *opaque, uint32_t delay_ms)
@@ -3118,6 +3230,9 @@ static void red_stream_update_client_playback_latency(void *opaque, uint32_t del
     main_dispatcher_set_mm_time_latency(agent->dcc->common.base.client, agent->dcc->streams_max_latency);
 }
 
+static int red_display_stream_agent_init_h264(DisplayChannelClient *dcc, StreamAgent *agent,
+                                              Stream *stream);
+
 static void red_display_create_stream(DisplayChannelClient *dcc, Stream *stream)
 {
     StreamAgent *agent = &dcc->stream_agents[get_stream_id(dcc->common.worker, stream)];
@@ -3135,7 +3250,15 @@ static void red_display_create_stream(DisplayChannelClient *dcc, Stream *stream)
     agent->fps = MAX_FPS;
     agent->dcc = dcc;
 
-    if (dcc->use_mjpeg_encoder_rate_control) {
+    /* In hybrid mode only the detected video areas are coded with h264, the
+     * rest of the screen keeps going through the lossless image codecs.
+     * h264 is coded 4:2:0, so odd sized streams stay mjpeg. */
+    if (dcc->common.worker->enable_avc == SPICE_AVC_MODE_HYBRID &&
+        stream->width % 2 == 0 && stream->height % 2 == 0 &&
+        red_display_stream_agent_init_h264(dcc, agent, stream)) {
+        agent->codec_type = SPICE_VIDEO_CODEC_TYPE_H264;
+        agent->mjpeg_encoder = NULL;
+    } else if (dcc->use_mjpeg_encoder_rate_control) {
         MJpegEncoderRateControlCbs mjpeg_cbs;
         uint64_t initial_bit_rate;
 
@@ -3144,8 +3267,10 @@ static void red_display_create_stream(DisplayChannelClient *dcc, Stream *stream)
         mjpeg_cbs.update_client_playback_delay = red_stream_update_client_playback_latency;
 
         initial_bit_rate = red_stream_get_initial_bit_rate(dcc, stream);
+        agent->codec_type = SPICE_VIDEO_CODEC_TYPE_MJPEG;
         agent->mjpeg_encoder = mjpeg_encoder_new(initial_bit_rate, &mjpeg_cbs, agent);
     } else {
+        agent->codec_type = SPICE_VIDEO_CODEC_TYPE_MJPEG;
         agent->mjpeg_encoder = mjpeg_encoder_new(0, NULL, NULL);
     }
     red_channel_client_pipe_add(&dcc->common.base, &agent->create_item);
@@ -3248,6 +3373,7 @@ static void red_display_destroy_streams_agents(DisplayChannelClient *dcc)
             mjpeg_encoder_destroy(agent->mjpeg_encoder);
             agent->mjpeg_encoder = NULL;
         }
+        red_display_stream_agent_free_h264(agent);
     }
 }
 
@@ -3373,6 +3499,16 @@ static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream, Drawa
         dcc = dpi->dcc;
         agent = &dcc->stream_agents[index];
 
+        if (agent->h264_rate_control) {
+            if (pipe_item_is_linked(&dpi->dpi_pipe_item)) {
+#ifdef STREAM_STATS
+                agent->stats.num_drops_pipe++;
+#endif
+                h264_rate_control_notify_server_frame_drop(agent->h264_rate_control);
+            }
+            continue;
+        }
+
         if (!dcc->use_mjpeg_encoder_rate_control &&
             !dcc->common.is_low_bandwidth) {
             continue;
@@ -3382,7 +3518,7 @@ static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream, Drawa
 #ifdef STREAM_STATS
             agent->stats.num_drops_pipe++;
 #endif
-            if (dcc->use_mjpeg_encoder_rate_control) {
+            if (dcc->use_mjpeg_encoder_rate_control && agent->mjpeg_encoder) {
                 mjpeg_encoder_notify_server_frame_drop(agent->mjpeg_encoder);
             } else {
                 ++agent->drops;
@@ -3396,7 +3532,7 @@ static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream, Drawa
 
         agent = &dcc->stream_agents[index];
 
-        if (dcc->use_mjpeg_encoder_rate_control) {
+        if (dcc->use_mjpeg_encoder_rate_control && agent->mjpeg_encoder) {
             continue;
         }
         if (agent->frames / agent->fps < FPS_TEST_INTERVAL) {
@@ -4459,6 +4595,24 @@ static void red_draw_qxl_drawable(RedWorker *worker, Drawable *drawable)
     image_cache_aging(&worker->image_cache);
 
     region_add(&surface->draw_dirty_region, &drawable->red_drawable->bbox);
+    if (worker->enable_avc == SPICE_AVC_MODE_FULL) {
+        /* a full screen update from qemu only changed its clip */
+        if (clip.type == SPICE_CLIP_TYPE_RECTS) {
+            QRegion rgn;
+            QRegion bbox_rgn;
+
+            region_init(&rgn);
+            add_clip_rects(&rgn, clip.rects);
+            region_init(&bbox_rgn);
+            region_add(&bbox_rgn, &drawable->red_drawable->bbox);
+            region_and(&rgn, &bbox_rgn);
+            region_or(&surface->h264_dirty_region, &rgn);
+            region_destroy(&bbox_rgn);
+            region_destroy(&rgn);
+        } else {
+            region_add(&surface->h264_dirty_region, &drawable->red_drawable->bbox);
+        }
+    }
 
     switch (drawable->red_drawable->type) {
     case QXL_DRAW_FILL: {
@@ -5398,10 +5552,10 @@ static inline void __red_display_free_compress_buf(DisplayChannel *dc,
     dc->free_compress_bufs = buf;
 }
 
-static void red_display_free_compress_buf(DisplayChannelClient *dcc,
-                                          RedCompressBuf *buf)
+/* take buf out of the buffers freed once the message being sent is out */
+static void red_display_detach_compress_buf(DisplayChannelClient *dcc,
+                                            RedCompressBuf *buf)
 {
-    DisplayChannel *display_channel = DCC_TO_DC(dcc);
     RedCompressBuf **curr_used = &dcc->send_data.used_compress_bufs;
 
     for (;;) {
@@ -5412,7 +5566,27 @@ static void red_display_free_compress_buf(DisplayChannelClient *dcc,
         }
         curr_used = &(*curr_used)->next;
     }
-    __red_display_free_compress_buf(display_channel, buf);
+}
+
+static void red_display_free_compress_buf(DisplayChannelClient *dcc,
+                                          RedCompressBuf *buf)
+{
+    red_display_detach_compress_buf(dcc, buf);
+    __red_display_free_compress_buf(DCC_TO_DC(dcc), buf);
+}
+
+static void red_compressed_image_unref(DisplayChannel *display_channel,
+                                       RedCompressedImage *item)
+{
+    if (--item->refs) {
+        return;
+    }
+    while (item->bufs) {
+        RedCompressBuf *buf = item->bufs;
+        item->bufs = buf->send_next;
+        __red_display_free_compress_buf(display_channel, buf);
+    }
+    free(item);
 }
 
 static void red_display_reset_compress_buf(DisplayChannelClient *dcc)
@@ -5422,6 +5596,38 @@ static void red_display_reset_compress_buf(DisplayChannelClient *dcc)
         dcc->send_data.used_compress_bufs = buf->next;
         __red_display_free_compress_buf(DCC_TO_DC(dcc), buf);
     }
+    while (dcc->send_data.num_compressed_images) {
+        red_compressed_image_unref(DCC_TO_DC(dcc),
+            dcc->send_data.compressed_images[--dcc->send_data.num_compressed_images]);
+    }
+}
+
+/* the item stays alive as long as a message being sent refers to it */
+static void red_display_remove_compressed_image(DisplayChannel *display_channel,
+                                                RedCompressedImage *item)
+{
+    RedCompressedImage **now = &display_channel->compressed_images[
+        COMPRESSED_IMAGE_HASH_KEY(item->id)];
+
+    while (*now != item) {
+        spice_assert(*now);
+        now = &(*now)->hash_next;
+    }
+    *now = item->hash_next;
+    ring_remove(&item->lru_link);
+    display_channel->num_compressed_images--;
+    display_channel->compressed_images_size -= item->size;
+    red_compressed_image_unref(display_channel, item);
+}
+
+static void red_display_flush_compressed_images(DisplayChannel *display_channel)
+{
+    RingItem *link;
+
+    while ((link = ring_get_tail(&display_channel->compressed_images_lru))) {
+        red_display_remove_compressed_image(display_channel,
+            SPICE_CONTAINEROF(link, RedCompressedImage, lru_link));
+    }
 }
 
 static void red_display_destroy_compress_bufs(DisplayChannel *display_channel)
@@ -6594,11 +6800,111 @@ static inline int red_quic_compress_image(DisplayChannelClient *dcc, SpiceImage
     return TRUE;
 }
 
+/* send the item's data with the message being marshalled */
+static void red_display_use_compressed_image(DisplayChannelClient *dcc, RedCompressedImage *item,
+                                             SpiceImage *dest, compress_send_data_t *o_comp_data)
+{
+    item->refs++;
+    dcc->send_data.compressed_images[dcc->send_data.num_compressed_images++] = item;
+    dest->descriptor.type = item->image.descriptor.type;
+    dest->u = item->image.u;
+    o_comp_data->comp_buf = item->bufs;
+    o_comp_data->comp_buf_size = item->size;
+    o_comp_data->is_lossy = item->is_lossy;
+}
+
+/*
+ * Compress src with codec, or reuse what it gave for another client. The
+ * image id stands for the content as for the pixmap cache: when the driver
+ * asks for the image to be cached (image_flags are those of the source
+ * image), or when the device or the worker made the id unique. The codec
+ * stands for the lossiness.
+ */
+static int red_shared_compress_image(DisplayChannelClient *dcc, CompressedImageCodec codec,
+                                     SpiceImage *dest, SpiceBitmap *src, uint8_t image_flags,
+                                     compress_send_data_t *o_comp_data, uint32_t group_id)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    RedCompressedImage **bucket =
+        &display_channel->compressed_images[COMPRESSED_IMAGE_HASH_KEY(dest->descriptor.id)];
+    RedCompressedImage *item;
+    RedCompressBuf *buf;
+    uint32_t id_group = (uint32_t)dest->descriptor.id;
+    int shared;
+    int ret = FALSE;
+
+    /* with a single client nothing would ever be reused */
+    shared = display_channel->common.base.clients_num > 1 && bitmap_fmt_is_rgb(src->format) &&
+             ((image_flags & SPICE_IMAGE_FLAGS_CACHE_ME) ||
+              id_group == QXL_IMAGE_GROUP_DEVICE || id_group == QXL_IMAGE_GROUP_RED) &&
+             dcc->send_data.num_compressed_images < MAX_DRAWABLE_PIXMAP_CACHE_ITEMS;
+    if (shared) {
+        for (item = *bucket; item; item = item->hash_next) {
+            if (item->id == dest->descriptor.id && item->codec == codec) {
+                ring_remove(&item->lru_link);
+                ring_add(&display_channel->compressed_images_lru, &item->lru_link);
+                red_display_use_compressed_image(dcc, item, dest, o_comp_data);
+                stat_inc_counter(display_channel->compressed_image_hits_counter, 1);
+                return TRUE;
+            }
+        }
+    }
+
+    switch (codec) {
+    case COMPRESSED_IMAGE_QUIC:
+        ret = red_quic_compress_image(dcc, dest, src, o_comp_data, group_id);
+        break;
+    case COMPRESSED_IMAGE_LZ:
+        ret = red_lz_compress_image(dcc, dest, src, o_comp_data, group_id);
+        break;
+#ifdef USE_LZ4
+    case COMPRESSED_IMAGE_LZ4:
+        ret = red_lz4_compress_image(dcc, dest, src, o_comp_data, group_id);
+        break;
+#endif
+    case COMPRESSED_IMAGE_JPEG:
+        ret = red_jpeg_compress_image(dcc, dest, src, o_comp_data, group_id);
+        break;
+    default:
+        spice_error("invalid codec %u", codec);
+    }
+    if (!ret || !shared) {
+        return ret;
+    }
+
+    item = spice_new0(RedCompressedImage, 1);
+    item->refs = 1;
+    item->id = dest->descriptor.id;
+    item->codec = codec;
+    item->image = *dest;
+    item->bufs = o_comp_data->comp_buf;
+    item->size = o_comp_data->comp_buf_size;
+    item->is_lossy = o_comp_data->is_lossy;
+    for (buf = item->bufs; buf; buf = buf->send_next) {
+        red_display_detach_compress_buf(dcc, buf);
+    }
+    item->hash_next = *bucket;
+    *bucket = item;
+    ring_add(&display_channel->compressed_images_lru, &item->lru_link);
+    display_channel->num_compressed_images++;
+    display_channel->compressed_images_size += item->size;
+    red_display_use_compressed_image(dcc, item, dest, o_comp_data);
+
+    while (display_channel->num_compressed_images > COMPRESSED_IMAGE_CACHE_ITEMS ||
+           display_channel->compressed_images_size > COMPRESSED_IMAGE_CACHE_BYTES) {
+        RingItem *tail = ring_get_tail(&display_channel->compressed_images_lru);
+
+        red_display_remove_compressed_image(display_channel,
+            SPICE_CONTAINEROF(tail, RedCompressedImage, lru_link));
+    }
+    return TRUE;
+}
+
 #define MIN_SIZE_TO_COMPRESS 54
 #define MIN_DIMENSION_TO_QUIC 3
 static inline int red_compress_image(DisplayChannelClient *dcc,
-                                     SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
-                                     int can_lossy,
+                                     SpiceImage *dest, SpiceBitmap *src, uint8_t image_flags,
+                                     Drawable *drawable, int can_lossy,
                                      compress_send_data_t* o_comp_data)
 {
     DisplayChannel *display_channel = DCC_TO_DC(dcc);
@@ -6660,12 +6966,13 @@ static inline int red_compress_image(DisplayChannelClient *dcc,
             (image_compression == SPICE_IMAGE_COMPRESSION_AUTO_GLZ))) {
             // if we use lz for alpha, the stride can't be extra
             if (src->format != SPICE_BITMAP_FMT_RGBA || !_stride_is_extra(src)) {
-                return red_jpeg_compress_image(dcc, dest,
-                                               src, o_comp_data, drawable->group_id);
+                return red_shared_compress_image(dcc, COMPRESSED_IMAGE_JPEG, dest,
+                                                 src, image_flags, o_comp_data,
+                                                 drawable->group_id);
             }
         }
-        return red_quic_compress_image(dcc, dest,
-                                       src, o_comp_data, drawable->group_id);
+        return red_shared_compress_image(dcc, COMPRESSED_IMAGE_QUIC, dest,
+                                         src, image_flags, o_comp_data, drawable->group_id);
     } else {
         int glz;
         int ret;
@@ -6702,12 +7009,12 @@ static inline int red_compress_image(DisplayChannelClient *dcc,
                 bitmap_fmt_is_rgb(src->format) &&
                 red_channel_client_test_remote_cap(&dcc->common.base,
                         SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
-                ret = red_lz4_compress_image(dcc, dest, src, o_comp_data,
-                                             drawable->group_id);
+                ret = red_shared_compress_image(dcc, COMPRESSED_IMAGE_LZ4, dest, src,
+                                                image_flags, o_comp_data, drawable->group_id);
             } else
 #endif
-                ret = red_lz_compress_image(dcc, dest, src, o_comp_data,
-                                            drawable->group_id);
+                ret = red_shared_compress_image(dcc, COMPRESSED_IMAGE_LZ, dest, src,
+                                                image_flags, o_comp_data, drawable->group_id);
 #ifdef COMPRESS_DEBUG
             spice_info("LZ LOCAL compress");
 #endif
@@ -6845,7 +7152,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
            in order to prevent starvation in the client between pixmap_cache and
            global dictionary (in cases of multiple monitors) */
         if (reds_stream_get_family(rcc->stream) == AF_UNIX ||
-            !red_compress_image(dcc, &image, &simage->u.bitmap,
+            !red_compress_image(dcc, &image, &simage->u.bitmap, simage->descriptor.flags,
                                 drawable, can_lossy, &comp_send_data)) {
             SpicePalette *palette;
 
@@ -8581,6 +8888,93 @@ static int encode_frame(DisplayChannelClient *dcc, const SpiceRect *src,
     return TRUE;
 }
 
+/*
+ * TRUE if what was already sent to the client, and is not received yet, takes
+ * more than a round trip plus H264_MAX_SOCKET_QUEUE_MS to drain at bit_rate.
+ * A frame coded now would only wait behind it: better skip it and code the
+ * next one, with the changes of both, once the link caught up.
+ */
+static int red_h264_socket_is_congested(RedChannelClient *rcc, uint64_t bit_rate)
+{
+    int roundtrip_ms = MAX(red_channel_client_get_roundtrip_ms(rcc), 0);
+
+    return red_channel_client_get_out_queue_size(rcc) * 8 * 1000 >
+           bit_rate * (roundtrip_ms + H264_MAX_SOCKET_QUEUE_MS);
+}
+
+/*
+ * Hand the src area of the frame to the stream's h264 pipeline. The lines go
+ * in the order encode_frame() hands them to the mjpeg encoder, so the client
+ * flips them the same way. The coded frame is pushed on its own by
+ * handle_stream_h264_frames().
+ *
+ * return: 1 if submitted, 0 if the pipeline is still busy with the previous
+ *         frames, -1 if the frame can't be coded and must be sent as an image.
+ */
+static int submit_h264_frame(DisplayChannelClient *dcc, Drawable *drawable, StreamAgent *agent,
+                             int width, int height, uint32_t mm_time)
+{
+    const SpiceRect *src = &drawable->red_drawable->u.copy.src_area;
+    const SpiceBitmap *image = &drawable->red_drawable->u.copy.src_bitmap->u.bitmap;
+    SpiceChunks *chunks = image->data;
+    H264StreamFrameInfo *info;
+    size_t offset = 0;
+    int chunk = 0;
+    size_t frame_stride = width * 4;
+    const uint8_t *rgb;
+    int stride;
+    int i;
+
+    if (image->format != SPICE_BITMAP_FMT_32BIT && image->format != SPICE_BITMAP_FMT_RGBA) {
+        return -1;
+    }
+    if (width % 2 != 0 || height % 2 != 0) {
+        return -1;
+    }
+
+    const int skip_lines = agent->stream->top_down ? src->top : image->y - (src->bottom - 0);
+    if (chunks->num_chunks == 1) {
+        /* the pipeline copies the lines from the bitmap itself */
+        if ((size_t)(skip_lines + height) * image->stride > chunks->chunk[0].len) {
+            spice_warning("bad chunk alignment");
+            return -1;
+        }
+        rgb = chunks->chunk[0].data + skip_lines * image->stride + src->left * 4;
+        stride = image->stride;
+    } else {
+        if (agent->h264_frame_buf_size < frame_stride * height) {
+            free(agent->h264_frame_buf);
+            agent->h264_frame_buf_size = frame_stride * height;
+            agent->h264_frame_buf = spice_malloc(agent->h264_frame_buf_size);
+        }
+        for (i = 0; i < skip_lines; i++) {
+            red_get_image_line(chunks, &offset, &chunk, image->stride);
+        }
+        for (i = 0; i < height; i++) {
+            uint8_t *src_line = red_get_image_line(chunks, &offset, &chunk, image->stride);
+
+            if (!src_line) {
+                return -1;
+            }
+            memcpy(agent->h264_frame_buf + i * frame_stride, src_line + src->left * 4,
+                   frame_stride);
+        }
+        rgb = agent->h264_frame_buf;
+        stride = frame_stride;
+    }
+
+    if (!h264_pipeline_submit(agent->h264_pipeline, agent->h264_next_frame_id, 0,
+                              rgb, width, height, stride, 0, NULL, FALSE)) {
+        return 0;
+    }
+    info = &agent->h264_frame_infos[agent->h264_next_frame_id % H264_STREAM_FRAME_INFOS];
+    info->frame_id = agent->h264_next_frame_id++;
+    info->mm_time = mm_time;
+    info->sized = drawable->sized_stream != NULL;
+    info->dest = drawable->red_drawable->bbox;
+    return 1;
+}
+
 static inline int red_marshall_stream_data(RedChannelClient *rcc,
                   SpiceMarshaller *base_marshaller, Drawable *drawable)
 {
@@ -8625,8 +9019,13 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
     uint64_t time_now = red_now();
     size_t outbuf_size;
 
-    if (!dcc->use_mjpeg_encoder_rate_control) {
-        if (time_now - agent->last_send_time < (1000 * 1000 * 1000) / agent->fps) {
+    /* h264 streams are paced at the fps of their rate control, mjpeg streams
+     * of clients without stream reports at agent->fps */
+    if (!dcc->use_mjpeg_encoder_rate_control || !agent->mjpeg_encoder) {
+        uint32_t fps = agent->h264_rate_control ?
+                       h264_rate_control_get_fps(agent->h264_rate_control) : agent->fps;
+
+        if (time_now - agent->last_send_time < (1000 * 1000 * 1000) / fps) {
             agent->frames--;
 #ifdef STREAM_STATS
             agent->stats.num_drops_fps++;
@@ -8639,34 +9038,65 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
     frame_mm_time =  drawable->red_drawable->mm_time ?
                         drawable->red_drawable->mm_time :
                         reds_get_mm_time();
-    outbuf_size = dcc->send_data.stream_outbuf_size;
-    ret = mjpeg_encoder_start_frame(agent->mjpeg_encoder, image->u.bitmap.format,
-                                    width, height,
-                                    &dcc->send_data.stream_outbuf,
-                                    &outbuf_size,
-                                    frame_mm_time);
-    switch (ret) {
-    case MJPEG_ENCODER_FRAME_DROP:
-        spice_assert(dcc->use_mjpeg_encoder_rate_control);
+
+    if (agent->h264_pipeline) {
+        uint64_t bit_rate;
+
+        if (h264_rate_control_update(agent->h264_rate_control)) {
+            h264_pipeline_set_rate(agent->h264_pipeline,
+                                   h264_rate_control_get_bit_rate(agent->h264_rate_control),
+                                   h264_rate_control_get_fps(agent->h264_rate_control));
+        }
+        bit_rate = h264_rate_control_get_bit_rate(agent->h264_rate_control);
+        /* the frame codes the whole stream area, so the next one covers what
+         * this one skips; the coded frame is sent by handle_stream_h264_frames() */
+        n = 0;
+        if (agent->h264_unsent_frames < H264_MAX_UNSENT_FRAMES &&
+            !red_h264_socket_is_congested(rcc, bit_rate)) {
+            n = submit_h264_frame(dcc, drawable, agent, width, height, frame_mm_time);
+        }
+        if (n < 0) {
+            return FALSE;
+        }
+        if (n == 0) {
+            h264_rate_control_notify_server_frame_drop(agent->h264_rate_control);
 #ifdef STREAM_STATS
-        agent->stats.num_drops_fps++;
+            agent->stats.num_drops_pipe++;
 #endif
+            return TRUE;
+        }
+        agent->last_send_time = time_now;
         return TRUE;
-    case MJPEG_ENCODER_FRAME_UNSUPPORTED:
-        return FALSE;
-    case MJPEG_ENCODER_FRAME_ENCODE_START:
-        break;
-    default:
-        spice_error("bad return value (%d) from mjpeg_encoder_start_frame", ret);
-        return FALSE;
-    }
+    } else {
+        outbuf_size = dcc->send_data.stream_outbuf_size;
+        ret = mjpeg_encoder_start_frame(agent->mjpeg_encoder, image->u.bitmap.format,
+                                        width, height,
+                                        &dcc->send_data.stream_outbuf,
+                                        &outbuf_size,
+                                        frame_mm_time);
+        switch (ret) {
+        case MJPEG_ENCODER_FRAME_DROP:
+            spice_assert(dcc->use_mjpeg_encoder_rate_control);
+#ifdef STREAM_STATS
+            agent->stats.num_drops_fps++;
+#endif
+            return TRUE;
+        case MJPEG_ENCODER_FRAME_UNSUPPORTED:
+            return FALSE;
+        case MJPEG_ENCODER_FRAME_ENCODE_START:
+            break;
+        default:
+            spice_error("bad return value (%d) from mjpeg_encoder_start_frame", ret);
+            return FALSE;
+        }
 
-    if (!encode_frame(dcc, &drawable->red_drawable->u.copy.src_area,
-                      &image->u.bitmap, stream)) {
-        return FALSE;
+        if (!encode_frame(dcc, &drawable->red_drawable->u.copy.src_area,
+                          &image->u.bitmap, stream)) {
+            return FALSE;
+        }
+        n = mjpeg_encoder_end_frame(agent->mjpeg_encoder);
+        dcc->send_data.stream_outbuf_size = outbuf_size;
     }
-    n = mjpeg_encoder_end_frame(agent->mjpeg_encoder);
-    dcc->send_data.stream_outbuf_size = outbuf_size;
 
     if (!drawable->sized_stream) {
         SpiceMsgDisplayStreamData stream_data;
@@ -8706,559 +9136,482 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
     return TRUE;
 }
 
-static int rgb2yuv(const uint8_t *rgb, const int width, const int height,
-            uint8_t *yuv)
+static void *h264_video_codec_create(void)
 {
-    struct SwsContext *sws;
-    const uint8_t *rgb_slice[3];
-    int rgb_stride[3];
-    uint8_t *yuv_slice[3];
-    int yuv_stride[3];
-    int n;
+    return video_encoder_new(NULL);
+}
 
-    sws = sws_getContext(width, height, AV_PIX_FMT_RGB32,
-                width, height, AV_PIX_FMT_YUV420P,
-                1, NULL, NULL, NULL);
-    if (sws == NULL) {
-        return -1;
-    }
-    rgb_slice[0] = rgb;
-    rgb_slice[1] = NULL;
-    rgb_slice[2] = NULL;
-    rgb_stride[0] = width * 4;
-    rgb_stride[1] = 0;
-    rgb_stride[2] = 0;
-    yuv_slice[0] = yuv;
-    yuv_slice[1] = yuv + width * height;
-    yuv_slice[2] = yuv_slice[1] + width * height / 4;
-    yuv_stride[0] = width;
-    yuv_stride[1] = width / 2;
-    yuv_stride[2] = width / 2;
-
-    n = sws_scale(sws, rgb_slice, rgb_stride, 0, height,
-            yuv_slice, yuv_stride);
-    sws_freeContext(sws);
-    sws = NULL;
-
-    if (n != height)
-        return -1;
-    return 0;
+static int h264_video_codec_encode(void *codec, const uint8_t *rgb, int width, int height,
+                                   int stride, uint8_t flags, const QRegion *damage, int refine,
+                                   uint8_t **frame, int *frame_size)
+{
+    return video_encoder_encode(codec, rgb, width, height, stride, flags, damage, refine,
+                                frame, frame_size);
 }
 
-static x264_t *h264_encoder_init(const int width, const int height)
+static void h264_video_codec_destroy(void *codec)
 {
-    x264_param_t param;
-    x264_t *h;
+    video_encoder_destroy(codec);
+}
 
-    fprintf(stderr, "[ZZQ] Init h264 encode, width = %d, height = %d\n", width, height);
+static void h264_video_codec_set_rate(void *codec, uint64_t bit_rate, uint32_t fps)
+{
+    video_encoder_reconfigure(codec, bit_rate, fps);
+}
 
-    /* Get default params for preset/tuning */
-    if (x264_param_default_preset(&param, "ultrafast", "zerolatency") < 0) {
-        fprintf(stderr, "Failed to get default params\n");
-        return NULL;
-    }
+static void h264_video_codec_request_keyframe(void *codec)
+{
+    video_encoder_request_keyframe(codec);
+}
 
-    /* Configure non-default param */
-    param.i_csp = X264_CSP_I420;
-    param.i_width =  width;
-    param.i_height = height;
-    param.b_vfr_input = 0;
-    param.b_repeat_headers = 1;
-    param.b_annexb = 1;
+static int h264_video_codec_get_refresh_area(void *codec, SpiceRect *area)
+{
+    return video_encoder_get_refresh_area(codec, area);
+}
 
-    /* Apply profile restrictions */
-    if (x264_param_apply_profile(&param, "baseline") < 0) {
-        fprintf(stderr, "Failed to apply profile\n");
-        return NULL;
-    }
+static void h264_video_codec_set_slice_output(void *codec, const H264SliceOutput *output,
+                                              void *opaque)
+{
+    video_encoder_set_slice_output(codec, output, opaque);
+}
 
-    h = x264_encoder_open(&param);
+static const H264PipelineCodec h264_codec = {
+    .create = h264_video_codec_create,
+    .encode = h264_video_codec_encode,
+    .destroy = h264_video_codec_destroy,
+    .set_rate = h264_video_codec_set_rate,
+    .request_keyframe = h264_video_codec_request_keyframe,
+    .get_refresh_area = h264_video_codec_get_refresh_area,
+    .set_slice_output = h264_video_codec_set_slice_output,
+};
 
-    return h;
+static void red_marshall_h264_frame(RedChannelClient *rcc, SpiceMarshaller *base_marshaller,
+                                    H264FrameItem *item)
+{
+    H264Frame *frame = item->frame;
+    SpiceMsgDisplayH264StreamData stream_data;
+    SpiceMsgDisplayH264StreamDataDirty stream_data_dirty;
+    SpiceMsgDisplayH264StreamDataSlice stream_data_slice;
+
+    /* the frame is sent from the buffer it was coded into; holding the item
+     * keeps it out of the pool until it is written to the socket */
+    if (frame->slice) {
+        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_H264_STREAM_DATA_SLICE,
+                                          &item->link);
+        stream_data_slice.data_size = frame->size;
+        spice_marshall_msg_display_h264_stream_data_slice(base_marshaller, &stream_data_slice);
+    } else if (red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_H264_DIRTY_RECTS)) {
+        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_H264_STREAM_DATA_DIRTY,
+                                          &item->link);
+        stream_data_dirty.base.surface_id = frame->surface_id;
+        stream_data_dirty.base.width = frame->width;
+        stream_data_dirty.base.height = frame->height;
+        stream_data_dirty.base.flags = frame->flags;
+        if (frame->dirty) {
+            stream_data_dirty.dirty.type = SPICE_CLIP_TYPE_RECTS;
+            stream_data_dirty.dirty.rects = frame->dirty;
+        } else {
+            stream_data_dirty.dirty.type = SPICE_CLIP_TYPE_NONE;
+            stream_data_dirty.dirty.rects = NULL;
+        }
+        stream_data_dirty.data_size = frame->size;
+        spice_marshall_msg_display_h264_stream_data_dirty(base_marshaller, &stream_data_dirty);
+    } else {
+        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_H264_STREAM_DATA, &item->link);
+        stream_data.base.surface_id = frame->surface_id;
+        stream_data.base.width = frame->width;
+        stream_data.base.height = frame->height;
+        stream_data.data_size = frame->size;
+        stream_data.base.flags = frame->flags;
+        spice_marshall_msg_display_h264_stream_data(base_marshaller, &stream_data);
+    }
+    item->sent = TRUE;
+    spice_marshaller_add_ref(base_marshaller, frame->data, frame->size);
 }
 
-int h264_qsv_encoder_init(h264_qsv_ctx **pctx, const int width, const int height)
+/* the frames of a hybrid stream, which may be gone by now */
+static void red_marshall_stream_h264_frame(RedChannelClient *rcc,
+                                           SpiceMarshaller *base_marshaller,
+                                           H264FrameItem *item)
 {
-    mfxStatus sts;
-    int i;
-    h264_qsv_ctx *pCtx;
-
-    sts = MFX_ERR_NONE;
-
-    pCtx = malloc(sizeof(h264_qsv_ctx));
-    MSDK_CHECK_POINTER(pCtx, MFX_ERR_MEMORY_ALLOC);
-    *pctx = pCtx;
-
-    fprintf(stderr, "[ZZQ] h264_qsv encode init\n");
-    // Initialize Intel Media SDK pCtx->session
-    // - MFX_IMPL_AUTO_ANY selects HW acceleration if available (on any adapter)
-    mfxIMPL impl = MFX_IMPL_AUTO_ANY;
-    mfxVersion ver = { {0, 1} };
-    sts = Initialize(impl, ver, &pCtx->session, &pCtx->mfxAllocator);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    // Initialize encoder parameters
-    // - In this example we are encoding an AVC (H.264) stream
-    mfxVideoParam mfxEncParams;
-    memset(&mfxEncParams, 0, sizeof(mfxEncParams));
-    mfxEncParams.mfx.CodecId = MFX_CODEC_AVC;
-    mfxEncParams.mfx.TargetUsage = MFX_TARGETUSAGE_BEST_SPEED;
-    //mfxEncParams.mfx.TargetUsage = MFX_TARGETUSAGE_BALANCED;
-    mfxEncParams.mfx.TargetKbps = 6000;
-    mfxEncParams.mfx.RateControlMethod = MFX_RATECONTROL_VBR;
-    mfxEncParams.mfx.FrameInfo.FrameRateExtN = 30;
-    mfxEncParams.mfx.FrameInfo.FrameRateExtD = 1;
-    mfxEncParams.mfx.FrameInfo.FourCC = MFX_FOURCC_NV12;
-    mfxEncParams.mfx.FrameInfo.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
-    mfxEncParams.mfx.FrameInfo.PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
-    mfxEncParams.mfx.FrameInfo.CropX = 0;
-    mfxEncParams.mfx.FrameInfo.CropY = 0;
-    mfxEncParams.mfx.FrameInfo.CropW = width;
-    mfxEncParams.mfx.FrameInfo.CropH = height;
-    // Width must be a multiple of 16
-    // Height must be a multiple of 16 in case of frame picture and a multiple of 32 in case of field picture
-    mfxEncParams.mfx.FrameInfo.Width = MSDK_ALIGN16(width);
-    mfxEncParams.mfx.FrameInfo.Height =
-        (MFX_PICSTRUCT_PROGRESSIVE == mfxEncParams.mfx.FrameInfo.PicStruct) ?
-        MSDK_ALIGN16(height) :
-        MSDK_ALIGN32(height);
-
-    mfxEncParams.IOPattern = MFX_IOPATTERN_IN_VIDEO_MEMORY;
-
-    // Configuration for low latency
-    mfxEncParams.AsyncDepth = 1;    //1 is best for low latency
-    mfxEncParams.mfx.GopRefDist = 1;        //1 is best for low latency, I and P frames only
-
-    mfxExtCodingOption extendedCodingOptions;
-    memset(&extendedCodingOptions, 0, sizeof(extendedCodingOptions));
-    extendedCodingOptions.Header.BufferId = MFX_EXTBUFF_CODING_OPTION;
-    extendedCodingOptions.Header.BufferSz = sizeof(extendedCodingOptions);
-    extendedCodingOptions.MaxDecFrameBuffering = 1;
-    mfxExtBuffer* extendedBuffers[1];
-    extendedBuffers[0] = (mfxExtBuffer*) & extendedCodingOptions;
-    mfxEncParams.ExtParam = extendedBuffers;
-    mfxEncParams.NumExtParam = 1;
-
-    // Validate video encode parameters (optional)
-    // - In this example the validation result is written to same structure
-    // - MFX_WRN_INCOMPATIBLE_VIDEO_PARAM is returned if some of the video parameters are not supported,
-    //   instead the encoder will select suitable parameters closest matching the requested configuration
-    sts = MFXVideoENCODE_Query(pCtx->session, &mfxEncParams, &mfxEncParams);
-    MSDK_IGNORE_MFX_STS(sts, MFX_WRN_INCOMPATIBLE_VIDEO_PARAM);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    // Initialize VPP parameters
-    mfxVideoParam VPPParams;
-    memset(&VPPParams, 0, sizeof(VPPParams));
-    // Input data
-    VPPParams.vpp.In.FourCC = MFX_FOURCC_RGB4;
-    VPPParams.vpp.In.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
-    VPPParams.vpp.In.CropX = 0;
-    VPPParams.vpp.In.CropY = 0;
-    VPPParams.vpp.In.CropW = width;
-    VPPParams.vpp.In.CropH = height;
-    VPPParams.vpp.In.PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
-    VPPParams.vpp.In.FrameRateExtN = 30;
-    VPPParams.vpp.In.FrameRateExtD = 1;
-    // width must be a multiple of 16
-    // height must be a multiple of 16 in case of frame picture and a multiple of 32 in case of field picture
-    VPPParams.vpp.In.Width = MSDK_ALIGN16(width);
-    VPPParams.vpp.In.Height =
-        (MFX_PICSTRUCT_PROGRESSIVE == VPPParams.vpp.In.PicStruct) ?
-        MSDK_ALIGN16(height) :
-        MSDK_ALIGN32(height);
-    // Output data
-    VPPParams.vpp.Out.FourCC = MFX_FOURCC_NV12;
-    VPPParams.vpp.Out.ChromaFormat = MFX_CHROMAFORMAT_YUV420;
-    VPPParams.vpp.Out.CropX = 0;
-    VPPParams.vpp.Out.CropY = 0;
-    VPPParams.vpp.Out.CropW = width;
-    VPPParams.vpp.Out.CropH = height;
-    VPPParams.vpp.Out.PicStruct = MFX_PICSTRUCT_PROGRESSIVE;
-    VPPParams.vpp.Out.FrameRateExtN = 30;
-    VPPParams.vpp.Out.FrameRateExtD = 1;
-    // width must be a multiple of 16
-    // height must be a multiple of 16 in case of frame picture and a multiple of 32 in case of field picture
-    VPPParams.vpp.Out.Width = MSDK_ALIGN16(VPPParams.vpp.Out.CropW);
-    VPPParams.vpp.Out.Height =
-        (MFX_PICSTRUCT_PROGRESSIVE == VPPParams.vpp.Out.PicStruct) ?
-        MSDK_ALIGN16(VPPParams.vpp.Out.CropH) :
-        MSDK_ALIGN32(VPPParams.vpp.Out.CropH);
-
-    VPPParams.IOPattern = MFX_IOPATTERN_IN_VIDEO_MEMORY | MFX_IOPATTERN_OUT_VIDEO_MEMORY;
-
-    // Query number of required surfaces for encoder
-    mfxFrameAllocRequest EncRequest;
-    memset(&EncRequest, 0, sizeof(EncRequest));
-    sts = MFXVideoENCODE_QueryIOSurf(pCtx->session, &mfxEncParams, &EncRequest);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    // Query number of required surfaces for VPP
-    mfxFrameAllocRequest VPPRequest[2];     // [0] - in, [1] - out
-    memset(&VPPRequest, 0, sizeof(mfxFrameAllocRequest) * 2);
-    sts = MFXVideoVPP_QueryIOSurf(pCtx->session, &VPPParams, VPPRequest);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    EncRequest.Type |= MFX_MEMTYPE_FROM_VPPOUT;     // surfaces are shared between VPP output and encode input
-
-    // Determine the required number of surfaces for VPP input and for VPP output (encoder input)
-    pCtx->nSurfNumVPPIn = VPPRequest[0].NumFrameSuggested;
-    pCtx->nSurfNumVPPOutEnc = EncRequest.NumFrameSuggested + VPPRequest[1].NumFrameSuggested;
-
-    EncRequest.NumFrameSuggested = pCtx->nSurfNumVPPOutEnc;
-
-    // Allocate required surfaces
-    sts = pCtx->mfxAllocator.Alloc(pCtx->mfxAllocator.pthis, &VPPRequest[0], &pCtx->mfxResponseVPPIn);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-    sts = pCtx->mfxAllocator.Alloc(pCtx->mfxAllocator.pthis, &EncRequest, &pCtx->mfxResponseVPPOutEnc);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    // Allocate required surfaces
-    mfxFrameAllocResponse mfxResponse ;
-    sts = pCtx->mfxAllocator.Alloc(pCtx->mfxAllocator.pthis, &EncRequest, &mfxResponse);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    // Allocate surface headers (mfxFrameSurface1) for VPPIn
-    pCtx->pmfxSurfacesVPPIn = (mfxFrameSurface1**)malloc(sizeof(mfxFrameSurface1*) * pCtx->nSurfNumVPPIn);
-    MSDK_CHECK_POINTER(pCtx->pmfxSurfacesVPPIn, MFX_ERR_MEMORY_ALLOC);
-    for (i = 0; i < pCtx->nSurfNumVPPIn; i++) {
-        pCtx->pmfxSurfacesVPPIn[i] = (mfxFrameSurface1*)malloc(sizeof(mfxFrameSurface1));
-        MSDK_CHECK_POINTER(pCtx->pmfxSurfacesVPPIn[i], MFX_ERR_MEMORY_ALLOC);
-        memset(pCtx->pmfxSurfacesVPPIn[i], 0, sizeof(mfxFrameSurface1));
-        memcpy(&(pCtx->pmfxSurfacesVPPIn[i]->Info), &(VPPParams.vpp.In), sizeof(mfxFrameInfo));
-        pCtx->pmfxSurfacesVPPIn[i]->Data.MemId = pCtx->mfxResponseVPPIn.mids[i];
-        ClearRGBSurfaceVMem(pCtx->pmfxSurfacesVPPIn[i]->Data.MemId);
-    }
-
-    pCtx->pVPPSurfacesVPPOutEnc = (mfxFrameSurface1**)malloc(sizeof(mfxFrameSurface1*) * pCtx->nSurfNumVPPOutEnc);
-    MSDK_CHECK_POINTER(pCtx->pVPPSurfacesVPPOutEnc, MFX_ERR_MEMORY_ALLOC);
-    for (i = 0; i < pCtx->nSurfNumVPPOutEnc; i++) {
-        pCtx->pVPPSurfacesVPPOutEnc[i] = (mfxFrameSurface1*)malloc(sizeof(mfxFrameSurface1));
-        MSDK_CHECK_POINTER(pCtx->pVPPSurfacesVPPOutEnc[i], MFX_ERR_MEMORY_ALLOC);
-        memset(pCtx->pVPPSurfacesVPPOutEnc[i], 0, sizeof(mfxFrameSurface1));
-        memcpy(&(pCtx->pVPPSurfacesVPPOutEnc[i]->Info), &(VPPParams.vpp.Out), sizeof(mfxFrameInfo));
-        pCtx->pVPPSurfacesVPPOutEnc[i]->Data.MemId = pCtx->mfxResponseVPPOutEnc.mids[i];
-    }
-
-    // Disable default VPP operations
-    mfxExtVPPDoNotUse extDoNotUse;
-    memset(&extDoNotUse, 0, sizeof(mfxExtVPPDoNotUse));
-    extDoNotUse.Header.BufferId = MFX_EXTBUFF_VPP_DONOTUSE;
-    extDoNotUse.Header.BufferSz = sizeof(mfxExtVPPDoNotUse);
-    extDoNotUse.NumAlg = 4;
-    extDoNotUse.AlgList = malloc(sizeof(mfxU32) * extDoNotUse.NumAlg);
-    MSDK_CHECK_POINTER(extDoNotUse.AlgList, MFX_ERR_MEMORY_ALLOC);
-    extDoNotUse.AlgList[0] = MFX_EXTBUFF_VPP_DENOISE;       // turn off denoising (on by default)
-    extDoNotUse.AlgList[1] = MFX_EXTBUFF_VPP_SCENE_ANALYSIS;        // turn off scene analysis (on by default)
-    extDoNotUse.AlgList[2] = MFX_EXTBUFF_VPP_DETAIL;        // turn off detail enhancement (on by default)
-    extDoNotUse.AlgList[3] = MFX_EXTBUFF_VPP_PROCAMP;       // turn off processing amplified (on by default)
-
-    // Add extended VPP buffers
-    mfxExtBuffer* extBuffers[1];
-    extBuffers[0] = (mfxExtBuffer*) & extDoNotUse;
-    VPPParams.ExtParam = extBuffers;
-    VPPParams.NumExtParam = 1;
-
-    // Initialize the Media SDK encoder
-    sts = MFXVideoENCODE_Init(pCtx->session, &mfxEncParams);
-    MSDK_IGNORE_MFX_STS(sts, MFX_WRN_PARTIAL_ACCELERATION);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    // Initialize Media SDK VPP
-    sts = MFXVideoVPP_Init(pCtx->session, &VPPParams);
-    MSDK_IGNORE_MFX_STS(sts, MFX_WRN_PARTIAL_ACCELERATION);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    // Retrieve video parameters selected by encoder.
-    // - BufferSizeInKB parameter is required to set bit stream buffer size
-    mfxVideoParam par;
-    memset(&par, 0, sizeof(par));
-    sts = MFXVideoENCODE_GetVideoParam(pCtx->session, &par);
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    // Prepare Media SDK bit stream buffer
-    memset(&pCtx->mfxBS, 0, sizeof(pCtx->mfxBS));
-    pCtx->mfxBS.MaxLength = par.mfx.BufferSizeInKB * 1000;
-    pCtx->mfxBS.Data = (mfxU8 *)malloc(sizeof(mfxU8) * pCtx->mfxBS.MaxLength);
-    MSDK_CHECK_POINTER(pCtx->mfxBS.Data, MFX_ERR_MEMORY_ALLOC);
-
-    free(extDoNotUse.AlgList);
-    extDoNotUse.AlgList = NULL;
-
-    return MFX_ERR_NONE;
-}
-
-static int h264_qsv_encoder_encode(h264_qsv_ctx **pctx, const int width,
-                    const int height, const unsigned char *rgb,
-                    unsigned char **pFrame, int *pFrameSize)
-{
-    mfxStatus sts;
-    int nEncSurfIdx;
-    int nVPPSurfIdx;
-    mfxSyncPoint syncpVPP, syncpEnc;
-    static int last_width = 0;
-    static int last_height = 0;
-    h264_qsv_ctx *pCtx;
-
-    sts = MFX_ERR_NONE;
-    nEncSurfIdx = 0;
-    nVPPSurfIdx = 0;
-
-    if (*pctx == NULL || width != last_width || height != last_height) {
-        if (*pctx != NULL) {
-            h264_qsv_encoder_fini(*pctx, width, height);
-            *pctx = NULL;
-        }
-        sts = h264_qsv_encoder_init(pctx, width, height);
-        MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-        last_width = width;
-        last_height = height;
-    }
-
-    pCtx = *pctx;
-
-    nVPPSurfIdx = GetFreeSurfaceIndex(pCtx->pmfxSurfacesVPPIn, pCtx->nSurfNumVPPIn);    // Find free input frame surface
-    MSDK_CHECK_ERROR(MFX_ERR_NOT_FOUND, nVPPSurfIdx, MFX_ERR_MEMORY_ALLOC);
-
-        // Surface locking required when read/write video surfaces
-    sts = pCtx->mfxAllocator.Lock(pCtx->mfxAllocator.pthis, pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx]->Data.MemId, &(pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx]->Data));
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    sts = LoadRawRGBFrameFromRGB(pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx], rgb, 4 * width * height);  // Load frame from file into surface
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    sts = pCtx->mfxAllocator.Unlock(pCtx->mfxAllocator.pthis, pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx]->Data.MemId, &(pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx]->Data));
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
-
-    nEncSurfIdx = GetFreeSurfaceIndex(pCtx->pVPPSurfacesVPPOutEnc, pCtx->nSurfNumVPPOutEnc);    // Find free output frame surface
-    MSDK_CHECK_ERROR(MFX_ERR_NOT_FOUND, nEncSurfIdx, MFX_ERR_MEMORY_ALLOC);
+    DisplayChannelClient *dcc = RCC_TO_DCC(rcc);
+    StreamAgent *agent = item->stream_agent;
+    H264Frame *frame = item->frame;
 
-    for (;;) {
-        // Process a frame asychronously (returns immediately)
-        sts = MFXVideoVPP_RunFrameVPPAsync(pCtx->session, pCtx->pmfxSurfacesVPPIn[nVPPSurfIdx], pCtx->pVPPSurfacesVPPOutEnc[nEncSurfIdx], NULL, &syncpVPP);
-        if (MFX_WRN_DEVICE_BUSY == sts) {
-            MSDK_SLEEP(1);  // Wait if device is busy, then repeat the same call
-        } else
-            break;
+    if (!agent->h264_pipeline || item->stream_serial != agent->h264_serial) {
+        return;
     }
+    if (!item->sized) {
+        SpiceMsgDisplayStreamData stream_data;
 
-    MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA, &item->link);
 
-    for (;;) {
-        // Encode a frame asychronously (returns immediately)
-        sts = MFXVideoENCODE_EncodeFrameAsync(pCtx->session, NULL, pCtx->pVPPSurfacesVPPOutEnc[nEncSurfIdx], &pCtx->mfxBS, &syncpEnc);
-
-        if (MFX_ERR_NONE < sts && !syncpEnc) {  // Repeat the call if warning and no output
-            if (MFX_WRN_DEVICE_BUSY == sts)
-                MSDK_SLEEP(1);  // Wait if device is busy, then repeat the same call
-        } else if (MFX_ERR_NONE < sts && syncpEnc) {
-            sts = MFX_ERR_NONE;     // Ignore warnings if output is available
-            break;
-        } else if (MFX_ERR_NOT_ENOUGH_BUFFER == sts) {
-            // Allocate more bitstream buffer memory here if needed...
-            break;
-        } else
-            break;
-    }
+        stream_data.base.id = get_stream_id(dcc->common.worker, agent->stream);
+        stream_data.base.multi_media_time = item->mm_time;
+        stream_data.data_size = frame->size;
+
+        spice_marshall_msg_display_stream_data(base_marshaller, &stream_data);
+    } else {
+        SpiceMsgDisplayStreamDataSized stream_data;
 
-    if (MFX_ERR_NONE == sts) {
-        sts = MFXVideoCORE_SyncOperation(pCtx->session, syncpEnc, 60000);   // Synchronize. Wait until encoded frame is ready
-        MSDK_CHECK_RESULT(sts, MFX_ERR_NONE, sts);
+        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA_SIZED, &item->link);
 
-        *pFrame = pCtx->mfxBS.Data + pCtx->mfxBS.DataOffset;
-        *pFrameSize = pCtx->mfxBS.DataLength;
-        pCtx->mfxBS.DataLength = 0;  //FIXME ZZQ must reset length here
+        stream_data.base.id = get_stream_id(dcc->common.worker, agent->stream);
+        stream_data.base.multi_media_time = item->mm_time;
+        stream_data.data_size = frame->size;
+        stream_data.width = frame->width;
+        stream_data.height = frame->height;
+        stream_data.dest = item->dest;
+
+        spice_marshall_msg_display_stream_data_sized(base_marshaller, &stream_data);
     }
+    item->sent = TRUE;
+    spice_marshaller_add_ref(base_marshaller, frame->data, frame->size);
+#ifdef STREAM_STATS
+    agent->stats.num_frames_sent++;
+    agent->stats.size_sent += frame->size;
+    agent->stats.end = item->mm_time;
+#endif
+}
+
+static void release_h264_frame_item(DisplayChannelClient *dcc, H264FrameItem *item)
+{
+    StreamAgent *agent = item->stream_agent;
 
-    return MFX_ERR_NONE;
+    if (!--item->refs) {
+        if (agent) {
+            /* the agent may serve another stream by now */
+            if (agent->h264_pipeline && item->stream_serial == agent->h264_serial) {
+                agent->h264_unsent_frames--;
+                if (item->sent) {
+                    h264_rate_control_notify_frame_sent(agent->h264_rate_control,
+                                                        item->frame->size);
+                }
+            }
+        } else {
+            if (!item->frame->slice) {
+                dcc->h264_unsent_frames--;
+            }
+            if (item->sent && dcc->h264_rate_control) {
+                h264_rate_control_notify_frame_sent(dcc->h264_rate_control, item->frame->size);
+            }
+        }
+        h264_frame_unref(item->frame);
+        free(item);
+    }
 }
 
-static int h264_encoder_encode(x264_t **ph, const uint8_t *rgb_data, const int width,
-                        const int height, x264_nal_t **nal, int *i_frame_size)
+static void red_push_h264_frame(DisplayChannelClient *dcc, H264Frame *frame)
 {
-    uint8_t *yuv;
-    int ret;
-    static int last_width = 0;
-    static int last_height = 0;
+    H264FrameItem *item;
 
-    x264_picture_t pic;
-    static x264_picture_t pic_out;
-    int luma_size;
-    int chroma_size;
-    static int i_frame = 0;
-    int i_nal;
+    item = spice_new(H264FrameItem, 1);
+    red_channel_pipe_item_init(dcc->common.base.channel, &item->link,
+                               PIPE_ITEM_TYPE_H264_FRAME);
+    item->refs = 1;
+    item->sent = FALSE;
+    item->frame = h264_frame_ref(frame);
+    item->stream_agent = NULL;
+    /* a frame counts once, with the item that completes it */
+    if (!frame->slice) {
+        dcc->h264_unsent_frames++;
+    }
+    red_channel_client_pipe_add_push(&dcc->common.base, &item->link);
+}
 
-    yuv = malloc(3 * width * height / 2);
-    if (yuv == NULL) {
-        fprintf(stderr, "Failed to allocate yuv buffer\n");
-        goto fail;
+#ifndef USE_VGA_MODE
+static int red_h264_pacer_tick(void *opaque, int settle);
+#endif
+
+static void handle_h264_frames(int fd, int event, void *opaque)
+{
+    DisplayChannelClient *dcc = RCC_TO_DCC((RedChannelClient *)opaque);
+    H264Frame *frame;
+
+    while ((frame = h264_pipeline_get_frame(dcc->h264_pipeline))) {
+        red_push_h264_frame(dcc, frame);
+        h264_frame_unref(frame);
     }
+}
+
+static void red_push_stream_h264_frame(DisplayChannelClient *dcc, StreamAgent *agent,
+                                       H264Frame *frame)
+{
+    H264StreamFrameInfo *info = &agent->h264_frame_infos[frame->frame_id %
+                                                         H264_STREAM_FRAME_INFOS];
+    H264FrameItem *item;
 
-    ret = rgb2yuv(rgb_data, width, height, yuv);
-    if (ret != 0) {
-        fprintf(stderr, "Failed to transfer rgb to yuv\n");
-        goto fail;
+    /* its info went to a later frame: it is lost, and the frames after it
+     * refer to it */
+    if (info->frame_id != frame->frame_id) {
+        h264_pipeline_request_keyframe(agent->h264_pipeline);
+        return;
     }
+    item = spice_new(H264FrameItem, 1);
+    red_channel_pipe_item_init(dcc->common.base.channel, &item->link,
+                               PIPE_ITEM_TYPE_H264_FRAME);
+    item->refs = 1;
+    item->sent = FALSE;
+    item->frame = h264_frame_ref(frame);
+    item->stream_agent = agent;
+    item->stream_serial = agent->h264_serial;
+    item->mm_time = info->mm_time;
+    item->sized = info->sized;
+    item->dest = info->dest;
+    agent->h264_unsent_frames++;
+    red_channel_client_pipe_add_push(&dcc->common.base, &item->link);
+}
 
-    if (width % 2 != 0 || height %2 != 0)
-        return 0;
+static void handle_stream_h264_frames(int fd, int event, void *opaque)
+{
+    DisplayChannelClient *dcc = RCC_TO_DCC((RedChannelClient *)opaque);
+    H264Frame *frame;
+    int i;
+
+    for (i = 0; i < NUM_STREAMS; i++) {
+        StreamAgent *agent = &dcc->stream_agents[i];
 
-    if (*ph == NULL || width != last_width || height != last_height) {
-        if (*ph != NULL) {
-            x264_encoder_close(*ph);
-            *ph = NULL;
+        if (!agent->h264_pipeline || h264_pipeline_get_fd(agent->h264_pipeline) != fd) {
+            continue;
         }
-        *ph = h264_encoder_init(width, height);
-        if (*ph == NULL) {
-            fprintf(stderr, "Failed to init h264 encoder\n");
-            goto fail;
+        while ((frame = h264_pipeline_get_frame(agent->h264_pipeline))) {
+            red_push_stream_h264_frame(dcc, agent, frame);
+            h264_frame_unref(frame);
         }
-        last_width = width;
-        last_height = height;
+        return;
     }
+}
 
-    luma_size = width * height;
-    chroma_size = luma_size / 4;
+/* In hybrid mode every h264 stream has its own pipeline, its codec starts
+ * over with the stream */
+static int red_display_stream_agent_init_h264(DisplayChannelClient *dcc, StreamAgent *agent,
+                                              Stream *stream)
+{
+    agent->h264_pipeline = h264_pipeline_new(&h264_codec, H264_MAX_PENDING_FRAMES);
+    if (!agent->h264_pipeline) {
+        return FALSE;
+    }
+    agent->h264_watch = worker_watch_add(h264_pipeline_get_fd(agent->h264_pipeline),
+                                         SPICE_WATCH_EVENT_READ, handle_stream_h264_frames,
+                                         &dcc->common.base);
+    if (!agent->h264_watch) {
+        h264_pipeline_destroy(agent->h264_pipeline);
+        agent->h264_pipeline = NULL;
+        return FALSE;
+    }
+    agent->h264_rate_control = h264_rate_control_new(red_stream_get_initial_bit_rate(dcc, stream),
+                                                     MAX_FPS);
+    h264_pipeline_set_rate(agent->h264_pipeline,
+                           h264_rate_control_get_bit_rate(agent->h264_rate_control),
+                           h264_rate_control_get_fps(agent->h264_rate_control));
+    agent->h264_serial++;
+    agent->h264_unsent_frames = 0;
+    return TRUE;
+}
 
-    if (x264_picture_alloc(&pic, X264_CSP_I420, width, height) < 0) {
-        fprintf(stderr, "Failed to allocate for x264 picture\n");
-        goto fail;
+static H264Pipeline *red_display_client_get_h264_pipeline(DisplayChannelClient *dcc)
+{
+    if (dcc->h264_pipeline) {
+        return dcc->h264_pipeline;
     }
-    pic.i_pts = i_frame++;
 
-    memcpy(pic.img.plane[0], yuv, luma_size);
-    memcpy(pic.img.plane[1], yuv + luma_size, chroma_size);
-    memcpy(pic.img.plane[2], yuv + luma_size + chroma_size, chroma_size);
+    dcc->h264_pipeline = h264_pipeline_new(&h264_codec, H264_MAX_PENDING_FRAMES);
+    if (!dcc->h264_pipeline) {
+        return NULL;
+    }
+    /* the last slice of a frame goes with its dirty rects */
+    if (red_channel_client_test_remote_cap(&dcc->common.base, SPICE_DISPLAY_CAP_H264_SLICES) &&
+        red_channel_client_test_remote_cap(&dcc->common.base,
+                                           SPICE_DISPLAY_CAP_H264_DIRTY_RECTS)) {
+        h264_pipeline_enable_slices(dcc->h264_pipeline);
+    }
+    dcc->h264_watch = worker_watch_add(h264_pipeline_get_fd(dcc->h264_pipeline),
+                                       SPICE_WATCH_EVENT_READ, handle_h264_frames,
+                                       &dcc->common.base);
+    if (!dcc->h264_watch) {
+        goto error;
+    }
+#ifndef USE_VGA_MODE
+    dcc->h264_pacer = h264_pacer_new(dcc->common.worker->h264_max_fps, H264_REFINE_DELAY_MS,
+                                     red_h264_pacer_tick, dcc);
+    if (!dcc->h264_pacer) {
+        worker_watch_remove(dcc->h264_watch);
+        dcc->h264_watch = NULL;
+        goto error;
+    }
+#endif
+    /* leave some of the bandwidth to the other messages, as streams do */
+    dcc->h264_rate_control = h264_rate_control_new(
+        RED_STREAM_CHANNEL_CAPACITY * red_display_client_get_initial_bit_rate(dcc),
+        dcc->common.worker->h264_max_fps);
+    h264_pipeline_set_rate(dcc->h264_pipeline,
+                           h264_rate_control_get_bit_rate(dcc->h264_rate_control),
+                           h264_rate_control_get_fps(dcc->h264_rate_control));
+#ifndef USE_VGA_MODE
+    h264_pacer_set_fps(dcc->h264_pacer, h264_rate_control_get_fps(dcc->h264_rate_control));
+#endif
+    return dcc->h264_pipeline;
 
-    *i_frame_size = x264_encoder_encode(*ph, nal, &i_nal, &pic, &pic_out);
+error:
+    h264_pipeline_destroy(dcc->h264_pipeline);
+    dcc->h264_pipeline = NULL;
+    return NULL;
+}
 
-    x264_picture_clean(&pic);
+static void red_display_client_destroy_h264(DisplayChannelClient *dcc)
+{
+    if (dcc->h264_pipeline) {
+#ifndef USE_VGA_MODE
+        h264_pacer_destroy(dcc->h264_pacer);
+        dcc->h264_pacer = NULL;
+#endif
+        worker_watch_remove(dcc->h264_watch);
+        dcc->h264_watch = NULL;
+        /* waits for the frame being encoded, if any */
+        h264_pipeline_destroy(dcc->h264_pipeline);
+        dcc->h264_pipeline = NULL;
+        h264_rate_control_destroy(dcc->h264_rate_control);
+        dcc->h264_rate_control = NULL;
+    }
+    region_destroy(&dcc->h264_dirty_region);
+#ifndef USE_VGA_MODE
+    region_destroy(&dcc->h264_lossy_region);
+#endif
+}
 
-    free(yuv);
-    yuv = NULL;
+/* re-evaluate the rate and hand it to the encoder and the pacer */
+static void red_h264_update_rate(DisplayChannelClient *dcc)
+{
+    uint32_t fps;
 
-    return 0;
-fail:
-    if (yuv != NULL) {
-        free(yuv);
-        yuv = NULL;
+    if (!h264_rate_control_update(dcc->h264_rate_control)) {
+        return;
     }
-
-    return -1;
+    fps = h264_rate_control_get_fps(dcc->h264_rate_control);
+    h264_pipeline_set_rate(dcc->h264_pipeline,
+                           h264_rate_control_get_bit_rate(dcc->h264_rate_control), fps);
+#ifndef USE_VGA_MODE
+    h264_pacer_set_fps(dcc->h264_pacer, fps);
+#endif
 }
 
-int h264_qsv_encoder_fini(h264_qsv_ctx *pCtx)
+/*
+ * Let the device pace its refreshes on the h264 clients: the rate they encode
+ * at and how many frames they are behind. Only calls back on changes, and
+ * once a new primary surface is created.
+ */
+static void red_update_display_feedback(RedWorker *worker)
 {
-    int i;
-    // ===================================================================
-    // Clean up resources
-    //  - It is recommended to close Media SDK components first, before releasing allocated surfaces, since
-    //    some surfaces may still be locked by internal Media SDK resources.
+    QXLInterface *qif = worker->qxl->st->qif;
+    QXLDisplayFeedback feedback = {0, 0, H264_MAX_UNSENT_FRAMES};
+    DisplayChannelClient *dcc;
+    RingItem *link, *next;
+    int have_client = FALSE;
 
-    MFXVideoENCODE_Close(pCtx->session);
-    MFXVideoVPP_Close(pCtx->session);
-    // pCtx->session closed automatically on destruction
+    if (qif->base.major_version < 3 ||
+        (qif->base.major_version == 3 && qif->base.minor_version < 4) ||
+        !qif->set_display_feedback) {
+        return;
+    }
+    if (worker->enable_avc == SPICE_AVC_MODE_FULL) {
+        WORKER_FOREACH_DCC_SAFE(worker, link, next, dcc) {
+            uint32_t interval;
+            uint32_t pending;
 
-    for (i = 0; i < pCtx->nSurfNumVPPIn; i++) {
-        free(pCtx->pmfxSurfacesVPPIn[i]);
-        pCtx->pmfxSurfacesVPPIn[i] = NULL;
+            if (!dcc->h264_pipeline) {
+                continue;
+            }
+            interval = 1000 / MAX(h264_rate_control_get_fps(dcc->h264_rate_control), 1);
+            pending = dcc->h264_unsent_frames + h264_pipeline_get_pending(dcc->h264_pipeline);
+            if (!have_client || interval < feedback.frame_interval_ms) {
+                feedback.frame_interval_ms = interval;
+            }
+            if (!have_client || pending < feedback.pending_frames) {
+                feedback.pending_frames = pending;
+            }
+            have_client = TRUE;
+        }
     }
-    free(pCtx->pmfxSurfacesVPPIn);
-    pCtx->pmfxSurfacesVPPIn = NULL;
-    for (i = 0; i < pCtx->nSurfNumVPPOutEnc; i++) {
-        free(pCtx->pVPPSurfacesVPPOutEnc[i]);
-        pCtx->pVPPSurfacesVPPOutEnc[i] = NULL;
+    if (memcmp(&feedback, &worker->display_feedback, sizeof(feedback)) == 0) {
+        return;
     }
-    free(pCtx->pVPPSurfacesVPPOutEnc);
-    pCtx->pVPPSurfacesVPPOutEnc = NULL;
-    free(pCtx->mfxBS.Data);
-    pCtx->mfxBS.Data = NULL;
-
-    pCtx->mfxAllocator.Free(pCtx->mfxAllocator.pthis, &pCtx->mfxResponseVPPIn);
-    pCtx->mfxAllocator.Free(pCtx->mfxAllocator.pthis, &pCtx->mfxResponseVPPOutEnc);
-
-    Release();
-
-    free(pCtx);
-
-    return 0;
+    worker->display_feedback = feedback;
+    qif->set_display_feedback(worker->qxl, &feedback);
 }
 
-static void h264_send(RedChannelClient *rcc, SpiceMarshaller *base_marshaller,
-                uint8_t *data, int data_size, const int surface_id,
-                const int width, const int height, const uint8_t flags)
+#ifndef USE_VGA_MODE
+/* hand the damage drawn since the last call to every client */
+static void red_h264_distribute_damage(RedWorker *worker, RedSurface *surface)
 {
     DisplayChannelClient *dcc;
-    SpiceMsgDisplayH264StreamData stream_data;
+    RingItem *link, *next;
 
-    red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_H264_STREAM_DATA, NULL);
+    if (region_is_empty(&surface->h264_dirty_region)) {
+        return;
+    }
+    WORKER_FOREACH_DCC_SAFE(worker, link, next, dcc) {
+        region_or(&dcc->h264_dirty_region, &surface->h264_dirty_region);
+    }
+    region_clear(&surface->h264_dirty_region);
+}
+
+/* The primary surface changed, the client gets a frame at its next tick */
+static void red_h264_kick(DisplayChannelClient *dcc)
+{
+    if (red_display_client_get_h264_pipeline(dcc)) {
+        h264_pacer_kick(dcc->h264_pacer);
+    }
+}
 
-    stream_data.base.surface_id = surface_id;
-    stream_data.base.width = width;
-    stream_data.base.height = height;
-    stream_data.data_size = data_size;
-    stream_data.base.flags = flags;
+/* The client lost track of the stream: the next frame is an IDR of the
+ * whole surface, even if the screen stands still */
+static void red_h264_refresh(DisplayChannelClient *dcc)
+{
+    RedSurface *surface = &dcc->common.worker->surfaces[0];
+    SpiceRect surface_rect = {0, 0, surface->context.width, surface->context.height};
 
-    spice_marshall_msg_display_h264_stream_data(base_marshaller, &stream_data);
-    spice_marshaller_add_ref(base_marshaller, data, data_size);
+    if (!dcc->h264_pipeline || !surface->context.canvas) {
+        return;
+    }
+    h264_pipeline_request_keyframe(dcc->h264_pipeline);
+    region_add(&dcc->h264_dirty_region, &surface_rect);
+    red_h264_kick(dcc);
 }
 
-static inline int red_marshall_stream_h264_data(RedChannelClient *rcc,
-                  SpiceMarshaller *base_marshaller, Drawable *drawable)
+/* Snapshot the primary surface for the client's encoder thread. The encoded
+ * frame is pushed to the client by handle_h264_frames() */
+static int red_h264_pacer_tick(void *opaque, int settle)
 {
-    SpiceImage *copy_image;
-    SpiceChunk *chunk;
-    int width, height;
-    int ret;
-    uint8_t *rgb_data;
-    SpiceRect *src_rect;
-    int frame_size;
-    unsigned char *frame;
-    x264_nal_t *nal;
-    int surface_id;
-    DisplayChannel *display_channel;
-    SpiceCanvas *canvas;
+    DisplayChannelClient *dcc = opaque;
+    RedWorker *worker = dcc->common.worker;
+    RedSurface *surface = &worker->surfaces[0];
+    SpiceCanvas *canvas = surface->context.canvas;
     pixman_image_t *image;
+    uint8_t *rgb_data;
+    int width, height;
     int stride;
-    uint8_t flags;
-    x264_t **ph;
-    h264_qsv_ctx **pctx;
 
-    //FIXME: for compatibilities of insert_h264_frame
-    surface_id = 0;
-    //surface_id = drawable->red_drawable->surface_id;
-    display_channel = SPICE_CONTAINEROF(rcc->channel, DisplayChannel, common.base);
-
-//ZZQ try to drop the too nearest frame(make sure that <= 30fps)
-#ifndef USE_VGA_MODE
-    RedWorker *worker = display_channel->common.worker;
-    struct timeval time;
-    static int cnt = 0;
-    static int total = 0;
-    total++;
-    if (cnt % 10 == 0) {
-        fprintf(stderr, "[ZZQ] drop %d frames, total = %d\n", cnt, total);
-    }
-    spice_assert(gettimeofday(&time, NULL) == 0);
-    if (time.tv_sec == worker->last_time.tv_sec
-            && time.tv_usec - worker->last_time.tv_usec <= 33000) {
-        cnt++;
-        display_channel->common.worker->last_drop = TRUE;
-        return TRUE;
-    } else if(time.tv_sec == worker->last_time.tv_sec + 1
-            && time.tv_usec + 1000000 - worker->last_time.tv_usec <= 33000 ){
-        cnt++;
-        display_channel->common.worker->last_drop = TRUE;
+    if (!canvas) {
         return TRUE;
     }
-    else {
-        display_channel->common.worker->last_drop = FALSE;
-        worker->last_time = time;
+    red_h264_distribute_damage(worker, surface);
+    if (settle) {
+        /* the motion stopped: refine what the client holds at motion quality */
+        region_or(&dcc->h264_dirty_region, &dcc->h264_lossy_region);
+    }
+    if (region_is_empty(&dcc->h264_dirty_region)) {
+        return TRUE;
     }
-#endif
 
-#ifndef USE_VGA_MODE
-    canvas = display_channel->common.worker->surfaces[surface_id].context.canvas;
+    red_h264_update_rate(dcc);
+    /* the socket does not keep up: queueing more frames only adds lag. The
+     * damage is kept for the next frame. */
+    if (dcc->h264_unsent_frames >= H264_MAX_UNSENT_FRAMES ||
+        red_h264_socket_is_congested(&dcc->common.base,
+                                     h264_rate_control_get_bit_rate(dcc->h264_rate_control))) {
+        h264_rate_control_notify_server_frame_drop(dcc->h264_rate_control);
+        return FALSE;
+    }
 
     image = sw_canvas_get_image(canvas);
     rgb_data = (uint8_t *)pixman_image_get_data(image);
@@ -9268,8 +9621,35 @@ static inline int red_marshall_stream_h264_data(RedChannelClient *rcc,
     spice_assert(stride < 0);
     rgb_data += stride * (height - 1);
     stride = - stride;
-    flags = 0;
+
+    /* on refusal the damage is kept for the retry */
+    if (!h264_pipeline_submit(dcc->h264_pipeline, 0, 0, rgb_data, width, height, stride, 0,
+                              &dcc->h264_dirty_region, settle)) {
+        return FALSE;
+    }
+    if (settle) {
+        region_clear(&dcc->h264_lossy_region);
+    } else {
+        region_or(&dcc->h264_lossy_region, &dcc->h264_dirty_region);
+    }
+    region_clear(&dcc->h264_dirty_region);
+    return TRUE;
+}
 #else
+/* The drawable's bitmap is the frame. It is gone by the next try, so a
+ * frame the encoder has no room for is lost, but its damage is kept for the
+ * next one */
+static int red_h264_submit_frame(DisplayChannelClient *dcc, Drawable *drawable)
+{
+    SpiceImage *copy_image;
+    SpiceChunk *chunk;
+    SpiceRect *src_rect;
+    SpiceClip *clip;
+    H264Pipeline *pipeline;
+    int width, height;
+    int stride;
+    int i;
+
     spice_assert(drawable->red_drawable->type == QXL_DRAW_COPY);
 
     copy_image = drawable->red_drawable->u.copy.src_bitmap;
@@ -9283,43 +9663,42 @@ static inline int red_marshall_stream_h264_data(RedChannelClient *rcc,
     height = src_rect->bottom - src_rect->top;
 
     stride = copy_image->u.bitmap.stride;
-    flags = copy_image->u.bitmap.flags;
 
     chunk = &copy_image->u.bitmap.data->chunk[0];
-    rgb_data = chunk->data;
-#endif
-
-#ifndef USE_H264_QSV
-    ph = &(display_channel->common.worker->x264_h);
 
-    ret = h264_encoder_encode(ph, rgb_data, width, height, &nal, &frame_size);
-    if (ret != 0) {
-        fprintf(stderr, "Failed to encode a h264 frame\n");
-        goto fail;
+    pipeline = red_display_client_get_h264_pipeline(dcc);
+    if (!pipeline) {
+        return FALSE;
     }
 
-    h264_send(rcc, base_marshaller, nal->p_payload, frame_size, surface_id,
-            width, height, flags);
-
-    return TRUE;
-#else
-    pctx = &(display_channel->common.worker->qsv_ctx);
+    /* qemu sends the whole screen with the part that changed as clip, in
+     * surface coordinates as the damage is. The pipeline maps them to the
+     * lines of the bitmap, top down or not as its flags say */
+    clip = &drawable->red_drawable->clip;
+    if (clip->type == SPICE_CLIP_TYPE_RECTS) {
+        for (i = 0; i < clip->rects->num_rects; i++) {
+            region_add(&dcc->h264_dirty_region, &clip->rects->rects[i]);
+        }
+    } else {
+        SpiceRect all = {0, 0, width, height};
 
-    ret = h264_qsv_encoder_encode(pctx, width, height, rgb_data,
-                            &frame, &frame_size);
-    if (ret != 0) {
-        fprintf(stderr, "Failed to encode a h264 frame\n");
-        goto fail;
+        region_add(&dcc->h264_dirty_region, &all);
     }
-    h264_send(rcc, base_marshaller, frame, frame_size, surface_id,
-            width, height, flags);
 
+    red_h264_update_rate(dcc);
+    if (dcc->h264_unsent_frames >= H264_MAX_UNSENT_FRAMES ||
+        red_h264_socket_is_congested(&dcc->common.base,
+                                     h264_rate_control_get_bit_rate(dcc->h264_rate_control))) {
+        h264_rate_control_notify_server_frame_drop(dcc->h264_rate_control);
+        return TRUE;
+    }
+    if (h264_pipeline_submit(pipeline, 0, 0, chunk->data, width, height, stride,
+                             copy_image->u.bitmap.flags, &dcc->h264_dirty_region, FALSE)) {
+        region_clear(&dcc->h264_dirty_region);
+    }
     return TRUE;
-#endif
-
-fail:
-    return FALSE;
 }
+#endif
 
 static inline void marshall_qxl_drawable(RedChannelClient *rcc,
     SpiceMarshaller *m, DrawablePipeItem *dpi)
@@ -9330,8 +9709,13 @@ static inline void marshall_qxl_drawable(RedChannelClient *rcc,
     spice_assert(display_channel && rcc);
     /* allow sized frames to be streamed, even if they where replaced by another frame, since
      * newer frames might not cover sized frames completely if they are bigger */
-    if (display_channel->common.worker->enable_avc) {
-        spice_assert(red_marshall_stream_h264_data(rcc, m, item));
+    if (display_channel->common.worker->enable_avc == SPICE_AVC_MODE_FULL) {
+        /* the encoded frame is pushed on its own once the encoder is done */
+#ifndef USE_VGA_MODE
+        red_h264_kick(RCC_TO_DCC(rcc));
+#else
+        red_h264_submit_frame(RCC_TO_DCC(rcc), item);
+#endif
     } else {
         if ((item->stream || item->sized_stream) && red_marshall_stream_data(rcc, m, item)) {
             return;
@@ -9654,7 +10038,7 @@ static void red_display_marshall_stream_start(RedChannelClient *rcc,
     stream_create.surface_id = 0;
     stream_create.id = get_stream_id(dcc->common.worker, stream);
     stream_create.flags = stream->top_down ? SPICE_STREAM_FLAGS_TOP_DOWN : 0;
-    stream_create.codec_type = SPICE_VIDEO_CODEC_TYPE_MJPEG;
+    stream_create.codec_type = agent->codec_type;
 
     stream_create.src_width = stream->width;
     stream_create.src_height = stream->height;
@@ -9939,6 +10323,16 @@ static void display_channel_send_item(RedChannelClient *rcc, PipeItem *pipe_item
         red_marshall_stream_activate_report(rcc, m, report_item->stream_id);
         break;
     }
+    case PIPE_ITEM_TYPE_H264_FRAME: {
+        H264FrameItem *frame_item = (H264FrameItem *)pipe_item;
+
+        if (frame_item->stream_agent) {
+            red_marshall_stream_h264_frame(rcc, m, frame_item);
+        } else {
+            red_marshall_h264_frame(rcc, m, frame_item);
+        }
+        break;
+    }
     default:
         spice_error("invalid pipe item type");
     }
@@ -10083,6 +10477,9 @@ static void display_channel_client_on_disconnect(RedChannelClient *rcc)
     red_display_reset_compress_buf(dcc);
     free(dcc->send_data.free_list.res);
     red_display_destroy_streams_agents(dcc);
+    red_display_client_destroy_h264(dcc);
+    /* the clients left may not need what the cache holds, if more than one */
+    red_display_flush_compressed_images(display_channel);
 
     // this was the last channel client
     if (!red_channel_is_connected(rcc->channel)) {
@@ -10290,6 +10687,7 @@ static inline void red_create_surface(RedWorker *worker, uint32_t surface_id, ui
                                       void *line_0, int data_is_valid, int send_client)
 {
     RedSurface *surface = &worker->surfaces[surface_id];
+    SpiceRect surface_rect;
     uint32_t i;
 
     spice_warn_if(surface->context.canvas);
@@ -10313,6 +10711,11 @@ static inline void red_create_surface(RedWorker *worker, uint32_t surface_id, ui
     ring_init(&surface->current_list);
     ring_init(&surface->depend_on_me);
     region_init(&surface->draw_dirty_region);
+    region_init(&surface->h264_dirty_region);
+    surface_rect.left = surface_rect.top = 0;
+    surface_rect.right = width;
+    surface_rect.bottom = height;
+    region_add(&surface->h264_dirty_region, &surface_rect);
     surface->refs = 1;
     if (worker->renderer != RED_RENDERER_INVALID) {
         surface->context.canvas = create_canvas_for_surface(worker, surface, worker->renderer,
@@ -10908,7 +11311,7 @@ static int display_channel_handle_stream_report(DisplayChannelClient *dcc,
         return FALSE;
     }
     stream_agent = &dcc->stream_agents[stream_report->stream_id];
-    if (!stream_agent->mjpeg_encoder) {
+    if (!stream_agent->mjpeg_encoder && !stream_agent->h264_rate_control) {
         spice_info("stream_report: no encoder for stream id %u."
                     "Probably the stream has been destroyed", stream_report->stream_id);
         return TRUE;
@@ -10919,6 +11322,13 @@ static int display_channel_handle_stream_report(DisplayChannelClient *dcc,
                       stream_agent->report_id, stream_report->unique_id);
         return TRUE;
     }
+    if (stream_agent->h264_rate_control) {
+        h264_rate_control_notify_client_report(stream_agent->h264_rate_control,
+                                               stream_report->num_frames,
+                                               stream_report->num_drops,
+                                               stream_report->last_frame_delay);
+        return TRUE;
+    }
     mjpeg_encoder_client_stream_report(stream_agent->mjpeg_encoder,
                                        stream_report->num_frames,
                                        stream_report->num_drops,
@@ -10954,11 +11364,42 @@ static int display_channel_handle_avc(DisplayChannelClient *dcc,
         SpiceMsgcDisplayAvc *pc) {
     DisplayChannel *display_channel = DCC_TO_DC(dcc);
 
+    if (pc->enable_avc >= SPICE_AVC_MODE_ENUM_END) {
+        spice_warning("invalid avc mode %u", pc->enable_avc);
+        return FALSE;
+    }
     display_channel->common.worker->enable_avc = pc->enable_avc;
 
     return TRUE;
 }
 
+static int display_channel_handle_h264_keyframe_request(DisplayChannelClient *dcc,
+        SpiceMsgcDisplayH264KeyframeRequest *request)
+{
+    StreamAgent *agent;
+
+    if (request->stream_id == SPICE_H264_FULL_SCREEN_STREAM_ID) {
+#ifndef USE_VGA_MODE
+        red_h264_refresh(dcc);
+#else
+        if (dcc->h264_pipeline) {
+            h264_pipeline_request_keyframe(dcc->h264_pipeline);
+        }
+#endif
+        return TRUE;
+    }
+    if (request->stream_id >= NUM_STREAMS) {
+        spice_warning("h264 keyframe request: invalid stream id %u", request->stream_id);
+        return FALSE;
+    }
+    agent = &dcc->stream_agents[request->stream_id];
+    /* the stream may have been destroyed, or gone back to mjpeg */
+    if (agent->h264_pipeline) {
+        h264_pipeline_request_keyframe(agent->h264_pipeline);
+    }
+    return TRUE;
+}
+
 static int display_channel_handle_message(RedChannelClient *rcc, uint32_t size, uint16_t type,
                                           void *message)
 {
@@ -10981,6 +11422,9 @@ static int display_channel_handle_message(RedChannelClient *rcc, uint32_t size,
 
     case SPICE_MSGC_DISPLAY_AVC:
         return display_channel_handle_avc(dcc, (SpiceMsgcDisplayAvc *)message);
+    case SPICE_MSGC_DISPLAY_H264_KEYFRAME_REQUEST:
+        return display_channel_handle_h264_keyframe_request(dcc,
+            (SpiceMsgcDisplayH264KeyframeRequest *)message);
 
     default:
         return red_channel_client_handle_message(rcc, size, type, message);
@@ -11242,6 +11686,9 @@ static void display_channel_hold_pipe_item(RedChannelClient *rcc, PipeItem *item
     case PIPE_ITEM_TYPE_IMAGE:
         ((ImageItem *)item)->refs++;
         break;
+    case PIPE_ITEM_TYPE_H264_FRAME:
+        ((H264FrameItem *)item)->refs++;
+        break;
     default:
         spice_critical("invalid item type");
     }
@@ -11265,6 +11712,9 @@ static void display_channel_client_release_item_after_push(DisplayChannelClient
     case PIPE_ITEM_TYPE_IMAGE:
         release_image_item((ImageItem *)item);
         break;
+    case PIPE_ITEM_TYPE_H264_FRAME:
+        release_h264_frame_item(dcc, (H264FrameItem *)item);
+        break;
     case PIPE_ITEM_TYPE_VERB:
         free(item);
         break;
@@ -11313,6 +11763,9 @@ static void display_channel_client_release_item_before_push(DisplayChannelClient
     case PIPE_ITEM_TYPE_IMAGE:
         release_image_item((ImageItem *)item);
         break;
+    case PIPE_ITEM_TYPE_H264_FRAME:
+        release_h264_frame_item(dcc, (H264FrameItem *)item);
+        break;
     case PIPE_ITEM_TYPE_CREATE_SURFACE: {
         SurfaceCreateItem *surface_create = SPICE_CONTAINEROF(item, SurfaceCreateItem,
                                                               pipe_item);
@@ -11395,7 +11848,11 @@ static void display_channel_create(RedWorker *worker, int migrate)
                                                              "add_to_cache", TRUE);
     display_channel->non_cache_counter = stat_add_counter(display_channel->stat,
                                                           "non_cache", TRUE);
+    display_channel->compressed_image_hits_counter = stat_add_counter(display_channel->stat,
+                                                                      "compressed_image_hits",
+                                                                      TRUE);
 #endif
+    ring_init(&display_channel->compressed_images_lru);
     stat_compress_init(&display_channel->lz_stat, lz_stat_name);
     stat_compress_init(&display_channel->glz_stat, glz_stat_name);
     stat_compress_init(&display_channel->quic_stat, quic_stat_name);
@@ -11512,21 +11969,21 @@ static void handle_new_display_channel(RedWorker *worker, RedClient *client, Red
     // todo: tune level according to bandwidth
     display_channel->zlib_level = ZLIB_DEFAULT_COMPRESSION_LEVEL;
     red_display_client_init_streams(dcc);
-    //ZZQ close old x264 handler
-    if (worker->x264_h != NULL) {
-        x264_encoder_close(worker->x264_h);
-        worker->x264_h = NULL;
-    }
-#ifdef USE_H264_QSV
-    if (worker->qsv_ctx != NULL) {
-        h264_qsv_encoder_fini(worker->qsv_ctx);
-        worker->qsv_ctx = NULL;
-    }
-#endif
+    /* the client encoder is created on the first frame, it starts with an
+     * IDR of the whole surface */
+    region_init(&dcc->h264_dirty_region);
 #ifndef USE_VGA_MODE
-    worker->last_drop = FALSE;
-    worker->last_time.tv_sec = 0;
-    worker->last_time.tv_usec = 0;
+    region_init(&dcc->h264_lossy_region);
+    if (worker->surfaces[0].context.canvas) {
+        RedSurface *surface = &worker->surfaces[0];
+        SpiceRect surface_rect = {0, 0, surface->context.width, surface->context.height};
+
+        region_add(&dcc->h264_dirty_region, &surface_rect);
+        if (worker->enable_avc == SPICE_AVC_MODE_FULL) {
+            /* the screen may stand still, do not wait for a drawable */
+            red_h264_kick(dcc);
+        }
+    }
 #endif
     on_new_display_channel_client(dcc);
 }
@@ -12043,6 +12500,10 @@ static void dev_create_primary_surface(RedWorker *worker, uint32_t surface_id,
     red_create_surface(worker, 0, surface.width, surface.height, surface.stride, surface.format,
                        line_0, surface.flags & QXL_SURF_FLAG_KEEP_DATA, TRUE);
     set_monitors_config_to_primary(worker);
+    /* the device drops the feedback while it has no use for it, e.g. out
+     * of vga mode. A real one never matches a zeroed one, whose
+     * max_pending_frames is 0, so the next update gives it again */
+    memset(&worker->display_feedback, 0, sizeof(worker->display_feedback));
 
     if (display_is_connected(worker) && !worker->display_channel->common.during_target_migrate) {
         /* guest created primary, so it will (hopefully) send a monitors_config
@@ -12262,7 +12723,13 @@ void handle_dev_reset_cursor(void *opaque, void *payload)
 
 void handle_dev_reset_image_cache(void *opaque, void *payload)
 {
-    image_cache_reset(&((RedWorker *)opaque)->image_cache);
+    RedWorker *worker = opaque;
+
+    image_cache_reset(&worker->image_cache);
+    /* the guest may reuse the ids */
+    if (worker->display_channel) {
+        red_display_flush_compressed_images(worker->display_channel);
+    }
 }
 
 void handle_dev_destroy_surface_wait_async(void *opaque, void *payload)
@@ -12799,6 +13266,25 @@ static void handle_dev_input(int fd, int event, void *opaque)
     dispatcher_handle_recv_read(red_dispatcher_get_dispatcher(worker->red_dispatcher));
 }
 
+static uint32_t red_h264_get_max_fps(void)
+{
+    char *env_max_fps_str;
+    long max_fps;
+
+    env_max_fps_str = getenv("SPICE_H264_MAX_FPS");
+    if (env_max_fps_str == NULL) {
+        return H264_DEFAULT_MAX_FPS;
+    }
+    errno = 0;
+    max_fps = strtol(env_max_fps_str, NULL, 10);
+    if (errno != 0 || max_fps < 1 || max_fps > H264_MAX_MAX_FPS) {
+        spice_warning("invalid SPICE_H264_MAX_FPS %s, expected 1-%d",
+                      env_max_fps_str, H264_MAX_MAX_FPS);
+        return H264_DEFAULT_MAX_FPS;
+    }
+    return max_fps;
+}
+
 static void red_init(RedWorker *worker, WorkerInitData *init_data)
 {
     RedWorkerMessage message;
@@ -12842,6 +13328,7 @@ static void red_init(RedWorker *worker, WorkerInitData *init_data)
     worker->jpeg_state = init_data->jpeg_state;
     worker->zlib_glz_state = init_data->zlib_glz_state;
     worker->streaming_video = init_data->streaming_video;
+    worker->h264_max_fps = red_h264_get_max_fps();
     worker->driver_cap_monitors_config = 0;
     ring_init(&worker->current_list);
     image_cache_init(&worker->image_cache);
@@ -12916,33 +13403,6 @@ static void insert_surface_image(RedWorker *worker)
         }
     }
 }
-
-//ZZQ write this according to red_channel_client_send_item
-static void insert_h264_frame(RedWorker *worker)
-{
-    RedChannelClient *rcc;
-    RingItem *link;
-    RingItem *next;
-    RedChannel *channel = &(worker->display_channel->common.base);
-    SpiceMarshaller *m;
-    DisplayChannelClient *dcc;
-
-    if (channel != NULL) {
-        RING_FOREACH_SAFE(link, next, &channel->clients) {
-            fprintf(stderr, "[ZZQ] insert a frame\n");
-            rcc = SPICE_CONTAINEROF(link, RedChannelClient, channel_link);
-            dcc = RCC_TO_DCC(rcc);
-            red_channel_client_reset_send_data(rcc);
-            red_display_reset_send_data(dcc);
-            m = red_channel_client_get_marshaller(rcc);
-            spice_assert(red_marshall_stream_h264_data(rcc, m, NULL));
-            // a message is pending
-            if (red_channel_client_send_message_pending(rcc)) {
-                display_begin_send_message(rcc);
-            }
-        }
-    }
-}
 #endif
 
 SPICE_GNUC_NORETURN void *red_worker_main(void *arg)
@@ -13015,23 +13475,9 @@ SPICE_GNUC_NORETURN void *red_worker_main(void *arg)
             int ring_is_empty;
             red_process_cursor(worker, MAX_PIPE_SIZE, &ring_is_empty);
             red_process_commands(worker, MAX_PIPE_SIZE, &ring_is_empty);
-#ifndef USE_VGA_MODE
-            struct timeval time;
-            if (ring_is_empty) {
-                if (worker->last_drop && worker->enable_avc) {
-                    spice_assert(gettimeofday(&time, NULL) == 0);
-                    // ZZQ if timeout, try insert a h264 frame
-                    if (time.tv_sec >= worker->last_time.tv_sec + 2) {
-                        insert_h264_frame(worker);
-                    } else if(time.tv_sec == worker->last_time.tv_sec + 1
-                            && time.tv_usec >= worker->last_time.tv_usec){
-                        insert_h264_frame(worker);
-                    }
-                }
-        }
-#endif
         }
         red_push(worker);
+        red_update_display_feedback(worker);
     }
     abort();
 }
@@ -2635,6 +2635,10 @@ static int reds_init_ssl(void)
     /* Limit connection to TLSv1 only */
 #ifdef SSL_OP_NO_COMPRESSION
     ssl_options |= SSL_OP_NO_COMPRESSION;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+    /* the kernel encrypts the records when it can, saving a copy of the data */
+    ssl_options |= SSL_OP_ENABLE_KTLS;
 #endif
     SSL_CTX_set_options(reds->ctx, ssl_options);
 
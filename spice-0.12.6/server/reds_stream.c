@@ -32,6 +32,10 @@
 #include <glib.h>
 
 #include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/* the most plain data a TLS record holds */
+#define SSL_RECORD_SIZE SSL3_RT_MAX_PLAIN_LENGTH
 
 struct AsyncRead {
     RedsStream *stream;
@@ -95,6 +99,11 @@ struct RedsStreamPrivate {
     ssize_t (*write)(RedsStream *s, const void *buf, size_t nbyte);
     ssize_t (*writev)(RedsStream *s, const struct iovec *iov, int iovcnt);
 
+    /* TLS only: small iovec elements gathered into one record. After
+     * SSL_write() asked for a retry, it holds the ssl_pending bytes the next
+     * writev starts with, see stream_ssl_writev_cb() */
+    uint8_t *ssl_record;
+    size_t ssl_pending;
 };
 
 static ssize_t stream_write_cb(RedsStream *s, const void *buf, size_t size)
@@ -150,6 +159,92 @@ static ssize_t stream_ssl_write_cb(RedsStream *s, const void *buf, size_t size)
     return return_code;
 }
 
+/*
+ * One SSL_write() per iovec element makes each element, however small, a
+ * TLS record of its own, with its header, MAC and padding, and a send() of
+ * its own. The elements smaller than a record are gathered into one instead,
+ * the bigger ones are written from where they are.
+ *
+ * SSL_write() must be retried with the same buffer after it returned
+ * SSL_ERROR_WANT_WRITE. The callers resume from the first byte that was not
+ * written, so a gathered record that is not written yet is kept, and written
+ * again as the start of the next call.
+ */
+static ssize_t stream_ssl_writev_cb(RedsStream *s, const struct iovec *iov, int iovcnt)
+{
+    RedsStreamPrivate *priv = s->priv;
+    size_t offset = 0; /* already written of iov[0] */
+    ssize_t ret = 0;
+
+    if (!priv->ssl_record) {
+        priv->ssl_record = spice_malloc(SSL_RECORD_SIZE);
+    }
+
+    for (;;) {
+        const uint8_t *buf;
+        size_t size;
+        int n;
+
+        while (iovcnt > 0 && offset == iov[0].iov_len) {
+            iov++;
+            iovcnt--;
+            offset = 0;
+        }
+        if (iovcnt == 0) {
+            break;
+        }
+
+        if (priv->ssl_pending) {
+            buf = priv->ssl_record;
+            size = priv->ssl_pending;
+        } else if (iov[0].iov_len - offset >= SSL_RECORD_SIZE) {
+            buf = (uint8_t *)iov[0].iov_base + offset;
+            size = iov[0].iov_len - offset;
+        } else {
+            size_t pos = offset;
+            int i;
+
+            buf = priv->ssl_record;
+            size = 0;
+            for (i = 0; i < iovcnt && size < SSL_RECORD_SIZE; i++, pos = 0) {
+                size_t len = iov[i].iov_len - pos;
+
+                /* a big element goes in records of its own */
+                if (i > 0 && len >= SSL_RECORD_SIZE) {
+                    break;
+                }
+                len = MIN(len, SSL_RECORD_SIZE - size);
+                memcpy(priv->ssl_record + size, (uint8_t *)iov[i].iov_base + pos, len);
+                size += len;
+            }
+        }
+
+        n = SSL_write(priv->ssl, buf, size);
+        if (n <= 0) {
+            if (buf == priv->ssl_record) {
+                priv->ssl_pending = size;
+            }
+            return ret == 0 ? n : ret;
+        }
+        priv->ssl_pending = 0;
+        ret += n;
+
+        while (n > 0) {
+            size_t len = MIN((size_t)n, iov[0].iov_len - offset);
+
+            offset += len;
+            n -= len;
+            if (offset == iov[0].iov_len) {
+                iov++;
+                iovcnt--;
+                offset = 0;
+            }
+        }
+    }
+
+    return ret;
+}
+
 static ssize_t stream_ssl_read_cb(RedsStream *s, void *buf, size_t size)
 {
     int return_code;
@@ -281,6 +376,7 @@ void reds_stream_free(RedsStream *s)
     if (s->priv->ssl) {
         SSL_free(s->priv->ssl);
     }
+    free(s->priv->ssl_record);
 
     reds_stream_remove_watch(s);
     spice_info("close socket fd %d", s->socket);
@@ -404,7 +500,7 @@ int reds_stream_enable_ssl(RedsStream *stream, SSL_CTX *ctx)
 
     stream->priv->write = stream_ssl_write_cb;
     stream->priv->read = stream_ssl_read_cb;
-    stream->priv->writev = NULL;
+    stream->priv->writev = stream_ssl_writev_cb;
 
     return reds_stream_ssl_accept(stream);
 }
@@ -28,7 +28,7 @@
 
 #define SPICE_INTERFACE_QXL "qxl"
 #define SPICE_INTERFACE_QXL_MAJOR 3
-#define SPICE_INTERFACE_QXL_MINOR 3
+#define SPICE_INTERFACE_QXL_MINOR 4
 
 typedef struct QXLInterface QXLInterface;
 typedef struct QXLInstance QXLInstance;
@@ -154,6 +154,23 @@ struct QXLDevSurfaceCreate {
     uint32_t group_id;
 };
 
+/*
+ * How often the display worker wants new frames, so that the device can
+ * refresh no more often than the clients take them.
+ *
+ * frame_interval_ms  : the shortest interval the clients' encoders target,
+ *                      0 when no client encodes the display
+ * pending_frames     : the frames the least busy client still has to encode
+ *                      or send
+ * max_pending_frames : from there on, the frames the device queues are
+ *                      dropped rather than encoded
+ */
+typedef struct QXLDisplayFeedback {
+    uint32_t frame_interval_ms;
+    uint32_t pending_frames;
+    uint32_t max_pending_frames;
+} QXLDisplayFeedback;
+
 struct QXLInterface {
     SpiceBaseInterface base;
 
@@ -181,6 +198,10 @@ struct QXLInterface {
      * return code. */
     int (*client_monitors_config)(QXLInstance *qin,
                                   VDAgentMonitorsConfig *monitors_config);
+    /* since minor 4, optional. Called from the worker thread when the
+     * feedback changed. */
+    void (*set_display_feedback)(QXLInstance *qin,
+                                 const QXLDisplayFeedback *feedback);
 };
 
 struct QXLInstance {
@@ -0,0 +1,438 @@
+/* Headless h264 encode benchmark.
+ *
+ * Replays a recording (made with SPICE_WORKER_RECORD_FILENAME) through the
+ * worker, without any client, and codes the primary surface the way the
+ * worker does in full avc mode: every --commands-per-frame commands the
+ * surface is updated and its damage since the previous frame is coded with
+ * the same h264 encoder chain.
+ *
+ * The results are printed as a json object, so that runs of the same
+ * recording can be compared, e.g. by CI across encoder changes.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+#include <spice/macros.h>
+#include "red_replay_qxl.h"
+#include "basic_event_loop.h"
+#include "video_encoder.h"
+#include "red_time.h"
+
+#define MEM_SLOT_GROUP_ID 0
+
+// same as qemu/ui/spice-display.h
+#define MAX_SURFACE_NUM 1024
+
+/* the damage of a frame is read back as at most this many rects, a frame
+ * with more is coded whole */
+#define BENCH_MAX_DIRTY_RECTS 64
+
+typedef struct BenchFrame {
+    uint64_t encode_time; /* ns */
+    uint64_t convert_time; /* ns */
+    uint64_t size;
+} BenchFrame;
+
+static SpiceCoreInterface *core;
+static SpiceServer *server;
+static SpiceReplay *replay;
+static QXLInstance display_sin = { 0, };
+static GAsyncQueue *aqueue = NULL;
+
+static VideoEncoder *encoder;
+static GArray *frames;
+static uint64_t encode_cpu_time;
+
+/* the primary surface as recorded, the worker renders into its memory */
+static QXLDevSurfaceCreate primary;
+static gboolean have_primary = FALSE;
+static gint pending_commands;
+
+static QXLDevMemSlot slot = {
+.slot_group_id = MEM_SLOT_GROUP_ID,
+.slot_id = 0,
+.generation = 0,
+.virt_start = 0,
+.virt_end = ~0,
+.addr_delta = 0,
+.qxl_ram_size = ~0,
+};
+
+static uint64_t thread_cpu_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+static void attach_worker(QXLInstance *qin, QXLWorker *_qxl_worker)
+{
+    spice_qxl_add_memslot(qin, &slot);
+    spice_server_vm_start(server);
+}
+
+static void set_compression_level(QXLInstance *qin, int level)
+{
+}
+
+static void set_mm_time(QXLInstance *qin, uint32_t mm_time)
+{
+}
+
+static void get_init_info(QXLInstance *qin, QXLDevInitInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->num_memslots = 1;
+    info->num_memslots_groups = 1;
+    info->memslot_id_bits = 1;
+    info->memslot_gen_bits = 1;
+    info->n_surfaces = MAX_SURFACE_NUM;
+}
+
+// called from the red_worker thread
+static int get_command(QXLInstance *qin, QXLCommandExt *ext)
+{
+    QXLCommandExt *cmd = g_async_queue_try_pop(aqueue);
+
+    if (!cmd) {
+        return FALSE;
+    }
+    *ext = *cmd;
+    return TRUE;
+}
+
+static int req_cmd_notification(QXLInstance *qin)
+{
+    return TRUE;
+}
+
+static void release_resource(QXLInstance *qin, struct QXLReleaseInfoExt release_info)
+{
+    spice_replay_free_cmd(replay, (QXLCommandExt *)release_info.info->id);
+}
+
+static int get_cursor_command(QXLInstance *qin, struct QXLCommandExt *ext)
+{
+    return FALSE;
+}
+
+static int req_cursor_notification(QXLInstance *qin)
+{
+    return TRUE;
+}
+
+static void notify_update(QXLInstance *qin, uint32_t update_id)
+{
+}
+
+static int flush_resources(QXLInstance *qin)
+{
+    return TRUE;
+}
+
+static QXLInterface display_sif = {
+    .base = {
+        .type = SPICE_INTERFACE_QXL,
+        .description = "h264 bench",
+        .major_version = SPICE_INTERFACE_QXL_MAJOR,
+        .minor_version = SPICE_INTERFACE_QXL_MINOR
+    },
+    .attache_worker = attach_worker,
+    .set_compression_level = set_compression_level,
+    .set_mm_time = set_mm_time,
+    .get_init_info = get_init_info,
+    .get_command = get_command,
+    .req_cmd_notification = req_cmd_notification,
+    .release_resource = release_resource,
+    .get_cursor_command = get_cursor_command,
+    .req_cursor_notification = req_cursor_notification,
+    .notify_update = notify_update,
+    .flush_resources = flush_resources,
+};
+
+/* Render the commands queued so far and code the damage they left on the
+ * primary surface as one frame */
+static void bench_encode_frame(void)
+{
+    QXLRect area = { 0, };
+    QXLRect dirty_rects[BENCH_MAX_DIRTY_RECTS];
+    VideoEncoderStats before, after;
+    BenchFrame frame;
+    QRegion damage;
+    uint8_t *rgb;
+    uint8_t *data;
+    int stride;
+    int size;
+    int ret;
+    int i;
+
+    if (!have_primary || pending_commands == 0) {
+        return;
+    }
+    pending_commands = 0;
+
+    area.bottom = primary.height;
+    area.right = primary.width;
+    memset(dirty_rects, 0, sizeof(dirty_rects));
+    spice_qxl_update_area(&display_sin, 0, &area, dirty_rects, BENCH_MAX_DIRTY_RECTS, TRUE);
+
+    region_init(&damage);
+    for (i = 0; i < BENCH_MAX_DIRTY_RECTS && dirty_rects[i].right > dirty_rects[i].left; i++) {
+        SpiceRect rect = {
+            .left = dirty_rects[i].left,
+            .top = dirty_rects[i].top,
+            .right = dirty_rects[i].right,
+            .bottom = dirty_rects[i].bottom,
+        };
+        region_add(&damage, &rect);
+    }
+    if (region_is_empty(&damage)) {
+        region_destroy(&damage);
+        return;
+    }
+
+    /* the lowest line in memory first, as the worker hands its canvas over */
+    rgb = (uint8_t *)(uintptr_t)primary.mem;
+    stride = abs(primary.stride);
+
+    video_encoder_get_stats(encoder, &before);
+    encode_cpu_time -= thread_cpu_now();
+    ret = video_encoder_encode(encoder, rgb, primary.width, primary.height, stride, 0,
+                               i == BENCH_MAX_DIRTY_RECTS ? NULL : &damage, FALSE,
+                               &data, &size);
+    encode_cpu_time += thread_cpu_now();
+    video_encoder_get_stats(encoder, &after);
+    region_destroy(&damage);
+
+    if (ret < 0) {
+        g_printerr("failed to encode a frame\n");
+        exit(1);
+    }
+    if (size == 0) {
+        return;
+    }
+    frame.encode_time = after.encode_time - before.encode_time;
+    frame.convert_time = after.convert_time - before.convert_time;
+    frame.size = size;
+    g_array_append_val(frames, frame);
+}
+
+/*
+ * The replay drives the primary surface through these. The bench needs the
+ * surface memory to read the frames back, and to code the frame of a primary
+ * surface before it goes away.
+ */
+static void bench_create_primary_surface(QXLWorker *worker, uint32_t surface_id,
+                                         QXLDevSurfaceCreate *surface)
+{
+    if (surface->format != SPICE_SURFACE_FMT_32_xRGB &&
+        surface->format != SPICE_SURFACE_FMT_32_ARGB) {
+        g_printerr("primary surface format %d is not supported\n", surface->format);
+        exit(1);
+    }
+    primary = *surface;
+    have_primary = TRUE;
+    spice_qxl_create_primary_surface(&display_sin, surface_id, surface);
+}
+
+static void bench_destroy_primary_surface(QXLWorker *worker, uint32_t surface_id)
+{
+    bench_encode_frame();
+    have_primary = FALSE;
+    spice_qxl_destroy_primary_surface(&display_sin, surface_id);
+}
+
+static void bench_destroy_surfaces(QXLWorker *worker)
+{
+    bench_encode_frame();
+    have_primary = FALSE;
+    spice_qxl_destroy_surfaces(&display_sin);
+}
+
+static QXLWorker bench_worker = {
+    .create_primary_surface = bench_create_primary_surface,
+    .destroy_primary_surface = bench_destroy_primary_surface,
+    .destroy_surfaces = bench_destroy_surfaces,
+};
+
+static int compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* nearest rank percentile of the sorted values */
+static uint64_t percentile(const uint64_t *values, guint n, int p)
+{
+    guint rank = (n * p + 99) / 100;
+
+    return values[MAX(rank, 1) - 1];
+}
+
+/* "name": {"mean": ..., "p50": ..., ...}, with the values divided by scale */
+static void print_distribution(FILE *out, const char *name, size_t offset, double scale)
+{
+    uint64_t *values = g_new(uint64_t, MAX(frames->len, 1));
+    uint64_t total = 0;
+    guint i;
+
+    for (i = 0; i < frames->len; i++) {
+        values[i] = *(uint64_t *)((uint8_t *)&g_array_index(frames, BenchFrame, i) + offset);
+        total += values[i];
+    }
+    if (frames->len == 0) {
+        fprintf(out, "  \"%s\": null,\n", name);
+        g_free(values);
+        return;
+    }
+    qsort(values, frames->len, sizeof(uint64_t), compare_uint64);
+    fprintf(out, "  \"%s\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+            "\"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n", name,
+            total / scale / frames->len,
+            percentile(values, frames->len, 50) / scale,
+            percentile(values, frames->len, 90) / scale,
+            percentile(values, frames->len, 95) / scale,
+            percentile(values, frames->len, 99) / scale,
+            values[frames->len - 1] / scale);
+    g_free(values);
+}
+
+static double timeval_to_sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context = NULL;
+    gchar **file = NULL;
+    gchar *chain = NULL, *name = NULL, *output = NULL;
+    gint commands_per_frame = 10, bit_rate = 0, fps = 30;
+    QXLCommandExt *cmd;
+    VideoEncoderStats stats;
+    struct rusage usage;
+    uint64_t start, commands = 0;
+    double wall, cpu;
+    FILE *fd, *out;
+
+    GOptionEntry entries[] = {
+        { "encoder", 'e', 0, G_OPTION_ARG_STRING, &chain,
+          "h264 encoder chain (default SPICE_H264_ENCODER or all)", "CHAIN" },
+        { "commands-per-frame", 'n', 0, G_OPTION_ARG_INT, &commands_per_frame,
+          "Code a frame every N commands (default 10)", "N" },
+        { "bit-rate", 'b', 0, G_OPTION_ARG_INT, &bit_rate,
+          "Target bit rate in kbps (default 0, constant quality)", "KBPS" },
+        { "fps", 'f', 0, G_OPTION_ARG_INT, &fps, "Frame rate of the rate control (default 30)",
+          "FPS" },
+        { "name", 'N', 0, G_OPTION_ARG_STRING, &name, "Scenario name (default the file name)",
+          "NAME" },
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output, "Write the results to FILE",
+          "FILE" },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &file, "replay file", "FILE" },
+        { NULL }
+    };
+
+    context = g_option_context_new("- h264 encode benchmark of a spice server recording");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    if (!file || commands_per_frame < 1 || bit_rate < 0 || fps < 1) {
+        g_printerr("%s\n", g_option_context_get_help(context, TRUE, NULL));
+        exit(1);
+    }
+
+    fd = fopen(file[0], "r");
+    if (fd == NULL) {
+        g_printerr("error opening %s\n", file[0]);
+        return 1;
+    }
+    if (fcntl(fileno(fd), FD_CLOEXEC) < 0) {
+        perror("fcntl failed");
+        exit(1);
+    }
+    replay = spice_replay_new(fd, MAX_SURFACE_NUM);
+    if (!replay) {
+        exit(1);
+    }
+
+    encoder = video_encoder_new(chain);
+    if (!encoder) {
+        g_printerr("no h264 encoder available\n");
+        exit(1);
+    }
+    if (bit_rate) {
+        video_encoder_reconfigure(encoder, (uint64_t)bit_rate * 1000, fps);
+    }
+    frames = g_array_new(FALSE, FALSE, sizeof(BenchFrame));
+
+    aqueue = g_async_queue_new();
+    core = basic_event_loop_init();
+    server = spice_server_new();
+    spice_server_init(server, core);
+    display_sin.base.sif = &display_sif.base;
+    spice_server_add_interface(server, &display_sin.base);
+
+    start = red_now();
+    while ((cmd = spice_replay_next_cmd(replay, &bench_worker))) {
+        g_async_queue_push(aqueue, cmd);
+        commands++;
+        if (++pending_commands >= commands_per_frame) {
+            bench_encode_frame();
+        }
+    }
+    bench_encode_frame();
+    wall = (red_now() - start) / 1e9;
+    getrusage(RUSAGE_SELF, &usage);
+    cpu = timeval_to_sec(&usage.ru_utime) + timeval_to_sec(&usage.ru_stime);
+
+    out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        g_printerr("error opening %s\n", output);
+        exit(1);
+    }
+    video_encoder_get_stats(encoder, &stats);
+    fprintf(out, "{\n");
+    fprintf(out, "  \"scenario\": \"%s\",\n", name ? name : g_path_get_basename(file[0]));
+    fprintf(out, "  \"encoder\": \"%s\",\n", video_encoder_get_name(encoder));
+    fprintf(out, "  \"width\": %d,\n  \"height\": %d,\n", primary.width, primary.height);
+    fprintf(out, "  \"commands\": %" G_GUINT64_FORMAT ",\n", commands);
+    fprintf(out, "  \"frames\": %u,\n", frames->len);
+    fprintf(out, "  \"keyframes\": %" G_GUINT64_FORMAT ",\n", stats.keyframes);
+    print_distribution(out, "encode_ms", G_STRUCT_OFFSET(BenchFrame, encode_time), 1e6);
+    print_distribution(out, "convert_ms", G_STRUCT_OFFSET(BenchFrame, convert_time), 1e6);
+    print_distribution(out, "frame_bytes", G_STRUCT_OFFSET(BenchFrame, size), 1);
+    fprintf(out, "  \"total_bytes\": %" G_GUINT64_FORMAT ",\n", stats.bytes);
+    fprintf(out, "  \"wall_s\": %.3f,\n", wall);
+    /* the frames coded per second of replay, and per second of encoding */
+    fprintf(out, "  \"fps\": %.2f,\n", frames->len / wall);
+    fprintf(out, "  \"encode_fps\": %.2f,\n",
+            stats.encode_time ? frames->len / (stats.encode_time / 1e9) : 0.0);
+    /* the whole process, i.e. the worker, the encoder and the replay parsing */
+    fprintf(out, "  \"cpu_percent\": %.1f,\n", cpu / wall * 100);
+    fprintf(out, "  \"encode_cpu_percent\": %.1f\n", encode_cpu_time / 1e9 / wall * 100);
+    fprintf(out, "}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    /* FIXME: like spice-server-replay, the server threads are not joined */
+    video_encoder_destroy(encoder);
+    spice_replay_free(replay);
+    g_array_free(frames, TRUE);
+    g_async_queue_unref(aqueue);
+    return 0;
+}
@@ -0,0 +1,561 @@
+/**
+ * Conformance of the h264 video encoder backends, and of the fallback chain
+ * in front of them. Every backend built in goes through the same checks;
+ * the ones that can't run on this host (e.g. qsv without a supported gpu)
+ * are skipped, so the test passes on a cpu only machine with x264 alone.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <spice/macros.h>
+
+#include "test_util.h"
+#include "video_encoder.h"
+#include "h264_pipeline.h"
+#include "common/region.h"
+
+static uint8_t *frame_new(int width, int height, int seed)
+{
+    uint8_t *rgb = malloc(width * height * 4);
+    int x, y;
+
+    ASSERT(rgb);
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            uint8_t *p = rgb + (y * width + x) * 4;
+
+            p[0] = x * 255 / width + seed;
+            p[1] = y * 255 / height;
+            p[2] = (x ^ y) + seed * 3;
+            p[3] = 0;
+        }
+    }
+    return rgb;
+}
+
+/* a valid frame is annex-b: it starts with a start code and a nal header
+ * with the forbidden bit clear */
+static void check_frame(const uint8_t *frame, int frame_size)
+{
+    int offset;
+
+    ASSERT(frame_size > 4);
+    ASSERT(frame[0] == 0 && frame[1] == 0);
+    offset = frame[2] == 1 ? 3 : 4;
+    ASSERT(frame[offset - 1] == 1);
+    ASSERT((frame[offset] & 0x80) == 0);
+}
+
+static int encode(const VideoEncoderBackend *backend, void *state, const uint8_t *rgb,
+                  int width, int height, int *keyframe)
+{
+    uint8_t *frame;
+    int frame_size;
+
+    ASSERT(backend->encode(state, rgb, width, height, width * 4, 0, NULL, FALSE,
+                           &frame, &frame_size) == 0);
+    if (frame_size == 0) {
+        *keyframe = FALSE;
+        return 0;
+    }
+    check_frame(frame, frame_size);
+    *keyframe = video_encoder_frame_is_keyframe(frame, frame_size);
+    return frame_size;
+}
+
+static void check_backend(const VideoEncoderBackend *backend)
+{
+    uint8_t *rgb[2];
+    uint8_t *frame;
+    int frame_size;
+    int keyframe;
+    void *state;
+    int i;
+
+    state = backend->init();
+    if (!state) {
+        printf("%s: not available, skipped\n", backend->name);
+        return;
+    }
+    ASSERT(backend->encode && backend->request_keyframe && backend->destroy);
+
+    rgb[0] = frame_new(320, 240, 0);
+    rgb[1] = frame_new(320, 240, 7);
+
+    /* the first frame of a stream is an IDR */
+    ASSERT(encode(backend, state, rgb[0], 320, 240, &keyframe) > 0);
+    ASSERT(keyframe);
+    for (i = 1; i < 10; i++) {
+        ASSERT(encode(backend, state, rgb[i % 2], 320, 240, &keyframe) > 0);
+    }
+
+    /* on request, and only for the next frame */
+    backend->request_keyframe(state);
+    ASSERT(encode(backend, state, rgb[0], 320, 240, &keyframe) > 0);
+    ASSERT(keyframe);
+
+    /* a new rate applies without breaking the stream */
+    if (backend->reconfigure) {
+        backend->reconfigure(state, 500 * 1000, 15);
+        for (i = 0; i < 5; i++) {
+            ASSERT(encode(backend, state, rgb[i % 2], 320, 240, &keyframe) > 0);
+        }
+    }
+    free(rgb[0]);
+    free(rgb[1]);
+
+    /* a new size starts a new stream */
+    rgb[0] = frame_new(640, 360, 3);
+    ASSERT(encode(backend, state, rgb[0], 640, 360, &keyframe) > 0);
+    ASSERT(keyframe);
+    free(rgb[0]);
+
+    /* 4:2:0 can't code odd sizes, that is not a failure */
+    rgb[0] = frame_new(33, 17, 0);
+    ASSERT(backend->encode(state, rgb[0], 33, 17, 33 * 4, 0, NULL, FALSE,
+                           &frame, &frame_size) == 0);
+    ASSERT(frame_size == 0);
+    free(rgb[0]);
+
+    backend->destroy(state);
+    printf("%s: ok\n", backend->name);
+}
+
+/* with intra refresh, the stream has no IDR after the first frame, and the
+ * columns refreshed sweep the whole picture */
+static void check_intra_refresh(void)
+{
+    const VideoEncoderBackend *backend = &video_encoder_x264_backend;
+    uint8_t *rgb[2];
+    uint8_t covered[320 / 16];
+    SpiceRect area;
+    int keyframe;
+    void *state;
+    int i, x;
+
+    setenv("SPICE_H264_INTRA_REFRESH", "10", 1);
+    state = backend->init();
+    unsetenv("SPICE_H264_INTRA_REFRESH");
+    ASSERT(state);
+
+    rgb[0] = frame_new(320, 240, 0);
+    rgb[1] = frame_new(320, 240, 7);
+
+    ASSERT(encode(backend, state, rgb[0], 320, 240, &keyframe) > 0);
+    ASSERT(keyframe);
+    ASSERT(!backend->get_refresh_area(state, &area));
+
+    memset(covered, 0, sizeof(covered));
+    for (i = 1; i < 30; i++) {
+        if (i == 15) {
+            backend->request_keyframe(state);
+        }
+        ASSERT(encode(backend, state, rgb[i % 2], 320, 240, &keyframe) > 0);
+        ASSERT(!keyframe);
+        if (backend->get_refresh_area(state, &area)) {
+            ASSERT(area.left < area.right && area.right <= 320);
+            ASSERT(area.top == 0 && area.bottom == 240);
+            for (x = area.left / 16; x < area.right / 16; x++) {
+                covered[x] = TRUE;
+            }
+        }
+    }
+    for (x = 0; x < 320 / 16; x++) {
+        ASSERT(covered[x]);
+    }
+
+    free(rgb[0]);
+    free(rgb[1]);
+    backend->destroy(state);
+    printf("intra refresh: ok\n");
+}
+
+/* size of the frame after an IDR of rgb[0], when rgb[1] changed within the
+ * damage, or everywhere if there is none */
+static int encode_damaged(const uint8_t *rgb0, const uint8_t *rgb1, uint8_t flags,
+                          const QRegion *damage, int refine)
+{
+    const VideoEncoderBackend *backend = &video_encoder_x264_backend;
+    uint8_t *frame;
+    int frame_size;
+    int keyframe;
+    void *state;
+
+    state = backend->init();
+    ASSERT(state);
+    ASSERT(encode(backend, state, rgb0, 320, 240, &keyframe) > 0);
+    ASSERT(keyframe);
+    ASSERT(backend->encode(state, rgb1, 320, 240, 320 * 4, flags, damage, refine,
+                           &frame, &frame_size) == 0);
+    check_frame(frame, frame_size);
+    ASSERT(!video_encoder_frame_is_keyframe(frame, frame_size));
+    backend->destroy(state);
+    return frame_size;
+}
+
+/* The damage is a full height column, so all the rows are still converted
+ * and only the qp offsets keep the changes in the rest of the picture down
+ * to a few bits. libx264 (build 165) codes the column frame at about a
+ * third of the full one, plain and refine alike */
+static void check_damage(void)
+{
+    uint8_t *rgb[2];
+    QRegion damage;
+    SpiceRect column = { 0, 0, 16, 240 };
+    SpiceRect band = { 0, 0, 320, 32 };
+    int full_size, damaged_size;
+
+    rgb[0] = frame_new(320, 240, 0);
+    rgb[1] = frame_new(320, 240, 7);
+    region_init(&damage);
+    region_add(&damage, &column);
+
+    full_size = encode_damaged(rgb[0], rgb[1], 0, NULL, FALSE);
+    damaged_size = encode_damaged(rgb[0], rgb[1], 0, &damage, FALSE);
+    ASSERT(damaged_size * 2 < full_size);
+
+    /* same for a refine frame, coded at a fixed qp the offsets add to */
+    full_size = encode_damaged(rgb[0], rgb[1], 0, NULL, TRUE);
+    damaged_size = encode_damaged(rgb[0], rgb[1], 0, &damage, TRUE);
+    ASSERT(damaged_size * 2 < full_size);
+
+    /* only the top lines change. In a top down frame the damage is the first
+     * lines of rgb, which get converted and coded; bottom-up it would be the
+     * last ones, unchanged, and the frame next to empty */
+    memcpy(rgb[1] + 32 * 320 * 4, rgb[0] + 32 * 320 * 4, (240 - 32) * 320 * 4);
+    region_clear(&damage);
+    region_add(&damage, &band);
+    full_size = encode_damaged(rgb[0], rgb[1], SPICE_BITMAP_FLAGS_TOP_DOWN, NULL, FALSE);
+    damaged_size = encode_damaged(rgb[0], rgb[1], SPICE_BITMAP_FLAGS_TOP_DOWN, &damage, FALSE);
+    ASSERT(damaged_size * 2 > full_size);
+    damaged_size = encode_damaged(rgb[0], rgb[1], 0, &damage, FALSE);
+    ASSERT(damaged_size * 4 < full_size);
+
+    region_destroy(&damage);
+    free(rgb[0]);
+    free(rgb[1]);
+    printf("damage: ok\n");
+}
+
+typedef struct Slices {
+    int count;
+    int size;
+    uint8_t *last; /* the frame, kept until the next encode */
+    int buffers; /* out of get_slice_buffer() and not freed yet */
+} Slices;
+
+static uint8_t *get_slice_buffer(void *opaque, int size)
+{
+    Slices *slices = opaque;
+    uint8_t *buffer = malloc(size);
+
+    ASSERT(buffer);
+    slices->buffers++;
+    return buffer;
+}
+
+static void free_slice_buffer(Slices *slices, uint8_t *buffer)
+{
+    free(buffer);
+    slices->buffers--;
+}
+
+static void put_slice(void *opaque, uint8_t *buffer, int size, int last)
+{
+    Slices *slices = opaque;
+
+    check_frame(buffer, size);
+    if (last) {
+        if (slices->last) {
+            free_slice_buffer(slices, slices->last);
+        }
+        slices->last = buffer;
+        return;
+    }
+    slices->count++;
+    slices->size += size;
+    free_slice_buffer(slices, buffer);
+}
+
+static void release_slice_buffer(void *opaque, uint8_t *buffer)
+{
+    free_slice_buffer(opaque, buffer);
+}
+
+static const H264SliceOutput slice_output = {
+    .get_buffer = get_slice_buffer,
+    .put_slice = put_slice,
+    .release_buffer = release_slice_buffer,
+};
+
+/* the leading slices are put during the encode, the frame is the last one,
+ * coded into a buffer of the output too */
+static void check_slices(void)
+{
+    VideoEncoder *encoder;
+    VideoEncoderStats stats;
+    Slices slices = { 0, 0, NULL, 0 };
+    uint8_t *rgb = frame_new(320, 240, 0);
+    uint8_t *frame;
+    int frame_size;
+    int i;
+
+    encoder = video_encoder_new("x264");
+    ASSERT(encoder);
+    video_encoder_set_slice_output(encoder, &slice_output, &slices);
+    for (i = 0; i < 3; i++) {
+        ASSERT(video_encoder_encode(encoder, rgb, 320, 240, 320 * 4, 0, NULL, FALSE,
+                                    &frame, &frame_size) == 0);
+        check_frame(frame, frame_size);
+        ASSERT(frame == slices.last);
+        ASSERT(slices.count > i);
+    }
+    /* the last slice of the first frame is an IDR slice */
+    video_encoder_get_stats(encoder, &stats);
+    ASSERT(stats.keyframes == 1);
+    ASSERT(stats.bytes > slices.size);
+    video_encoder_destroy(encoder);
+    /* all the buffers were given back */
+    free_slice_buffer(&slices, slices.last);
+    ASSERT(slices.buffers == 0);
+    free(rgb);
+    printf("slices: ok\n");
+}
+
+static void *broken_init(void)
+{
+    return malloc(1);
+}
+
+static int broken_encode(void *state, const uint8_t *rgb, int width, int height,
+                         int stride, uint8_t flags, const QRegion *damage, int refine,
+                         uint8_t **frame, int *frame_size)
+{
+    *frame_size = 0;
+    return -1;
+}
+
+static void broken_request_keyframe(void *state)
+{
+}
+
+static void broken_destroy(void *state)
+{
+    free(state);
+}
+
+/* initializes, but fails to encode, like a gpu that goes away */
+static const VideoEncoderBackend broken_backend = {
+    .name = "broken",
+    .init = broken_init,
+    .encode = broken_encode,
+    .request_keyframe = broken_request_keyframe,
+    .destroy = broken_destroy,
+};
+
+static void *unavailable_init(void)
+{
+    return NULL;
+}
+
+static const VideoEncoderBackend unavailable_backend = {
+    .name = "unavailable",
+    .init = unavailable_init,
+};
+
+static void check_chain(void)
+{
+    const VideoEncoderBackend *chain[3];
+    VideoEncoderStats stats;
+    VideoEncoder *encoder;
+    uint8_t *rgb = frame_new(64, 48, 0);
+    uint8_t *frame;
+    int frame_size;
+
+    ASSERT(video_encoder_find_backend("x264") == &video_encoder_x264_backend);
+    ASSERT(video_encoder_find_backend("nonexistent") == NULL);
+    ASSERT(video_encoder_new("nonexistent") == NULL);
+
+    /* unknown names and backends that can't run are skipped */
+    encoder = video_encoder_new("nonexistent,x264");
+    ASSERT(encoder);
+    ASSERT(strcmp(video_encoder_get_name(encoder), "x264") == 0);
+    video_encoder_destroy(encoder);
+
+    chain[0] = &unavailable_backend;
+    chain[1] = &video_encoder_x264_backend;
+    encoder = video_encoder_new_from_backends(chain, 2);
+    ASSERT(encoder);
+    ASSERT(strcmp(video_encoder_get_name(encoder), "x264") == 0);
+    video_encoder_destroy(encoder);
+
+    /* a backend failing to encode hands over to the next one, with the rate
+     * set so far, and the frame is not lost */
+    chain[0] = &broken_backend;
+    chain[1] = &video_encoder_x264_backend;
+    encoder = video_encoder_new_from_backends(chain, 2);
+    ASSERT(encoder);
+    ASSERT(strcmp(video_encoder_get_name(encoder), "broken") == 0);
+    video_encoder_reconfigure(encoder, 1000 * 1000, 30);
+    ASSERT(video_encoder_encode(encoder, rgb, 64, 48, 64 * 4, 0, NULL, FALSE,
+                                &frame, &frame_size) == 0);
+    ASSERT(strcmp(video_encoder_get_name(encoder), "x264") == 0);
+    check_frame(frame, frame_size);
+    ASSERT(video_encoder_frame_is_keyframe(frame, frame_size));
+
+    ASSERT(video_encoder_encode(encoder, rgb, 64, 48, 64 * 4, 0, NULL, FALSE,
+                                &frame, &frame_size) == 0);
+    video_encoder_request_keyframe(encoder);
+    ASSERT(video_encoder_encode(encoder, rgb, 64, 48, 64 * 4, 0, NULL, FALSE,
+                                &frame, &frame_size) == 0);
+    video_encoder_get_stats(encoder, &stats);
+    ASSERT(stats.failures == 1);
+    ASSERT(stats.frames == 3);
+    ASSERT(stats.keyframes == 2);
+    ASSERT(stats.bytes > 0);
+    /* x264 converts on the cpu, within the encode */
+    ASSERT(stats.convert_time > 0);
+    ASSERT(stats.encode_time >= stats.convert_time);
+    video_encoder_destroy(encoder);
+
+    /* the last backend of the chain keeps its state on failure */
+    chain[0] = &broken_backend;
+    encoder = video_encoder_new_from_backends(chain, 1);
+    ASSERT(encoder);
+    ASSERT(video_encoder_encode(encoder, rgb, 64, 48, 64 * 4, 0, NULL, FALSE,
+                                &frame, &frame_size) < 0);
+    ASSERT(strcmp(video_encoder_get_name(encoder), "broken") == 0);
+    video_encoder_destroy(encoder);
+
+    free(rgb);
+    printf("chain: ok\n");
+}
+
+/* hands back the pixels it was given, as a frame of a single slice */
+static uint8_t *fake_pixels;
+
+static void *fake_create(void)
+{
+    return malloc(1);
+}
+
+static int fake_encode(void *codec, const uint8_t *rgb, int width, int height, int stride,
+                       uint8_t flags, const QRegion *damage, int refine,
+                       uint8_t **frame, int *frame_size)
+{
+    static uint8_t idr[] = { 0, 0, 0, 1, 0x65, 0x88 };
+    static uint8_t slice[] = { 0, 0, 0, 1, 0x41, 0x9a };
+
+    free(fake_pixels);
+    fake_pixels = malloc(height * stride);
+    ASSERT(fake_pixels);
+    memcpy(fake_pixels, rgb, height * stride);
+    *frame = damage ? slice : idr;
+    *frame_size = damage ? sizeof(slice) : sizeof(idr);
+    return 0;
+}
+
+static void fake_destroy(void *codec)
+{
+    free(codec);
+}
+
+static void fake_request_keyframe(void *codec)
+{
+}
+
+static const H264PipelineCodec fake_codec = {
+    .create = fake_create,
+    .encode = fake_encode,
+    .destroy = fake_destroy,
+    .request_keyframe = fake_request_keyframe,
+};
+
+static H264Frame *pipeline_submit(H264Pipeline *pipeline, const uint8_t *rgb, uint8_t flags,
+                                  const QRegion *damage)
+{
+    struct pollfd fd = { h264_pipeline_get_fd(pipeline), POLLIN, 0 };
+    H264Frame *frame;
+
+    ASSERT(h264_pipeline_submit(pipeline, 0, 0, rgb, 64, 40, 64 * 4, flags, damage, FALSE));
+    while (!(frame = h264_pipeline_get_frame(pipeline))) {
+        ASSERT(poll(&fd, 1, 5000) == 1);
+    }
+    ASSERT(frame->flags == flags);
+    return frame;
+}
+
+/* The damage and the dirty area of the frames are in surface coordinates. The
+ * lines of a top down frame are the surface lines, those of the others are
+ * upside down, and the pipeline copies the damaged ones into its snapshot */
+static void check_pipeline_damage(void)
+{
+    H264Pipeline *pipeline;
+    H264Frame *frame;
+    uint8_t *rgb[2];
+    QRegion damage;
+    SpiceRect band = { 8, 16, 24, 24 };
+    SpiceRect *dirty;
+    int y;
+
+    rgb[0] = frame_new(64, 40, 0);
+    rgb[1] = frame_new(64, 40, 7);
+    region_init(&damage);
+    region_add(&damage, &band);
+    pipeline = h264_pipeline_new(&fake_codec, 1);
+    ASSERT(pipeline);
+
+    frame = pipeline_submit(pipeline, rgb[0], SPICE_BITMAP_FLAGS_TOP_DOWN, NULL);
+    ASSERT(frame->dirty == NULL);
+    h264_frame_unref(frame);
+    frame = pipeline_submit(pipeline, rgb[1], SPICE_BITMAP_FLAGS_TOP_DOWN, &damage);
+    for (y = 0; y < 40; y++) {
+        const uint8_t *line = rgb[y >= 16 && y < 24] + y * 64 * 4;
+
+        ASSERT(memcmp(fake_pixels + y * 64 * 4, line, 64 * 4) == 0);
+    }
+    /* grown to the macroblocks the deblocking reaches */
+    ASSERT(frame->dirty && frame->dirty->num_rects == 1);
+    dirty = &frame->dirty->rects[0];
+    ASSERT(dirty->left == 0 && dirty->right == 32);
+    ASSERT(dirty->top == 0 && dirty->bottom == 32);
+    h264_frame_unref(frame);
+
+    /* bottom-up, the band is on the lines 16 to 24 of the 40 as well, but
+     * the macroblocks are counted from the last line */
+    frame = pipeline_submit(pipeline, rgb[0], 0, &damage);
+    ASSERT(memcmp(fake_pixels, rgb[0], 64 * 40 * 4) == 0);
+    ASSERT(frame->dirty && frame->dirty->num_rects == 1);
+    dirty = &frame->dirty->rects[0];
+    ASSERT(dirty->left == 0 && dirty->right == 32);
+    ASSERT(dirty->top == 8 && dirty->bottom == 40);
+    h264_frame_unref(frame);
+
+    h264_pipeline_destroy(pipeline);
+    region_destroy(&damage);
+    free(fake_pixels);
+    fake_pixels = NULL;
+    free(rgb[0]);
+    free(rgb[1]);
+    printf("pipeline damage: ok\n");
+}
+
+int main(void)
+{
+    const VideoEncoderBackend *const *backends = video_encoder_get_backends();
+    int i;
+
+    for (i = 0; backends[i]; i++) {
+        check_backend(backends[i]);
+    }
+    check_intra_refresh();
+    check_damage();
+    check_slices();
+    check_chain();
+    check_pipeline_damage();
+    printf("ok\n");
+    return 0;
+}
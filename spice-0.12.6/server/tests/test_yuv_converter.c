@@ -0,0 +1,236 @@
+/**
+ * Check the BGRX -> I420/NV12 converters:
+ *  - every SIMD implementation the cpu supports is bit exact with the C one,
+ *    for odd sizes, negative strides and partial bands
+ *  - the C implementation stays within a rounding step of libswscale, which
+ *    the h264 path used before
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libswscale/swscale.h>
+#include <spice/macros.h>
+
+#include "test_util.h"
+#include "yuv_converter.h"
+
+#define SWSCALE_MAX_DIFF 2
+
+typedef struct Picture {
+    int width;
+    int height;
+    uint8_t *planes[3];
+    int strides[3];
+} Picture;
+
+static void picture_init(Picture *pic, int width, int height)
+{
+    int chroma_height = (height + 1) / 2;
+
+    pic->width = width;
+    pic->height = height;
+    pic->strides[0] = width + 32;
+    pic->strides[1] = pic->strides[2] = (width + 1) / 2 + 16;
+    pic->planes[0] = calloc(pic->strides[0], height);
+    pic->planes[1] = calloc(pic->strides[1], chroma_height);
+    pic->planes[2] = calloc(pic->strides[2], chroma_height);
+    ASSERT(pic->planes[0] && pic->planes[1] && pic->planes[2]);
+}
+
+static void picture_fini(Picture *pic)
+{
+    free(pic->planes[0]);
+    free(pic->planes[1]);
+    free(pic->planes[2]);
+}
+
+/* NV12 picture, planes[1] holds the interleaved chroma */
+static void picture_init_nv12(Picture *pic, int width, int height)
+{
+    pic->width = width;
+    pic->height = height;
+    pic->strides[0] = width + 32;
+    pic->strides[1] = ((width + 1) / 2) * 2 + 32;
+    pic->strides[2] = 0;
+    pic->planes[0] = calloc(pic->strides[0], height);
+    pic->planes[1] = calloc(pic->strides[1], (height + 1) / 2);
+    pic->planes[2] = NULL;
+    ASSERT(pic->planes[0] && pic->planes[1]);
+}
+
+static int plane_cmp(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride,
+                     int width, int height)
+{
+    int max_diff = 0;
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            int diff = abs(a[y * a_stride + x] - b[y * b_stride + x]);
+            if (diff > max_diff) {
+                max_diff = diff;
+            }
+        }
+    }
+    return max_diff;
+}
+
+static int picture_cmp(const Picture *a, const Picture *b)
+{
+    int cw = (a->width + 1) / 2;
+    int ch = (a->height + 1) / 2;
+    int max_diff;
+
+    max_diff = plane_cmp(a->planes[0], a->strides[0], b->planes[0], b->strides[0],
+                         a->width, a->height);
+    max_diff = MAX(max_diff, plane_cmp(a->planes[1], a->strides[1],
+                                       b->planes[1], b->strides[1], cw, ch));
+    max_diff = MAX(max_diff, plane_cmp(a->planes[2], a->strides[2],
+                                       b->planes[2], b->strides[2], cw, ch));
+    return max_diff;
+}
+
+static void nv12_to_i420_cmp(const Picture *nv12, const Picture *i420)
+{
+    int x, y;
+
+    ASSERT(plane_cmp(nv12->planes[0], nv12->strides[0], i420->planes[0], i420->strides[0],
+                     i420->width, i420->height) == 0);
+    for (y = 0; y < (i420->height + 1) / 2; y++) {
+        for (x = 0; x < (i420->width + 1) / 2; x++) {
+            ASSERT(nv12->planes[1][y * nv12->strides[1] + 2 * x] ==
+                   i420->planes[1][y * i420->strides[1] + x]);
+            ASSERT(nv12->planes[1][y * nv12->strides[1] + 2 * x + 1] ==
+                   i420->planes[2][y * i420->strides[2] + x]);
+        }
+    }
+}
+
+static uint8_t *random_bgrx(int height, int stride)
+{
+    uint8_t *bgrx = malloc(stride * height);
+    int i;
+
+    ASSERT(bgrx);
+    for (i = 0; i < stride * height; i++) {
+        bgrx[i] = rand();
+    }
+    return bgrx;
+}
+
+static void check_size(int width, int height)
+{
+    int stride = width * 4 + 12;
+    uint8_t *bgrx = random_bgrx(height, stride);
+    /* the worker hands in the canvas bottom-up, with a negative stride */
+    const uint8_t *flipped = bgrx + stride * (height - 1);
+    Picture ref, ref_flipped, pic, nv12;
+    int impl;
+    int y;
+
+    picture_init(&ref, width, height);
+    picture_init(&ref_flipped, width, height);
+    ASSERT(yuv_converter_set_impl(YUV_CONVERTER_IMPL_C));
+    yuv_convert_bgrx_to_i420(bgrx, stride, width, height, 0, height,
+                             ref.planes, ref.strides);
+    yuv_convert_bgrx_to_i420(flipped, -stride, width, height, 0, height,
+                             ref_flipped.planes, ref_flipped.strides);
+
+    for (impl = YUV_CONVERTER_IMPL_C; impl < YUV_CONVERTER_IMPL_LAST; impl++) {
+        if (!yuv_converter_set_impl(impl)) {
+            printf("%s: not supported, skipped\n", yuv_converter_impl_name(impl));
+            continue;
+        }
+
+        picture_init(&pic, width, height);
+        yuv_convert_bgrx_to_i420(bgrx, stride, width, height, 0, height,
+                                 pic.planes, pic.strides);
+        ASSERT(picture_cmp(&ref, &pic) == 0);
+        picture_fini(&pic);
+
+        /* the same picture assembled from bands, some of them odd */
+        picture_init(&pic, width, height);
+        for (y = 0; y < height; y += 7) {
+            yuv_convert_bgrx_to_i420(flipped, -stride, width, height, y, 7,
+                                     pic.planes, pic.strides);
+        }
+        ASSERT(picture_cmp(&ref_flipped, &pic) == 0);
+        picture_fini(&pic);
+
+        picture_init_nv12(&nv12, width, height);
+        yuv_convert_bgrx_to_nv12(bgrx, stride, width, height, 0, height,
+                                 nv12.planes, nv12.strides);
+        nv12_to_i420_cmp(&nv12, &ref);
+        picture_fini(&nv12);
+    }
+
+    picture_fini(&ref_flipped);
+    picture_fini(&ref);
+    free(bgrx);
+}
+
+static void check_swscale(int width, int height)
+{
+    int stride = width * 4;
+    uint8_t *bgrx = malloc(stride * height);
+    const uint8_t *src[1] = {bgrx};
+    struct SwsContext *sws;
+    Picture ref, pic;
+    int max_diff;
+    int x, y;
+
+    /* smooth content, swscale and the 2x2 box filter only agree on
+     * chroma where neighbouring pixels are close */
+    ASSERT(bgrx);
+    memset(bgrx, 0, stride * height);
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            bgrx[y * stride + x * 4 + 0] = x * 255 / width;
+            bgrx[y * stride + x * 4 + 1] = y * 255 / height;
+            bgrx[y * stride + x * 4 + 2] = (x + y) * 127 / (width + height);
+        }
+    }
+
+    picture_init(&ref, width, height);
+    picture_init(&pic, width, height);
+
+    sws = sws_getContext(width, height, AV_PIX_FMT_RGB32,
+                         width, height, AV_PIX_FMT_YUV420P,
+                         SWS_FAST_BILINEAR | SWS_ACCURATE_RND, NULL, NULL, NULL);
+    ASSERT(sws);
+    ASSERT(sws_scale(sws, src, &stride, 0, height, ref.planes, ref.strides) == height);
+    sws_freeContext(sws);
+
+    ASSERT(yuv_converter_set_impl(YUV_CONVERTER_IMPL_C));
+    yuv_convert_bgrx_to_i420(bgrx, stride, width, height, 0, height,
+                             pic.planes, pic.strides);
+    max_diff = picture_cmp(&ref, &pic);
+    printf("%dx%d: max difference from swscale %d\n", width, height, max_diff);
+    ASSERT(max_diff <= SWSCALE_MAX_DIFF);
+
+    picture_fini(&pic);
+    picture_fini(&ref);
+    free(bgrx);
+}
+
+int main(void)
+{
+    static const int sizes[][2] = {
+        {2, 2}, {16, 2}, {31, 3}, {32, 32}, {33, 17}, {64, 48},
+        {100, 75}, {640, 480}, {1023, 767},
+    };
+    unsigned int i;
+
+    srand(0);
+    printf("default implementation: %s\n",
+           yuv_converter_impl_name(yuv_converter_get_impl()));
+    for (i = 0; i < SPICE_N_ELEMENTS(sizes); i++) {
+        check_size(sizes[i][0], sizes[i][1]);
+    }
+    check_swscale(640, 480);
+    check_swscale(1920, 1080);
+    printf("ok\n");
+    return 0;
+}
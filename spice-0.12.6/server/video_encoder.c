@@ -0,0 +1,361 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "red_common.h"
+#include "video_encoder.h"
+#include "h264_encoder.h"
+#include "red_time.h"
+
+#define VIDEO_ENCODER_MAX_CHAIN 8
+
+#define H264_NAL_TYPE_SLICE 1
+#define H264_NAL_TYPE_IDR 5
+
+struct VideoEncoder {
+    const VideoEncoderBackend *chain[VIDEO_ENCODER_MAX_CHAIN];
+    int chain_len;
+    int current; /* index in chain of the backend in use */
+    void *state;
+
+    /* 0 until the first reconfigure */
+    uint64_t bit_rate;
+    uint32_t fps;
+    /* NULL for whole frames */
+    const H264SliceOutput *slice_output;
+    void *slice_opaque;
+
+    VideoEncoderStats stats;
+};
+
+static void *video_encoder_x264_init(void)
+{
+    return h264_encoder_new();
+}
+
+static int video_encoder_x264_encode(void *state, const uint8_t *rgb,
+                                     int width, int height, int stride, uint8_t flags,
+                                     const QRegion *damage, int refine,
+                                     uint8_t **frame, int *frame_size)
+{
+    return h264_encoder_encode(state, rgb, width, height, stride, flags, damage, refine,
+                               frame, frame_size);
+}
+
+static void video_encoder_x264_reconfigure(void *state, uint64_t bit_rate, uint32_t fps)
+{
+    h264_encoder_set_rate(state, bit_rate, fps);
+}
+
+static void video_encoder_x264_request_keyframe(void *state)
+{
+    h264_encoder_request_keyframe(state);
+}
+
+static void video_encoder_x264_destroy(void *state)
+{
+    h264_encoder_destroy(state);
+}
+
+static uint64_t video_encoder_x264_get_convert_time(void *state)
+{
+    return h264_encoder_get_convert_time(state);
+}
+
+static int video_encoder_x264_get_refresh_area(void *state, SpiceRect *area)
+{
+    return h264_encoder_get_refresh_area(state, area);
+}
+
+static void video_encoder_x264_set_slice_output(void *state, const H264SliceOutput *output,
+                                                void *opaque)
+{
+    h264_encoder_set_slice_output(state, output, opaque);
+}
+
+const VideoEncoderBackend video_encoder_x264_backend = {
+    .name = "x264",
+    .init = video_encoder_x264_init,
+    .encode = video_encoder_x264_encode,
+    .reconfigure = video_encoder_x264_reconfigure,
+    .request_keyframe = video_encoder_x264_request_keyframe,
+    .destroy = video_encoder_x264_destroy,
+    .get_convert_time = video_encoder_x264_get_convert_time,
+    .get_refresh_area = video_encoder_x264_get_refresh_area,
+    .set_slice_output = video_encoder_x264_set_slice_output,
+};
+
+static const VideoEncoderBackend *const video_encoder_backends[] = {
+#ifdef USE_H264_QSV
+    &video_encoder_qsv_backend,
+#endif
+    &video_encoder_x264_backend,
+    NULL,
+};
+
+const VideoEncoderBackend *const *video_encoder_get_backends(void)
+{
+    return video_encoder_backends;
+}
+
+const VideoEncoderBackend *video_encoder_find_backend(const char *name)
+{
+    int i;
+
+    for (i = 0; video_encoder_backends[i]; i++) {
+        if (strcmp(video_encoder_backends[i]->name, name) == 0) {
+            return video_encoder_backends[i];
+        }
+    }
+    return NULL;
+}
+
+static uint8_t *video_encoder_get_slice_buffer(void *opaque, int size)
+{
+    VideoEncoder *encoder = opaque;
+
+    return encoder->slice_output->get_buffer(encoder->slice_opaque, size);
+}
+
+/* the leading slices are part of the frame in the stats, the last one is
+ * counted as the frame */
+static void video_encoder_put_slice(void *opaque, uint8_t *buffer, int size, int last)
+{
+    VideoEncoder *encoder = opaque;
+
+    if (!last) {
+        encoder->stats.bytes += size;
+    }
+    encoder->slice_output->put_slice(encoder->slice_opaque, buffer, size, last);
+}
+
+static void video_encoder_release_slice_buffer(void *opaque, uint8_t *buffer)
+{
+    VideoEncoder *encoder = opaque;
+
+    encoder->slice_output->release_buffer(encoder->slice_opaque, buffer);
+}
+
+static const H264SliceOutput video_encoder_slice_output = {
+    .get_buffer = video_encoder_get_slice_buffer,
+    .put_slice = video_encoder_put_slice,
+    .release_buffer = video_encoder_release_slice_buffer,
+};
+
+/*
+ * Initialize the first backend of the chain, from index first, that can run
+ * and switch to it. The backend in use, if any, is kept when none can.
+ */
+static int video_encoder_open_backend(VideoEncoder *encoder, int first)
+{
+    int i;
+
+    for (i = first; i < encoder->chain_len; i++) {
+        const VideoEncoderBackend *backend = encoder->chain[i];
+        void *state = backend->init();
+
+        if (!state) {
+            spice_info("h264 encoder %s is not available", backend->name);
+            continue;
+        }
+        if (encoder->state) {
+            encoder->chain[encoder->current]->destroy(encoder->state);
+        }
+        encoder->state = state;
+        encoder->current = i;
+        if (encoder->bit_rate && backend->reconfigure) {
+            backend->reconfigure(state, encoder->bit_rate, encoder->fps);
+        }
+        if (encoder->slice_output && backend->set_slice_output) {
+            backend->set_slice_output(state, &video_encoder_slice_output, encoder);
+        }
+        spice_info("h264 encoder: %s", backend->name);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+VideoEncoder *video_encoder_new_from_backends(const VideoEncoderBackend *const *backends,
+                                              int n_backends)
+{
+    VideoEncoder *encoder = spice_new0(VideoEncoder, 1);
+    int i;
+
+    for (i = 0; i < n_backends && encoder->chain_len < VIDEO_ENCODER_MAX_CHAIN; i++) {
+        encoder->chain[encoder->chain_len++] = backends[i];
+    }
+    if (!video_encoder_open_backend(encoder, 0)) {
+        spice_warning("no h264 encoder available");
+        free(encoder);
+        return NULL;
+    }
+    return encoder;
+}
+
+VideoEncoder *video_encoder_new(const char *chain)
+{
+    const VideoEncoderBackend *backends[VIDEO_ENCODER_MAX_CHAIN];
+    int n_backends = 0;
+    char *names;
+    char *name;
+    char *saveptr;
+
+    if (!chain) {
+        chain = getenv("SPICE_H264_ENCODER");
+    }
+    if (!chain) {
+        for (; video_encoder_backends[n_backends]; n_backends++) {
+            backends[n_backends] = video_encoder_backends[n_backends];
+        }
+        return video_encoder_new_from_backends(backends, n_backends);
+    }
+
+    names = spice_strdup(chain);
+    for (name = strtok_r(names, ",", &saveptr); name && n_backends < VIDEO_ENCODER_MAX_CHAIN;
+         name = strtok_r(NULL, ",", &saveptr)) {
+        const VideoEncoderBackend *backend = video_encoder_find_backend(name);
+
+        if (!backend) {
+            spice_warning("unknown h264 encoder %s", name);
+            continue;
+        }
+        backends[n_backends++] = backend;
+    }
+    free(names);
+    return video_encoder_new_from_backends(backends, n_backends);
+}
+
+void video_encoder_destroy(VideoEncoder *encoder)
+{
+    if (encoder->state) {
+        encoder->chain[encoder->current]->destroy(encoder->state);
+    }
+    free(encoder);
+}
+
+const char *video_encoder_get_name(VideoEncoder *encoder)
+{
+    return encoder->chain[encoder->current]->name;
+}
+
+static uint64_t video_encoder_get_convert_time(VideoEncoder *encoder)
+{
+    const VideoEncoderBackend *backend = encoder->chain[encoder->current];
+
+    return backend->get_convert_time ? backend->get_convert_time(encoder->state) : 0;
+}
+
+int video_encoder_encode(VideoEncoder *encoder, const uint8_t *rgb,
+                         int width, int height, int stride, uint8_t flags,
+                         const QRegion *damage, int refine,
+                         uint8_t **frame, int *frame_size)
+{
+    const VideoEncoderBackend *backend = encoder->chain[encoder->current];
+    uint64_t start = red_now();
+    uint64_t convert_start = video_encoder_get_convert_time(encoder);
+
+    while (backend->encode(encoder->state, rgb, width, height, stride, flags, damage, refine,
+                           frame, frame_size) < 0) {
+        encoder->stats.failures++;
+        if (!video_encoder_open_backend(encoder, encoder->current + 1)) {
+            return -1;
+        }
+        spice_warning("h264 encoder %s failed, falling back to %s", backend->name,
+                      encoder->chain[encoder->current]->name);
+        backend = encoder->chain[encoder->current];
+        convert_start = video_encoder_get_convert_time(encoder);
+    }
+
+    encoder->stats.encode_time += red_now() - start;
+    encoder->stats.convert_time += video_encoder_get_convert_time(encoder) - convert_start;
+    if (*frame_size > 0) {
+        encoder->stats.frames++;
+        encoder->stats.bytes += *frame_size;
+        if (video_encoder_frame_is_keyframe(*frame, *frame_size)) {
+            encoder->stats.keyframes++;
+        }
+    }
+    return 0;
+}
+
+void video_encoder_reconfigure(VideoEncoder *encoder, uint64_t bit_rate, uint32_t fps)
+{
+    const VideoEncoderBackend *backend = encoder->chain[encoder->current];
+
+    encoder->bit_rate = bit_rate;
+    encoder->fps = fps;
+    if (backend->reconfigure) {
+        backend->reconfigure(encoder->state, bit_rate, fps);
+    }
+}
+
+void video_encoder_request_keyframe(VideoEncoder *encoder)
+{
+    encoder->chain[encoder->current]->request_keyframe(encoder->state);
+}
+
+void video_encoder_set_slice_output(VideoEncoder *encoder, const H264SliceOutput *output,
+                                    void *opaque)
+{
+    const VideoEncoderBackend *backend = encoder->chain[encoder->current];
+
+    spice_return_if_fail(encoder->slice_output == NULL);
+
+    encoder->slice_output = output;
+    encoder->slice_opaque = opaque;
+    if (backend->set_slice_output) {
+        backend->set_slice_output(encoder->state, &video_encoder_slice_output, encoder);
+    }
+}
+
+int video_encoder_get_refresh_area(VideoEncoder *encoder, SpiceRect *area)
+{
+    const VideoEncoderBackend *backend = encoder->chain[encoder->current];
+
+    return backend->get_refresh_area ? backend->get_refresh_area(encoder->state, area) : FALSE;
+}
+
+void video_encoder_get_stats(VideoEncoder *encoder, VideoEncoderStats *stats)
+{
+    *stats = encoder->stats;
+}
+
+int video_encoder_frame_is_keyframe(const uint8_t *frame, int frame_size)
+{
+    int i;
+
+    /* the slices of a picture are all of the same type: the first one
+     * tells, the parameter sets and seis before it don't */
+    for (i = 0; i + 3 < frame_size; i++) {
+        if (frame[i] == 0 && frame[i + 1] == 0 && frame[i + 2] == 1) {
+            switch (frame[i + 3] & 0x1f) {
+            case H264_NAL_TYPE_IDR:
+                return TRUE;
+            case H264_NAL_TYPE_SLICE:
+                return FALSE;
+            }
+            i += 2;
+        }
+    }
+    return FALSE;
+}
@@ -0,0 +1,122 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_VIDEO_ENCODER
+#define _H_VIDEO_ENCODER
+
+#include "red_common.h"
+#include "common/region.h"
+#include "h264_encoder.h"
+
+/*
+ * A frame level h264 encoder whose codec is picked at runtime.
+ *
+ * The backends are tried in the order of a chain, e.g. "qsv,x264": the
+ * first one that initializes on this host is used. If it later fails to
+ * encode, the encoder moves on to the next backend of the chain, which
+ * starts over with an IDR. The chain comes from the SPICE_H264_ENCODER
+ * environment variable, and defaults to the hardware backends first.
+ *
+ * A VideoEncoder, like its backend state, is used by one thread at a time.
+ */
+
+typedef struct VideoEncoderBackend {
+    const char *name;
+    /* returns NULL if the backend can't run on this host */
+    void *(*init)(void);
+    /* same contract as h264_encoder_encode() */
+    int (*encode)(void *state, const uint8_t *rgb, int width, int height, int stride,
+                  uint8_t flags, const QRegion *damage, int refine,
+                  uint8_t **frame, int *frame_size);
+    /* bit_rate in bits per second, see h264_encoder_set_rate() */
+    void (*reconfigure)(void *state, uint64_t bit_rate, uint32_t fps);
+    /* the next frame is an IDR */
+    void (*request_keyframe)(void *state);
+    void (*destroy)(void *state);
+    /* optional, the total time spent converting frames to yuv on the cpu, in ns */
+    uint64_t (*get_convert_time)(void *state);
+    /* optional, see h264_encoder_get_refresh_area() */
+    int (*get_refresh_area)(void *state, SpiceRect *area);
+    /* optional, see h264_encoder_set_slice_output() */
+    void (*set_slice_output)(void *state, const H264SliceOutput *output, void *opaque);
+} VideoEncoderBackend;
+
+/* x264, always available */
+extern const VideoEncoderBackend video_encoder_x264_backend;
+#ifdef USE_H264_QSV
+/* Intel Media SDK, needs a gpu it supports */
+extern const VideoEncoderBackend video_encoder_qsv_backend;
+#endif
+
+typedef struct VideoEncoderStats {
+    uint64_t frames;
+    uint64_t keyframes;
+    uint64_t bytes;
+    uint64_t failures; /* encode calls that failed, including the ones recovered
+                          by falling back to the next backend */
+    uint64_t encode_time; /* ns spent in video_encoder_encode() */
+    uint64_t convert_time; /* ns of encode_time spent converting to yuv, 0 for the
+                              backends that convert on the gpu */
+} VideoEncoderStats;
+
+typedef struct VideoEncoder VideoEncoder;
+
+/* the backends built in, best first, NULL terminated */
+const VideoEncoderBackend *const *video_encoder_get_backends(void);
+const VideoEncoderBackend *video_encoder_find_backend(const char *name);
+
+/*
+ * chain : comma separated backend names, unknown ones are skipped.
+ *         NULL for SPICE_H264_ENCODER, or all the backends if it is not set.
+ *
+ * return: NULL if no backend of the chain could be initialized
+ */
+VideoEncoder *video_encoder_new(const char *chain);
+/* the same, with the chain given as an array of n_backends backends */
+VideoEncoder *video_encoder_new_from_backends(const VideoEncoderBackend *const *backends,
+                                              int n_backends);
+void video_encoder_destroy(VideoEncoder *encoder);
+
+/* name of the backend in use */
+const char *video_encoder_get_name(VideoEncoder *encoder);
+
+/*
+ * Same contract as h264_encoder_encode(). On failure the next backend of the
+ * chain, if any, is tried with the same frame.
+ */
+int video_encoder_encode(VideoEncoder *encoder, const uint8_t *rgb,
+                         int width, int height, int stride, uint8_t flags,
+                         const QRegion *damage, int refine,
+                         uint8_t **frame, int *frame_size);
+
+/* the rate is kept and also applied to the backends fallen back to */
+void video_encoder_reconfigure(VideoEncoder *encoder, uint64_t bit_rate, uint32_t fps);
+void video_encoder_request_keyframe(VideoEncoder *encoder);
+/* the area the last frame refreshed outside its damage, FALSE if none */
+int video_encoder_get_refresh_area(VideoEncoder *encoder, SpiceRect *area);
+/* Code the frames as slices into the buffers of output, with the backends
+ * that can, also the ones fallen back to. The others keep coding whole frames
+ * into their own buffers. Can only be set once. */
+void video_encoder_set_slice_output(VideoEncoder *encoder, const H264SliceOutput *output,
+                                    void *opaque);
+void video_encoder_get_stats(VideoEncoder *encoder, VideoEncoderStats *stats);
+
+/* TRUE if the annex-b frame holds an IDR slice */
+int video_encoder_frame_is_keyframe(const uint8_t *frame, int frame_size);
+
+#endif
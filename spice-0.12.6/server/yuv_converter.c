@@ -0,0 +1,491 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <stddef.h>
+#include <spice/macros.h>
+
+#include "yuv_converter.h"
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define YUV_CONVERTER_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * All the implementations compute, in 16 bit unsigned arithmetic:
+ *   Y = ((66 R + 129 G + 25 B + 128) >> 8) + 16
+ *   U = (112 B - 38 R - 74 G + 128 + (128 << 8)) >> 8
+ *   V = (112 R - 94 G - 18 B + 128 + (128 << 8)) >> 8
+ * where for U and V, R, G and B are the rounded average of a 2x2 block.
+ * None of the results leave [0, 65535], so the SIMD code can use wrapping
+ * 16 bit multiplies and stay bit exact with the C code.
+ */
+#define YUV_Y_R 66
+#define YUV_Y_G 129
+#define YUV_Y_B 25
+#define YUV_U_R 38
+#define YUV_U_G 74
+#define YUV_U_B 112
+#define YUV_V_R 112
+#define YUV_V_G 94
+#define YUV_V_B 18
+#define YUV_Y_BIAS 128
+#define YUV_UV_BIAS (128 + (128 << 8))
+
+/* one pair of lines: src0/y0 is even, src1/y1 is the following line */
+typedef void (*YuvRowPairFunc)(const uint8_t *src0, const uint8_t *src1, int width,
+                               uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v);
+
+typedef struct YuvConverterFuncs {
+    const char *name;
+    YuvRowPairFunc i420;
+    YuvRowPairFunc nv12; /* u is the interleaved plane, v is unused */
+} YuvConverterFuncs;
+
+static inline uint8_t yuv_y(int r, int g, int b)
+{
+    return ((YUV_Y_R * r + YUV_Y_G * g + YUV_Y_B * b + YUV_Y_BIAS) >> 8) + 16;
+}
+
+static inline uint8_t yuv_u(int r, int g, int b)
+{
+    return (YUV_U_B * b - YUV_U_R * r - YUV_U_G * g + YUV_UV_BIAS) >> 8;
+}
+
+static inline uint8_t yuv_v(int r, int g, int b)
+{
+    return (YUV_V_R * r - YUV_V_G * g - YUV_V_B * b + YUV_UV_BIAS) >> 8;
+}
+
+/* BGRX pixels, i.e. PIXMAN_x8r8g8b8 on little endian */
+#define PIX_B(p) ((p)[0])
+#define PIX_G(p) ((p)[1])
+#define PIX_R(p) ((p)[2])
+
+static inline void yuv_row_pair_c(const uint8_t *src0, const uint8_t *src1,
+                                  int x, int width,
+                                  uint8_t *y0, uint8_t *y1,
+                                  uint8_t *u, uint8_t *v, int uv_step)
+{
+    for (; x < width; x += 2) {
+        const uint8_t *p00 = src0 + x * 4;
+        const uint8_t *p10 = src1 + x * 4;
+        /* an odd last column is paired with itself */
+        const uint8_t *p01 = x + 1 < width ? p00 + 4 : p00;
+        const uint8_t *p11 = x + 1 < width ? p10 + 4 : p10;
+        int r, g, b;
+
+        y0[x] = yuv_y(PIX_R(p00), PIX_G(p00), PIX_B(p00));
+        y1[x] = yuv_y(PIX_R(p10), PIX_G(p10), PIX_B(p10));
+        if (x + 1 < width) {
+            y0[x + 1] = yuv_y(PIX_R(p01), PIX_G(p01), PIX_B(p01));
+            y1[x + 1] = yuv_y(PIX_R(p11), PIX_G(p11), PIX_B(p11));
+        }
+
+        r = (PIX_R(p00) + PIX_R(p01) + PIX_R(p10) + PIX_R(p11) + 2) >> 2;
+        g = (PIX_G(p00) + PIX_G(p01) + PIX_G(p10) + PIX_G(p11) + 2) >> 2;
+        b = (PIX_B(p00) + PIX_B(p01) + PIX_B(p10) + PIX_B(p11) + 2) >> 2;
+        u[(x / 2) * uv_step] = yuv_u(r, g, b);
+        v[(x / 2) * uv_step] = yuv_v(r, g, b);
+    }
+}
+
+static void yuv_row_pair_i420_c(const uint8_t *src0, const uint8_t *src1, int width,
+                                uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    yuv_row_pair_c(src0, src1, 0, width, y0, y1, u, v, 1);
+}
+
+static void yuv_row_pair_nv12_c(const uint8_t *src0, const uint8_t *src1, int width,
+                                uint8_t *y0, uint8_t *y1,
+                                uint8_t *uv, SPICE_GNUC_UNUSED uint8_t *unused)
+{
+    yuv_row_pair_c(src0, src1, 0, width, y0, y1, uv, uv + 1, 2);
+}
+
+#ifdef YUV_CONVERTER_X86
+
+/* 4 pixels of src as 32 bit lanes -> b, g, r in 32 bit lanes */
+#define SSE2_SPLIT(px, b, g, r) do {                                    \
+    __m128i mask_ = _mm_set1_epi32(0xff);                               \
+    (b) = _mm_and_si128((px), mask_);                                   \
+    (g) = _mm_and_si128(_mm_srli_epi32((px), 8), mask_);                \
+    (r) = _mm_and_si128(_mm_srli_epi32((px), 16), mask_);               \
+} while (0)
+
+static inline __attribute__((target("sse2")))
+__m128i sse2_y16(__m128i b, __m128i g, __m128i r)
+{
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(YUV_Y_R)),
+                              _mm_mullo_epi16(g, _mm_set1_epi16(YUV_Y_G)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(YUV_Y_B)));
+    y = _mm_add_epi16(y, _mm_set1_epi16(YUV_Y_BIAS));
+    return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+static inline __attribute__((target("sse2")))
+void sse2_uv16(__m128i b, __m128i g, __m128i r, __m128i *u, __m128i *v)
+{
+    __m128i bias = _mm_set1_epi16((short)YUV_UV_BIAS);
+    __m128i t;
+
+    t = _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(YUV_U_B)), bias);
+    t = _mm_sub_epi16(t, _mm_mullo_epi16(r, _mm_set1_epi16(YUV_U_R)));
+    t = _mm_sub_epi16(t, _mm_mullo_epi16(g, _mm_set1_epi16(YUV_U_G)));
+    *u = _mm_srli_epi16(t, 8);
+
+    t = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(YUV_V_R)), bias);
+    t = _mm_sub_epi16(t, _mm_mullo_epi16(g, _mm_set1_epi16(YUV_V_G)));
+    t = _mm_sub_epi16(t, _mm_mullo_epi16(b, _mm_set1_epi16(YUV_V_B)));
+    *v = _mm_srli_epi16(t, 8);
+}
+
+/* 8 pixels of one line as 16 bit b, g, r */
+static inline __attribute__((target("sse2")))
+void sse2_load8(const uint8_t *src, __m128i *b, __m128i *g, __m128i *r)
+{
+    __m128i b0, g0, r0, b1, g1, r1;
+
+    SSE2_SPLIT(_mm_loadu_si128((const __m128i *)src), b0, g0, r0);
+    SSE2_SPLIT(_mm_loadu_si128((const __m128i *)(src + 16)), b1, g1, r1);
+    *b = _mm_packs_epi32(b0, b1);
+    *g = _mm_packs_epi32(g0, g1);
+    *r = _mm_packs_epi32(r0, r1);
+}
+
+/* sum of horizontal pairs of two 8 x 16 bit vectors -> 8 x 16 bit */
+static inline __attribute__((target("sse2")))
+__m128i sse2_pair_sum(__m128i lo, __m128i hi)
+{
+    __m128i ones = _mm_set1_epi16(1);
+    return _mm_packs_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+}
+
+/* 16 pixels of two lines -> 16 + 16 Y bytes, 8 U and 8 V as 16 bit */
+static inline __attribute__((target("sse2")))
+void sse2_block16(const uint8_t *src0, const uint8_t *src1,
+                  uint8_t *y0, uint8_t *y1, __m128i *u, __m128i *v)
+{
+    __m128i b00, g00, r00, b01, g01, r01;
+    __m128i b10, g10, r10, b11, g11, r11;
+    __m128i b, g, r;
+    __m128i two = _mm_set1_epi16(2);
+
+    sse2_load8(src0, &b00, &g00, &r00);
+    sse2_load8(src0 + 32, &b01, &g01, &r01);
+    sse2_load8(src1, &b10, &g10, &r10);
+    sse2_load8(src1 + 32, &b11, &g11, &r11);
+
+    _mm_storeu_si128((__m128i *)y0, _mm_packus_epi16(sse2_y16(b00, g00, r00),
+                                                     sse2_y16(b01, g01, r01)));
+    _mm_storeu_si128((__m128i *)y1, _mm_packus_epi16(sse2_y16(b10, g10, r10),
+                                                     sse2_y16(b11, g11, r11)));
+
+    b = sse2_pair_sum(_mm_add_epi16(b00, b10), _mm_add_epi16(b01, b11));
+    g = sse2_pair_sum(_mm_add_epi16(g00, g10), _mm_add_epi16(g01, g11));
+    r = sse2_pair_sum(_mm_add_epi16(r00, r10), _mm_add_epi16(r01, r11));
+    b = _mm_srli_epi16(_mm_add_epi16(b, two), 2);
+    g = _mm_srli_epi16(_mm_add_epi16(g, two), 2);
+    r = _mm_srli_epi16(_mm_add_epi16(r, two), 2);
+    sse2_uv16(b, g, r, u, v);
+}
+
+static __attribute__((target("sse2")))
+void yuv_row_pair_i420_sse2(const uint8_t *src0, const uint8_t *src1, int width,
+                            uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    __m128i u16, v16;
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        sse2_block16(src0 + x * 4, src1 + x * 4, y0 + x, y1 + x, &u16, &v16);
+        _mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(u16, u16));
+        _mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(v16, v16));
+    }
+    yuv_row_pair_c(src0, src1, x, width, y0, y1, u, v, 1);
+}
+
+static __attribute__((target("sse2")))
+void yuv_row_pair_nv12_sse2(const uint8_t *src0, const uint8_t *src1, int width,
+                            uint8_t *y0, uint8_t *y1,
+                            uint8_t *uv, SPICE_GNUC_UNUSED uint8_t *unused)
+{
+    __m128i u16, v16;
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        sse2_block16(src0 + x * 4, src1 + x * 4, y0 + x, y1 + x, &u16, &v16);
+        _mm_storeu_si128((__m128i *)(uv + x), _mm_or_si128(u16, _mm_slli_epi16(v16, 8)));
+    }
+    yuv_row_pair_c(src0, src1, x, width, y0, y1, uv, uv + 1, 2);
+}
+
+/*
+ * AVX2 packs work inside 128 bit lanes, every pack is followed by a
+ * permute of the 64 bit quarters (0, 2, 1, 3) to restore pixel order.
+ */
+#define AVX2_FIX_ORDER(x) _mm256_permute4x64_epi64((x), 0xd8)
+
+#define AVX2_SPLIT(px, b, g, r) do {                                    \
+    __m256i mask_ = _mm256_set1_epi32(0xff);                            \
+    (b) = _mm256_and_si256((px), mask_);                                \
+    (g) = _mm256_and_si256(_mm256_srli_epi32((px), 8), mask_);          \
+    (r) = _mm256_and_si256(_mm256_srli_epi32((px), 16), mask_);         \
+} while (0)
+
+static inline __attribute__((target("avx2")))
+__m256i avx2_y16(__m256i b, __m256i g, __m256i r)
+{
+    __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(YUV_Y_R)),
+                                 _mm256_mullo_epi16(g, _mm256_set1_epi16(YUV_Y_G)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(YUV_Y_B)));
+    y = _mm256_add_epi16(y, _mm256_set1_epi16(YUV_Y_BIAS));
+    return _mm256_add_epi16(_mm256_srli_epi16(y, 8), _mm256_set1_epi16(16));
+}
+
+static inline __attribute__((target("avx2")))
+void avx2_uv16(__m256i b, __m256i g, __m256i r, __m256i *u, __m256i *v)
+{
+    __m256i bias = _mm256_set1_epi16((short)YUV_UV_BIAS);
+    __m256i t;
+
+    t = _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(YUV_U_B)), bias);
+    t = _mm256_sub_epi16(t, _mm256_mullo_epi16(r, _mm256_set1_epi16(YUV_U_R)));
+    t = _mm256_sub_epi16(t, _mm256_mullo_epi16(g, _mm256_set1_epi16(YUV_U_G)));
+    *u = _mm256_srli_epi16(t, 8);
+
+    t = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(YUV_V_R)), bias);
+    t = _mm256_sub_epi16(t, _mm256_mullo_epi16(g, _mm256_set1_epi16(YUV_V_G)));
+    t = _mm256_sub_epi16(t, _mm256_mullo_epi16(b, _mm256_set1_epi16(YUV_V_B)));
+    *v = _mm256_srli_epi16(t, 8);
+}
+
+/* 16 pixels of one line as 16 bit b, g, r */
+static inline __attribute__((target("avx2")))
+void avx2_load16(const uint8_t *src, __m256i *b, __m256i *g, __m256i *r)
+{
+    __m256i b0, g0, r0, b1, g1, r1;
+
+    AVX2_SPLIT(_mm256_loadu_si256((const __m256i *)src), b0, g0, r0);
+    AVX2_SPLIT(_mm256_loadu_si256((const __m256i *)(src + 32)), b1, g1, r1);
+    *b = AVX2_FIX_ORDER(_mm256_packs_epi32(b0, b1));
+    *g = AVX2_FIX_ORDER(_mm256_packs_epi32(g0, g1));
+    *r = AVX2_FIX_ORDER(_mm256_packs_epi32(r0, r1));
+}
+
+static inline __attribute__((target("avx2")))
+__m256i avx2_pair_sum(__m256i lo, __m256i hi)
+{
+    __m256i ones = _mm256_set1_epi16(1);
+    return AVX2_FIX_ORDER(_mm256_packs_epi32(_mm256_madd_epi16(lo, ones),
+                                             _mm256_madd_epi16(hi, ones)));
+}
+
+/* 32 pixels of two lines -> 32 + 32 Y bytes, 16 U and 16 V as 16 bit */
+static inline __attribute__((target("avx2")))
+void avx2_block32(const uint8_t *src0, const uint8_t *src1,
+                  uint8_t *y0, uint8_t *y1, __m256i *u, __m256i *v)
+{
+    __m256i b00, g00, r00, b01, g01, r01;
+    __m256i b10, g10, r10, b11, g11, r11;
+    __m256i b, g, r;
+    __m256i two = _mm256_set1_epi16(2);
+
+    avx2_load16(src0, &b00, &g00, &r00);
+    avx2_load16(src0 + 64, &b01, &g01, &r01);
+    avx2_load16(src1, &b10, &g10, &r10);
+    avx2_load16(src1 + 64, &b11, &g11, &r11);
+
+    _mm256_storeu_si256((__m256i *)y0,
+                        AVX2_FIX_ORDER(_mm256_packus_epi16(avx2_y16(b00, g00, r00),
+                                                           avx2_y16(b01, g01, r01))));
+    _mm256_storeu_si256((__m256i *)y1,
+                        AVX2_FIX_ORDER(_mm256_packus_epi16(avx2_y16(b10, g10, r10),
+                                                           avx2_y16(b11, g11, r11))));
+
+    b = avx2_pair_sum(_mm256_add_epi16(b00, b10), _mm256_add_epi16(b01, b11));
+    g = avx2_pair_sum(_mm256_add_epi16(g00, g10), _mm256_add_epi16(g01, g11));
+    r = avx2_pair_sum(_mm256_add_epi16(r00, r10), _mm256_add_epi16(r01, r11));
+    b = _mm256_srli_epi16(_mm256_add_epi16(b, two), 2);
+    g = _mm256_srli_epi16(_mm256_add_epi16(g, two), 2);
+    r = _mm256_srli_epi16(_mm256_add_epi16(r, two), 2);
+    avx2_uv16(b, g, r, u, v);
+}
+
+static inline __attribute__((target("avx2")))
+__m128i avx2_pack_chroma(__m256i c16)
+{
+    return _mm256_castsi256_si128(AVX2_FIX_ORDER(_mm256_packus_epi16(c16, c16)));
+}
+
+static __attribute__((target("avx2")))
+void yuv_row_pair_i420_avx2(const uint8_t *src0, const uint8_t *src1, int width,
+                            uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    __m256i u16, v16;
+    int x;
+
+    for (x = 0; x + 32 <= width; x += 32) {
+        avx2_block32(src0 + x * 4, src1 + x * 4, y0 + x, y1 + x, &u16, &v16);
+        _mm_storeu_si128((__m128i *)(u + x / 2), avx2_pack_chroma(u16));
+        _mm_storeu_si128((__m128i *)(v + x / 2), avx2_pack_chroma(v16));
+    }
+    yuv_row_pair_c(src0, src1, x, width, y0, y1, u, v, 1);
+}
+
+static __attribute__((target("avx2")))
+void yuv_row_pair_nv12_avx2(const uint8_t *src0, const uint8_t *src1, int width,
+                            uint8_t *y0, uint8_t *y1,
+                            uint8_t *uv, SPICE_GNUC_UNUSED uint8_t *unused)
+{
+    __m256i u16, v16;
+    int x;
+
+    for (x = 0; x + 32 <= width; x += 32) {
+        avx2_block32(src0 + x * 4, src1 + x * 4, y0 + x, y1 + x, &u16, &v16);
+        _mm256_storeu_si256((__m256i *)(uv + x),
+                            _mm256_or_si256(u16, _mm256_slli_epi16(v16, 8)));
+    }
+    yuv_row_pair_c(src0, src1, x, width, y0, y1, uv, uv + 1, 2);
+}
+
+#endif /* YUV_CONVERTER_X86 */
+
+static const YuvConverterFuncs yuv_converter_funcs[YUV_CONVERTER_IMPL_LAST] = {
+    [YUV_CONVERTER_IMPL_C] = {"c", yuv_row_pair_i420_c, yuv_row_pair_nv12_c},
+#ifdef YUV_CONVERTER_X86
+    [YUV_CONVERTER_IMPL_SSE2] = {"sse2", yuv_row_pair_i420_sse2, yuv_row_pair_nv12_sse2},
+    [YUV_CONVERTER_IMPL_AVX2] = {"avx2", yuv_row_pair_i420_avx2, yuv_row_pair_nv12_avx2},
+#else
+    [YUV_CONVERTER_IMPL_SSE2] = {"sse2", NULL, NULL},
+    [YUV_CONVERTER_IMPL_AVX2] = {"avx2", NULL, NULL},
+#endif
+};
+
+static pthread_once_t yuv_converter_once = PTHREAD_ONCE_INIT;
+static YuvConverterImpl yuv_converter_impl = YUV_CONVERTER_IMPL_C;
+
+static int yuv_converter_impl_supported(YuvConverterImpl impl)
+{
+    switch (impl) {
+    case YUV_CONVERTER_IMPL_C:
+        return TRUE;
+#ifdef YUV_CONVERTER_X86
+    case YUV_CONVERTER_IMPL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case YUV_CONVERTER_IMPL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return FALSE;
+    }
+}
+
+static void yuv_converter_init(void)
+{
+    int impl;
+
+    for (impl = YUV_CONVERTER_IMPL_LAST - 1; impl > YUV_CONVERTER_IMPL_C; impl--) {
+        if (yuv_converter_impl_supported(impl)) {
+            break;
+        }
+    }
+    yuv_converter_impl = impl;
+}
+
+int yuv_converter_set_impl(YuvConverterImpl impl)
+{
+    pthread_once(&yuv_converter_once, yuv_converter_init);
+    if (impl >= YUV_CONVERTER_IMPL_LAST || !yuv_converter_impl_supported(impl)) {
+        return FALSE;
+    }
+    yuv_converter_impl = impl;
+    return TRUE;
+}
+
+YuvConverterImpl yuv_converter_get_impl(void)
+{
+    pthread_once(&yuv_converter_once, yuv_converter_init);
+    return yuv_converter_impl;
+}
+
+const char *yuv_converter_impl_name(YuvConverterImpl impl)
+{
+    return impl < YUV_CONVERTER_IMPL_LAST ? yuv_converter_funcs[impl].name : "invalid";
+}
+
+static void yuv_convert_band(const uint8_t *src, int src_stride,
+                             int width, int height, int y, int h,
+                             YuvRowPairFunc row_pair,
+                             uint8_t *dst_y, int y_stride,
+                             uint8_t *dst_u, uint8_t *dst_v, int uv_stride)
+{
+    int end;
+
+    end = y + h;
+    y &= ~1;
+    if (end > height) {
+        end = height;
+    }
+
+    for (; y < end; y += 2) {
+        const uint8_t *src0 = src + (ptrdiff_t)y * src_stride;
+        uint8_t *y0 = dst_y + (ptrdiff_t)y * y_stride;
+        /* an odd last line is paired with itself */
+        int last = y + 1 >= height;
+
+        row_pair(src0, last ? src0 : src0 + src_stride, width,
+                 y0, last ? y0 : y0 + y_stride,
+                 dst_u + (ptrdiff_t)(y / 2) * uv_stride,
+                 dst_v ? dst_v + (ptrdiff_t)(y / 2) * uv_stride : NULL);
+    }
+}
+
+void yuv_convert_bgrx_to_i420(const uint8_t *src, int src_stride,
+                              int width, int height, int y, int h,
+                              uint8_t *const dst[3], const int dst_stride[3])
+{
+    YuvConverterImpl impl = yuv_converter_get_impl();
+
+    yuv_convert_band(src, src_stride, width, height, y, h,
+                     yuv_converter_funcs[impl].i420,
+                     dst[0], dst_stride[0], dst[1], dst[2], dst_stride[1]);
+}
+
+void yuv_convert_bgrx_to_nv12(const uint8_t *src, int src_stride,
+                              int width, int height, int y, int h,
+                              uint8_t *const dst[2], const int dst_stride[2])
+{
+    YuvConverterImpl impl = yuv_converter_get_impl();
+
+    yuv_convert_band(src, src_stride, width, height, y, h,
+                     yuv_converter_funcs[impl].nv12,
+                     dst[0], dst_stride[0], dst[1], NULL, dst_stride[1]);
+}
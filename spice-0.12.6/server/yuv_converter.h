@@ -0,0 +1,60 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2009 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_YUV_CONVERTER
+#define _H_YUV_CONVERTER
+
+#include <stdint.h>
+
+/*
+ * BGRX (32bpp, the layout of the spice primary surface) to 4:2:0 YUV,
+ * BT.601 limited range, chroma taken from the rounded 2x2 average.
+ *
+ * The SSE2 and AVX2 implementations are bit exact with the C one, the
+ * best one supported by the cpu is picked at runtime.
+ */
+typedef enum YuvConverterImpl {
+    YUV_CONVERTER_IMPL_C,
+    YUV_CONVERTER_IMPL_SSE2,
+    YUV_CONVERTER_IMPL_AVX2,
+
+    YUV_CONVERTER_IMPL_LAST,
+} YuvConverterImpl;
+
+/* returns FALSE if the implementation is not supported by this cpu/build */
+int yuv_converter_set_impl(YuvConverterImpl impl);
+YuvConverterImpl yuv_converter_get_impl(void);
+const char *yuv_converter_impl_name(YuvConverterImpl impl);
+
+/*
+ * Convert the lines [y, y + h) of a width x height picture. y and h are
+ * widened to even values so that whole chroma lines are produced.
+ *
+ * src        : the first line of the picture. src_stride may be negative,
+ *              which is how the bottom-up pixman canvas is handed in.
+ * dst/stride : Y, U, V planes (i420) or Y, UV planes (nv12) of the whole
+ *              picture, only the converted band is written.
+ */
+void yuv_convert_bgrx_to_i420(const uint8_t *src, int src_stride,
+                              int width, int height, int y, int h,
+                              uint8_t *const dst[3], const int dst_stride[3]);
+void yuv_convert_bgrx_to_nv12(const uint8_t *src, int src_stride,
+                              int width, int height, int y, int h,
+                              uint8_t *const dst[2], const int dst_stride[2]);
+
+#endif
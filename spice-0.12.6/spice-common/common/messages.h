@@ -352,6 +352,18 @@ typedef struct SpiceMsgDisplayH264StreamData {
     uint8_t data[0];
 } SpiceMsgDisplayH264StreamData;
 
+typedef struct SpiceMsgDisplayH264StreamDataDirty {
+    SpiceH264StreamDataHeader base;
+    SpiceClip dirty;
+    uint32_t data_size;
+    uint8_t data[0];
+} SpiceMsgDisplayH264StreamDataDirty;
+
+typedef struct SpiceMsgDisplayH264StreamDataSlice {
+    uint32_t data_size;
+    uint8_t data[0];
+} SpiceMsgDisplayH264StreamDataSlice;
+
 typedef struct SpiceMsgDisplayStreamDataSized {
     SpiceStreamDataHeader base;
     uint32_t width;
@@ -651,6 +663,10 @@ typedef struct SpiceMsgcDisplayAvc {
     uint8_t enable_avc;
 } SpiceMsgcDisplayAvc;
 
+typedef struct SpiceMsgcDisplayH264KeyframeRequest {
+    uint32_t stream_id;
+} SpiceMsgcDisplayH264KeyframeRequest;
+
 SPICE_END_DECLS
 
 #endif /* _H_SPICE_PROTOCOL */
@@ -74,6 +74,7 @@ typedef struct {
     void (*msgc_port_event)(SpiceMarshaller *m, SpiceMsgcPortEvent *msg);
     void (*msgc_display_preferred_compression)(SpiceMarshaller *m, SpiceMsgcDisplayPreferredCompression *msg);
     void (*msgc_display_avc)(SpiceMarshaller *m, SpiceMsgcDisplayAvc *msg);
+    void (*msgc_display_h264_keyframe_request)(SpiceMarshaller *m, SpiceMsgcDisplayH264KeyframeRequest *msg);
 } SpiceMessageMarshallers;
 
 SpiceMessageMarshallers *spice_message_marshallers_get(void);
@@ -0,0 +1,545 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+
+#include "channel-display-priv.h"
+
+#include <libavutil/pixdesc.h>
+
+/*
+ * h264 coded video streams, sent by the server in hybrid avc mode for the
+ * areas it detected as video. Each stream has its own decoder, as each
+ * one is a separate h264 sequence.
+ */
+
+/* slice threads only: frame threads would hold back a picture per thread */
+static AVCodecContext *h264_decoder_new(gboolean refcounted)
+{
+    AVCodec *codec;
+    AVCodecContext *ctx;
+
+    avcodec_register_all();
+    codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    g_return_val_if_fail(codec != NULL, NULL);
+
+    ctx = avcodec_alloc_context3(codec);
+    g_return_val_if_fail(ctx != NULL, NULL);
+    ctx->thread_count = 0;
+    ctx->thread_type = FF_THREAD_SLICE;
+    ctx->flags |= CODEC_FLAG_LOW_DELAY;
+    /* a frame can come in several packets, see display_h264_push() */
+    ctx->flags2 |= CODEC_FLAG2_CHUNKS;
+    /* no picture until the stream is recovered, see h264_decode() */
+    ctx->flags &= ~CODEC_FLAG_OUTPUT_CORRUPT;
+    ctx->flags2 &= ~CODEC_FLAG2_SHOW_ALL;
+    ctx->refcounted_frames = refcounted;
+    if (avcodec_open2(ctx, codec, NULL) < 0) {
+        g_warning("failed to open the h264 decoder");
+        avcodec_free_context(&ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/* A picture that did not decode, or that depends on one, is not shown:
+ * the display keeps the last good one until the stream recovers, at an IDR
+ * or at the end of an intra refresh wave. Requests are repeated at most once
+ * per second while the stream stays broken. */
+G_GNUC_INTERNAL
+void h264_request_keyframe(SpiceChannel *channel, guint32 stream_id, gint64 *last_request)
+{
+    SpiceMsgcDisplayH264KeyframeRequest request;
+    SpiceMsgOut *out;
+    gint64 now = g_get_monotonic_time();
+
+    if (!spice_channel_test_capability(channel, SPICE_DISPLAY_CAP_H264_KEYFRAME_REQUEST)) {
+        return;
+    }
+    if (*last_request != 0 && now - *last_request < G_USEC_PER_SEC) {
+        return;
+    }
+    *last_request = now;
+
+    CHANNEL_DEBUG(channel, "h264 keyframe request, stream %u", stream_id);
+    request.stream_id = stream_id;
+    out = spice_msg_out_new(channel, SPICE_MSGC_DISPLAY_H264_KEYFRAME_REQUEST);
+    out->marshallers->msgc_display_h264_keyframe_request(out->marshaller, &request);
+    spice_msg_out_send(out);
+}
+
+/*
+ * Decodes a frame, TRUE if it gave a picture to show.
+ *
+ * On a decoding error the decoder is flushed, and the stream is broken:
+ * libavcodec then outputs no picture until it recovers, at an IDR or, with
+ * intra refresh, once the wave that starts at a recovery point SEI has gone
+ * across the picture. The first picture out again is clean, even though only
+ * an IDR has key_frame set then.
+ */
+static gboolean h264_decode(AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt,
+                            gboolean *broken)
+{
+    int got_frame = 0;
+
+    if (avcodec_decode_video2(ctx, frame, &got_frame, pkt) < 0 ||
+        (got_frame && frame->decode_error_flags)) {
+        /* flushing again would restart the recovery */
+        if (!*broken) {
+            g_warning("failed to decode h264 frame");
+            avcodec_flush_buffers(ctx);
+            *broken = TRUE;
+        }
+        return FALSE;
+    }
+    if (!got_frame) {
+        return FALSE;
+    }
+    *broken = FALSE;
+    return TRUE;
+}
+
+G_GNUC_INTERNAL
+void stream_h264_init(display_stream *st)
+{
+    st->h264_ctx = h264_decoder_new(FALSE);
+    if (st->h264_ctx != NULL) {
+        st->h264_frame = av_frame_alloc();
+    }
+    /* nothing is shown before the stream has recovered once */
+    st->h264_broken = TRUE;
+}
+
+G_GNUC_INTERNAL
+void stream_h264_data(display_stream *st)
+{
+    AVFrame *frame = st->h264_frame;
+    AVPacket pkt;
+    int width;
+    int height;
+    uint8_t *dest[1];
+    int dest_stride[1];
+
+    /* nothing is drawn for a frame that did not decode */
+    g_free(st->out_frame);
+    st->out_frame = NULL;
+
+    if (st->h264_ctx == NULL || frame == NULL) {
+        return;
+    }
+
+    av_init_packet(&pkt);
+    pkt.size = stream_get_current_frame(st, &pkt.data);
+    if (!h264_decode(st->h264_ctx, frame, &pkt, &st->h264_broken)) {
+        if (st->h264_broken) {
+            SpiceMsgDisplayStreamCreate *op = spice_msg_in_parsed(st->msg_create);
+
+            h264_request_keyframe(st->channel, op->id, &st->h264_keyframe_request_time);
+        }
+        return;
+    }
+
+    stream_get_dimensions(st, &width, &height);
+    if (frame->width != width || frame->height != height) {
+        g_warning("h264 frame is %dx%d, expected %dx%d",
+                  frame->width, frame->height, width, height);
+        return;
+    }
+
+    /* the converter is only rebuilt when a sized stream changes size */
+    st->h264_sws = sws_getCachedContext(st->h264_sws,
+                                        width, height, frame->format,
+                                        width, height, AV_PIX_FMT_RGB32,
+                                        SWS_FAST_BILINEAR, NULL, NULL, NULL);
+    g_return_if_fail(st->h264_sws != NULL);
+
+    dest[0] = g_malloc0(width * height * 4);
+    dest_stride[0] = width * 4;
+    sws_scale(st->h264_sws, (const uint8_t * const *)frame->data, frame->linesize,
+              0, height, dest, dest_stride);
+    st->out_frame = dest[0];
+}
+
+G_GNUC_INTERNAL
+void stream_h264_cleanup(display_stream *st)
+{
+    sws_freeContext(st->h264_sws);
+    st->h264_sws = NULL;
+    av_frame_free(&st->h264_frame);
+    if (st->h264_ctx != NULL) {
+        avcodec_free_context(&st->h264_ctx);
+    }
+    g_free(st->out_frame);
+    st->out_frame = NULL;
+}
+
+/*
+ * The full screen h264 stream, sent in full avc mode in place of the draw
+ * commands. It is decoded on its own thread, so the channel keeps reading
+ * the socket and the widget keeps repainting while a picture decodes. The
+ * decoded pictures come back to the main context, where they are converted
+ * straight from the decoder planes into the surface memory the canvas
+ * draws from.
+ *
+ * Each picture covers the whole screen, so when the main context falls
+ * behind only the newest ones are kept: the decoding thread never waits,
+ * and neither does the channel.
+ */
+
+#define DISPLAY_H264_PICTURES 2
+
+static display_h264_packet quit_packet;
+
+G_GNUC_INTERNAL
+void display_h264_init(display_h264 *h264, GSourceFunc ready, gpointer data)
+{
+    STATIC_MUTEX_INIT(h264->lock);
+    h264->decoded = g_queue_new();
+    h264->ready = ready;
+    h264->ready_data = data;
+}
+
+G_GNUC_INTERNAL
+void display_h264_packet_free(display_h264_packet *packet)
+{
+    av_frame_free(&packet->frame);
+    spice_msg_in_unref(packet->in);
+    g_free(packet);
+}
+
+static void display_h264_decode(display_h264 *h264, display_h264_packet *packet)
+{
+    AVPacket pkt;
+    gboolean broken = h264->broken;
+
+    if (h264->ctx == NULL) {
+        packet->result = -1;
+        return;
+    }
+    packet->frame = av_frame_alloc();
+    if (packet->frame == NULL) {
+        packet->result = -1;
+        return;
+    }
+
+    av_init_packet(&pkt);
+    pkt.data = packet->data;
+    pkt.size = packet->data_size;
+    if (!h264_decode(h264->ctx, packet->frame, &pkt, &h264->broken)) {
+        av_frame_free(&packet->frame);
+        if (h264->broken) {
+            packet->result = -1;
+        }
+        return;
+    }
+    /* only the message that ends a frame says where to draw it */
+    if (packet->base == NULL) {
+        av_frame_free(&packet->frame);
+        return;
+    }
+    /* the pictures held back while the stream was broken never reached the
+     * surface */
+    if (broken) {
+        packet->dirty = NULL;
+    }
+}
+
+/* drops the oldest pictures not drawn yet, their packets are still handed
+ * back to be released in the main context */
+static void display_h264_drop_pictures(display_h264 *h264)
+{
+    GList *l;
+
+    for (l = h264->decoded->head;
+         l != NULL && h264->decoded_pictures > DISPLAY_H264_PICTURES; l = l->next) {
+        display_h264_packet *packet = l->data;
+
+        if (packet->frame != NULL) {
+            av_frame_free(&packet->frame);
+            h264->decoded_pictures--;
+            h264->dropped_pictures = TRUE;
+        }
+    }
+}
+
+/* decoding thread */
+static gpointer display_h264_thread(gpointer data)
+{
+    display_h264 *h264 = data;
+    display_h264_packet *packet;
+
+    h264->ctx = h264_decoder_new(TRUE);
+    /* a stream joined halfway waits for its first keyframe */
+    h264->broken = TRUE;
+
+    while ((packet = g_async_queue_pop(h264->packets)) != &quit_packet) {
+        display_h264_decode(h264, packet);
+
+        STATIC_MUTEX_LOCK(h264->lock);
+        g_queue_push_tail(h264->decoded, packet);
+        if (packet->frame != NULL) {
+            h264->decoded_pictures++;
+            display_h264_drop_pictures(h264);
+        }
+        /* leading slices wait for the picture of their frame */
+        if (h264->idle_id == 0 && (packet->base != NULL || packet->result < 0)) {
+            h264->idle_id = g_idle_add(h264->ready, h264->ready_data);
+        }
+        STATIC_MUTEX_UNLOCK(h264->lock);
+    }
+
+    if (h264->ctx != NULL) {
+        avcodec_free_context(&h264->ctx);
+    }
+    return NULL;
+}
+
+/* coroutine context: @base, @data and @dirty belong to @in. @base is NULL
+ * for the leading slices of a frame: the decoder takes them as they come,
+ * and outputs the picture with the packet that completes it */
+G_GNUC_INTERNAL
+void display_h264_push(display_h264 *h264, SpiceMsgIn *in,
+                       SpiceH264StreamDataHeader *base, uint8_t *data,
+                       uint32_t data_size, SpiceClip *dirty)
+{
+    display_h264_packet *packet;
+
+    if (h264->thread == NULL) {
+        h264->packets = g_async_queue_new();
+#if GLIB_CHECK_VERSION(2,31,19)
+        h264->thread = g_thread_new("h264_decoder", display_h264_thread, h264);
+#else
+        h264->thread = g_thread_create(display_h264_thread, h264, TRUE, NULL);
+#endif
+        g_return_if_fail(h264->thread != NULL);
+    }
+
+    packet = g_new0(display_h264_packet, 1);
+    spice_msg_in_ref(in);
+    packet->in = in;
+    packet->base = base;
+    packet->data = data;
+    packet->data_size = data_size;
+    if (dirty != NULL && dirty->type == SPICE_CLIP_TYPE_RECTS) {
+        packet->dirty = dirty->rects;
+    }
+    g_async_queue_push(h264->packets, packet);
+}
+
+/* main context: returns the newest decoded picture, if any, and releases
+ * the packets before it. @failed is set when one of them did not decode.
+ * A picture that comes after dropped ones is redrawn whole, as the dirty
+ * area it carries does not cover theirs */
+G_GNUC_INTERNAL
+display_h264_packet *display_h264_get_picture(display_h264 *h264, gboolean *failed)
+{
+    display_h264_packet *packet;
+    display_h264_packet *picture = NULL;
+    gboolean dropped;
+    GQueue decoded;
+
+    STATIC_MUTEX_LOCK(h264->lock);
+    h264->idle_id = 0;
+    h264->decoded_pictures = 0;
+    dropped = h264->dropped_pictures;
+    h264->dropped_pictures = FALSE;
+    decoded = *h264->decoded;
+    g_queue_init(h264->decoded);
+    STATIC_MUTEX_UNLOCK(h264->lock);
+
+    *failed = FALSE;
+    while ((packet = g_queue_pop_head(&decoded)) != NULL) {
+        if (packet->result < 0) {
+            *failed = TRUE;
+        }
+        if (packet->frame == NULL) {
+            display_h264_packet_free(packet);
+            continue;
+        }
+        if (picture != NULL) {
+            display_h264_packet_free(picture);
+            dropped = TRUE;
+        }
+        picture = packet;
+    }
+    if (picture != NULL && dropped) {
+        picture->dirty = NULL;
+    }
+    return picture;
+}
+
+static enum AVPixelFormat surface_pix_fmt(display_surface *surface)
+{
+    switch (surface->format) {
+    case SPICE_SURFACE_FMT_32_xRGB:
+    case SPICE_SURFACE_FMT_32_ARGB:
+        return AV_PIX_FMT_RGB32;
+    case SPICE_SURFACE_FMT_16_555:
+        return AV_PIX_FMT_RGB555;
+    default:
+        return AV_PIX_FMT_NONE;
+    }
+}
+
+/* Converts the lines [top, bottom) of the surface. The converter goes
+ * through its own fast path for same size pictures, which takes any band
+ * of lines as a slice starting at 0 */
+static void display_h264_convert(display_h264 *h264, display_h264_packet *picture,
+                                 display_surface *surface, int top, int bottom)
+{
+    AVFrame *frame = picture->frame;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    const uint8_t *src[4];
+    int src_stride[4];
+    uint8_t *dest[1];
+    int dest_stride[1];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        int line = top;
+
+        src[i] = frame->data[i];
+        src_stride[i] = frame->linesize[i];
+        if (src[i] == NULL) {
+            continue;
+        }
+        /* the server codes the canvas lines in memory order, that is
+         * bottom-up unless told otherwise: read the planes upwards */
+        if (!(picture->base->flags & SPICE_BITMAP_FLAGS_TOP_DOWN)) {
+            line = frame->height - 1 - top;
+        }
+        if (i == 1 || i == 2) {
+            line >>= desc->log2_chroma_h;
+        }
+        src[i] += line * src_stride[i];
+        if (!(picture->base->flags & SPICE_BITMAP_FLAGS_TOP_DOWN)) {
+            src_stride[i] = -src_stride[i];
+        }
+    }
+
+    dest[0] = surface->data + top * surface->stride;
+    dest_stride[0] = surface->stride;
+    sws_scale(h264->sws, src, src_stride, 0, bottom - top, dest, dest_stride);
+}
+
+/* main context: draws the dirty area of the picture. On success @drawn is
+ * set to that area, in surface coordinates */
+G_GNUC_INTERNAL
+int display_h264_draw(display_h264 *h264, display_h264_packet *picture,
+                      display_surface *surface, pixman_region32_t *drawn)
+{
+    AVFrame *frame = picture->frame;
+    enum AVPixelFormat dest_fmt;
+    pixman_region32_t lines;
+    pixman_box32_t *boxes;
+    int n_boxes;
+    int i;
+
+    dest_fmt = surface_pix_fmt(surface);
+    if (dest_fmt == AV_PIX_FMT_NONE) {
+        g_warning("h264 on a surface of format %d", surface->format);
+        return -1;
+    }
+    if (frame->width > surface->width || frame->height > surface->height) {
+        g_warning("h264 frame is %dx%d, surface %d is %dx%d",
+                  frame->width, frame->height, surface->surface_id,
+                  surface->width, surface->height);
+        return -1;
+    }
+    g_return_val_if_fail(av_pix_fmt_desc_get(frame->format) != NULL, -1);
+
+    h264->sws = sws_getCachedContext(h264->sws,
+                                     frame->width, frame->height, frame->format,
+                                     frame->width, frame->height, dest_fmt,
+                                     SWS_FAST_BILINEAR, NULL, NULL, NULL);
+    g_return_val_if_fail(h264->sws != NULL, -1);
+
+    if (picture->dirty == NULL) {
+        display_h264_convert(h264, picture, surface, 0, frame->height);
+        pixman_region32_init_rect(drawn, 0, 0, frame->width, frame->height);
+        return 0;
+    }
+
+    /* whole lines, in pairs to keep the chroma lines whole as well */
+    pixman_region32_init(drawn);
+    pixman_region32_init(&lines);
+    for (i = 0; i < picture->dirty->num_rects; i++) {
+        SpiceRect *r = &picture->dirty->rects[i];
+        int top = MAX(r->top, 0) & ~1;
+        int bottom = MIN((r->bottom + 1) & ~1, frame->height);
+
+        pixman_region32_union_rect(drawn, drawn, r->left, r->top,
+                                   r->right - r->left, r->bottom - r->top);
+        if (top < bottom) {
+            pixman_region32_union_rect(&lines, &lines, 0, top, frame->width, bottom - top);
+        }
+    }
+    pixman_region32_intersect_rect(drawn, drawn, 0, 0, frame->width, frame->height);
+
+    boxes = pixman_region32_rectangles(&lines, &n_boxes);
+    for (i = 0; i < n_boxes; i++) {
+        display_h264_convert(h264, picture, surface, boxes[i].y1, boxes[i].y2);
+    }
+    pixman_region32_fini(&lines);
+    return 0;
+}
+
+/* main context: stops the decoding thread and drops what it was given,
+ * the next stream starts over with a new decoder */
+G_GNUC_INTERNAL
+void display_h264_reset(display_h264 *h264)
+{
+    display_h264_packet *packet;
+
+    if (h264->thread != NULL) {
+        g_async_queue_push(h264->packets, &quit_packet);
+        g_thread_join(h264->thread);
+        h264->thread = NULL;
+    }
+    if (h264->packets != NULL) {
+        while ((packet = g_async_queue_try_pop(h264->packets)) != NULL) {
+            display_h264_packet_free(packet);
+        }
+        g_async_queue_unref(h264->packets);
+        h264->packets = NULL;
+    }
+
+    if (h264->idle_id != 0) {
+        g_source_remove(h264->idle_id);
+        h264->idle_id = 0;
+    }
+    while ((packet = g_queue_pop_head(h264->decoded)) != NULL) {
+        display_h264_packet_free(packet);
+    }
+    h264->decoded_pictures = 0;
+
+    sws_freeContext(h264->sws);
+    h264->sws = NULL;
+}
+
+G_GNUC_INTERNAL
+void display_h264_cleanup(display_h264 *h264)
+{
+    display_h264_reset(h264);
+    g_queue_free(h264->decoded);
+    h264->decoded = NULL;
+    STATIC_MUTEX_CLEAR(h264->lock);
+}
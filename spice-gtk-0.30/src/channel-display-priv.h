@@ -25,6 +25,8 @@
 #define XMD_H
 #endif
 #include <jpeglib.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
 
 #include "common/canvas_utils.h"
 #include "client_sw_canvas.h"
@@ -32,6 +34,8 @@
 #include "common/quic.h"
 #include "common/rop3.h"
 
+#include "spice-util-priv.h"
+
 G_BEGIN_DECLS
 
 
@@ -48,6 +52,39 @@ typedef struct display_surface {
     SpiceJpegDecoder            *jpeg_decoder;
 } display_surface;
 
+/* a coded frame of the full screen h264 stream, and its picture. result is
+ * negative when the picture could not be shown: the stream is broken until
+ * it recovers */
+typedef struct display_h264_packet {
+    SpiceMsgIn                     *in;
+    SpiceH264StreamDataHeader      *base; /* NULL for leading slices */
+    uint8_t                        *data;
+    uint32_t                       data_size;
+    SpiceClipRects                 *dirty; /* NULL for the whole picture */
+    AVFrame                        *frame;
+    int                            result;
+} display_h264_packet;
+
+/* decoder of the full screen h264 stream, in full avc mode */
+typedef struct display_h264 {
+    GThread                     *thread;
+    GAsyncQueue                 *packets;
+    AVCodecContext              *ctx;
+    gboolean                    broken; /* waiting for the stream to recover */
+
+    /* pictures back to the main context */
+    STATIC_MUTEX                lock;
+    GQueue                      *decoded;
+    guint                       decoded_pictures;
+    gboolean                    dropped_pictures;
+    gint64                      keyframe_request_time;
+    guint                       idle_id;
+    GSourceFunc                 ready;
+    gpointer                    ready_data;
+
+    struct SwsContext           *sws;
+} display_h264;
+
 typedef struct drops_sequence_stats {
     uint32_t len;
     uint32_t start_mm_time;
@@ -71,6 +108,13 @@ typedef struct display_stream {
     struct jpeg_decompress_struct  mjpeg_cinfo;
     struct jpeg_error_mgr          mjpeg_jerr;
 
+    /* h264 decoder */
+    AVCodecContext                 *h264_ctx;
+    AVFrame                        *h264_frame;
+    struct SwsContext              *h264_sws;
+    gboolean                       h264_broken; /* waiting for the stream to recover */
+    gint64                         h264_keyframe_request_time;
+
     uint8_t                     *out_frame;
     GQueue                      *msgq;
     guint                       timeout;
@@ -108,6 +152,22 @@ void stream_mjpeg_init(display_stream *st);
 void stream_mjpeg_data(display_stream *st);
 void stream_mjpeg_cleanup(display_stream *st);
 
+/* channel-display-h264.c */
+void stream_h264_init(display_stream *st);
+void stream_h264_data(display_stream *st);
+void stream_h264_cleanup(display_stream *st);
+void h264_request_keyframe(SpiceChannel *channel, guint32 stream_id, gint64 *last_request);
+void display_h264_init(display_h264 *h264, GSourceFunc ready, gpointer data);
+void display_h264_push(display_h264 *h264, SpiceMsgIn *in,
+                       SpiceH264StreamDataHeader *base, uint8_t *data,
+                       uint32_t data_size, SpiceClip *dirty);
+display_h264_packet *display_h264_get_picture(display_h264 *h264, gboolean *failed);
+int display_h264_draw(display_h264 *h264, display_h264_packet *picture,
+                      display_surface *surface, pixman_region32_t *drawn);
+void display_h264_packet_free(display_h264_packet *packet);
+void display_h264_reset(display_h264 *h264);
+void display_h264_cleanup(display_h264 *h264);
+
 G_END_DECLS
 
 #endif // CHANNEL_DISPLAY_PRIV_H_
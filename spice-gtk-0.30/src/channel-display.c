@@ -29,12 +29,6 @@
 #include <sys/ipc.h>
 #endif
 
-#include <libavcodec/avcodec.h>
-#include <libavutil/frame.h>
-#include <libavformat/avformat.h>
-#include <libswscale/swscale.h>
-#include <libavutil/imgutils.h>
-
 #include "glib-compat.h"
 #include "spice-client.h"
 #include "spice-common.h"
@@ -85,6 +79,7 @@ struct _SpiceDisplayChannelPrivate {
     GArray                      *monitors;
     guint                       monitors_max;
     gboolean                    enable_adaptive_streaming;
+    display_h264                h264;
 #ifdef G_OS_WIN32
     HDC dc;
 #endif
@@ -121,6 +116,7 @@ static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surf
 static gboolean display_stream_render(display_stream *st);
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating);
 static void spice_display_channel_reset_capabilities(SpiceChannel *channel);
+static gboolean display_h264_ready(gpointer data);
 static void destroy_canvas(display_surface *surface);
 static void _msg_in_unref_func(gpointer data, gpointer user_data);
 static void display_session_mm_time_reset_cb(SpiceSession *session, gpointer data);
@@ -148,6 +144,7 @@ static void spice_display_channel_finalize(GObject *object)
     clear_surfaces(SPICE_CHANNEL(object), FALSE);
     g_hash_table_unref(c->surfaces);
     clear_streams(SPICE_CHANNEL(object));
+    display_h264_cleanup(&c->h264);
     g_clear_pointer(&c->palettes, cache_unref);
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize)
@@ -226,6 +223,7 @@ static void spice_display_channel_reset(SpiceChannel *channel, gboolean migratin
     /* palettes, images, and glz_window are cleared in the session */
     clear_streams(channel);
     clear_surfaces(channel, TRUE);
+    display_h264_reset(&SPICE_DISPLAY_CHANNEL(channel)->priv->h264);
 
     SPICE_CHANNEL_CLASS(spice_display_channel_parent_class)->channel_reset(channel, migrating);
 }
@@ -599,6 +597,8 @@ static void spice_display_channel_reset_capabilities(SpiceChannel *channel)
 #ifdef USE_LZ4
     spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_LZ4_COMPRESSION);
 #endif
+    spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_H264_DIRTY_RECTS);
+    spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_H264_SLICES);
     if (SPICE_DISPLAY_CHANNEL(channel)->priv->enable_adaptive_streaming) {
         spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_STREAM_REPORT);
     }
@@ -626,6 +626,7 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
     c->dc = create_compatible_dc();
 #endif
     c->monitors_max = 1;
+    display_h264_init(&c->h264, display_h264_ready, channel);
 
     if (g_getenv("SPICE_DISABLE_ADAPTIVE_STREAMING")) {
         SPICE_DEBUG("adaptive video disabled");
@@ -828,7 +829,12 @@ static void spice_display_channel_up(SpiceChannel *channel)
     }
 
     fprintf(stderr, "[ZZQ] avc check: %d\n", spice_session_get_avc_enabled(s));
-    avc_msg.enable_avc = spice_session_get_avc_enabled(s);
+    if (!spice_session_get_avc_enabled(s))
+        avc_msg.enable_avc = SPICE_AVC_MODE_OFF;
+    else if (spice_session_get_avc_hybrid(s))
+        avc_msg.enable_avc = SPICE_AVC_MODE_HYBRID;
+    else
+        avc_msg.enable_avc = SPICE_AVC_MODE_FULL;
     out = spice_msg_out_new(channel, SPICE_MSGC_DISPLAY_AVC);
     out->marshallers->msgc_display_avc(out->marshaller, &avc_msg);
     spice_msg_out_send_internal(out);
@@ -1022,6 +1028,9 @@ static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
     case SPICE_VIDEO_CODEC_TYPE_MJPEG:
         stream_mjpeg_init(st);
         break;
+    case SPICE_VIDEO_CODEC_TYPE_H264:
+        stream_h264_init(st);
+        break;
     }
 }
 
@@ -1146,6 +1155,9 @@ static gboolean display_stream_render(display_stream *st)
         case SPICE_VIDEO_CODEC_TYPE_MJPEG:
             stream_mjpeg_data(st);
             break;
+        case SPICE_VIDEO_CODEC_TYPE_H264:
+            stream_h264_data(st);
+            break;
         }
 
         if (st->out_frame) {
@@ -1348,317 +1360,84 @@ static void display_stream_test_frames_mm_time_reset(display_stream *st,
     }
 }
 
-#define STREAM_PLAYBACK_SYNC_DROP_SEQ_LEN_LIMIT 5
-
-static int yuv2rgb(const uint8_t *yuv, const int width, const int height, uint8_t *rgb)
-{
-    struct SwsContext *sws;
-    const uint8_t *yuv_slice[3];
-    int yuv_stride[3];
-    uint8_t *rgb_slice[3];
-    int rgb_stride[3];
-    int n;
-
-    sws = sws_getContext(width, height, AV_PIX_FMT_YUV420P,
-                width, height, AV_PIX_FMT_RGB32,
-                1, NULL, NULL, NULL);
-    if (sws == NULL) {
-        fprintf(stderr, "Failed to get swscale context\n");
-        return -1;
-    }
-
-    yuv_slice[0] = yuv;
-    yuv_slice[1] = yuv + width * height;
-    yuv_slice[2] = yuv_slice[1] + width * height / 4;
-    yuv_stride[0] = width;
-    yuv_stride[1] = width / 2;
-    yuv_stride[2] = width / 2;
-    rgb_slice[0] = rgb;
-    rgb_slice[1] = NULL;
-    rgb_slice[2] = NULL;
-    rgb_stride[0] = width * 4;
-    rgb_stride[1] = 0;
-    rgb_stride[2] = 0;
-
-    n = sws_scale(sws, yuv_slice, yuv_stride, 0, height,
-            rgb_slice, rgb_stride);
-    sws_freeContext(sws);
-    sws = NULL;
-
-    if (n != height){
-        fprintf(stderr, "Failed to run swscale\n");
-        return -1;
-    }
-
-    return 0;
-}
-
-static AVCodecContext *h264_decoder_init(const int width, const int height)
-{
-    AVCodec *codec;
-    AVCodecContext *ctx;
-    int result;
-
-    codec = NULL;
-    ctx = NULL;
-
-    av_register_all();
-
-    avcodec_register_all();
-
-    codec = avcodec_find_decoder(AV_CODEC_ID_H264);
-
-    ctx = avcodec_alloc_context3(codec);
-
-    ctx->width = width;
-    ctx->height = height;
-
-    result = avcodec_open2(ctx, codec, NULL);
-    if (result < 0) {
-        fprintf(stderr, "Can't open decoder\n");
-        goto fail;
-    }
-
-    return ctx;
-
-fail:
-    return NULL;
-}
-
-static void fill_bitmap(SpiceBitmap *bitmap, SpiceChunks *chunks,
-                const int width, const int height, const uint8_t flags)
-{
-    bitmap->format = 8;
-    bitmap->flags = flags;
-    bitmap->x = width;
-    bitmap->y = height;
-    bitmap->stride = 4 * width;
-    bitmap->palette = NULL;
-    bitmap->palette_id = 0;
-    bitmap->data = chunks;
-}
-
-static int h264_decode(uint8_t *data, const int data_size,
-                const int width, const int height, uint8_t *rgb)
+/* main context */
+static gboolean display_h264_ready(gpointer data)
 {
-    static AVCodecContext *ctx = NULL;
-    static AVFrame *fr = NULL;
-    static AVPacket pkt;
-    static int last_width = 0;
-    static int last_height = 0;
-
-    int result;
-    int got_frame;
-    uint8_t *yuv;
-    int yuv_size;
-    int n;
-
-    yuv = NULL;
-
-    if (width != last_width || height != last_height) {
-        fprintf(stderr, "[ZZQ] decode init\n");
-        if (ctx != NULL) {
-            avcodec_free_context(&ctx);
-            ctx = NULL;
-        }
-        av_free_packet(&pkt);
-        av_frame_free(&fr);
-        ctx = h264_decoder_init(width, height);
-        if (ctx == NULL) {
-            fprintf(stderr, "Failed to init decoder\n");
-            goto fail;
-        }
-        fr = av_frame_alloc();
-        if (fr == NULL) {
-            fprintf(stderr, "Failed to allocate frame\n");
-            goto fail;
-        }
-        av_init_packet(&pkt);
-        last_width = width;
-        last_height = height;
-    }
-
-    yuv_size = 3 * width * height / 2;
-    yuv = malloc(yuv_size);
-    if (yuv == NULL) {
-        fprintf(stderr, "Failed to allocate buffer for yuv\n");
-        goto fail;
-    }
-
-    pkt.data = data;
-    pkt.size = data_size;
-
-   result = avcodec_decode_video2(ctx, fr, &got_frame, &pkt);
-   if (result < 0) {
-        fprintf(stderr, "Failed to decode frame\n");
-        goto fail;
-   }
+    SpiceChannel *channel = data;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_h264_packet *picture;
+    display_surface *surface;
+    pixman_region32_t drawn;
+    pixman_box32_t *boxes;
+    gboolean failed;
+    SpiceRect box;
+    int n_boxes;
+    int i;
 
-   if (got_frame) {
-        n = av_image_copy_to_buffer(yuv, yuv_size,
-                (const uint8_t* const *)fr->data, (const int*) fr->linesize,
-                ctx->pix_fmt, ctx->width, ctx->height, 1);
-        if (n < 0) {
-            fprintf(stderr, "Can't copy image to buffer\n");
-            goto fail;
-        }
-        //color space transfer
-        result = yuv2rgb(yuv, width, height, rgb);
-        if (result < 0) {
-            fprintf(stderr, "Failed to transfer yuv to rgb\n");
-            goto fail;
-        }
-    } else {
-        fprintf(stderr, "Got No frame\n");
-        goto fail;
+    picture = display_h264_get_picture(&c->h264, &failed);
+    if (failed) {
+        h264_request_keyframe(channel, SPICE_H264_FULL_SCREEN_STREAM_ID,
+                              &c->h264.keyframe_request_time);
     }
-
-    free(yuv);
-    yuv = NULL;
-
-    return 0;
-
-fail:
-    if (yuv != NULL) {
-        free(yuv);
-        yuv= NULL;
+    if (picture == NULL) {
+        return FALSE;
     }
 
-    return -1;
-}
-
-static int h264_display(uint8_t *rgb, SpiceChannel *channel,
-                int surface_id, const int width, const int height,
-                const uint8_t flags)
-{
-    SpiceRect box;
-    pixman_region32_t dest_region;
-    pixman_image_t *src_image;
-    SpiceBitmap bitmap;
-    SpiceChunks *chunks;
-    display_surface *surface;
-
-    surface = find_surface(SPICE_DISPLAY_CHANNEL(channel)->priv, surface_id);
+    surface = find_surface(c, picture->base->surface_id);
     if (surface == NULL) {
-        fprintf(stderr, "Can not find surface\n");
-        return -1;
+        g_warning("h264 frame for unknown surface %d", picture->base->surface_id);
+        display_h264_packet_free(picture);
+        return FALSE;
+    }
+    if (display_h264_draw(&c->h264, picture, surface, &drawn) < 0) {
+        display_h264_packet_free(picture);
+        return FALSE;
     }
-
-    box.left = 0;
-    box.top = 0;
-    box.right = width;
-    box.bottom = height;
-
-    chunks = malloc(sizeof(SpiceChunks) + sizeof(SpiceChunk));
-
-    chunks->data_size = 4 * width * height;
-    chunks->num_chunks = 1;
-    chunks->flags = 0;
-    chunks->chunk[0].len = 4 * width * height;
-    chunks->chunk[0].data = rgb;
-
-    pixman_region32_init_rect(&dest_region,
-                          box.left, box.top,
-                          box.right - box.left,
-                          box.bottom - box.top);
-
-    fill_bitmap(&bitmap, chunks, width, height, flags);
-
-    src_image = canvas_get_bits(surface->canvas, &bitmap, TRUE);
-
-    blit_image(surface->canvas, &dest_region, src_image, 0, 0);
     if (surface->primary) {
-        emit_invalidate(channel, &box);
+        boxes = pixman_region32_rectangles(&drawn, &n_boxes);
+        for (i = 0; i < n_boxes; i++) {
+            box.left = boxes[i].x1;
+            box.top = boxes[i].y1;
+            box.right = boxes[i].x2;
+            box.bottom = boxes[i].y2;
+            emit_invalidate(channel, &box);
+        }
     }
-    pixman_image_unref(src_image);
-    pixman_region32_fini(&dest_region);
-
-    free(chunks);
-    chunks = NULL;
-
-    return 0;
+    pixman_region32_fini(&drawn);
+    display_h264_packet_free(picture);
+    return FALSE;
 }
 
+/* coroutine context */
 static void display_handle_h264_data(SpiceChannel *channel, SpiceMsgIn *in)
 {
-    SpiceMsgDisplayH264StreamData *stream_data_op;
-
-    /* data from Msg */
-    int width;
-    int height;
-    int surface_id;
-    uint8_t flags;
-    uint8_t *data;
-    int data_size;
-
-    uint8_t *rgb;
-
-    rgb = NULL;
-
-    stream_data_op = spice_msg_in_parsed(in);
-
-    surface_id = stream_data_op->base.surface_id;
-    width = stream_data_op->base.width;
-    height = stream_data_op->base.height;
-    flags = stream_data_op->base.flags;
-    data = stream_data_op->data;
-    data_size = stream_data_op->data_size;
-
-
-/*
- * this code is t test whether decode is right or not
- * generate a rawh264 stream, use ffplay to test it
- */
-#if 0
-    static FILE *test_fp;
-    static int cn = 0;
-    if (cnt == 0){
-        test_fp =fopen("/tmp/test.264", "wb");
-        spice_assrt(test_fp != NULL);
-        cnt++;
-    }
-    if (cnt < 50){
-        spice_assrt(fwrite(stream_data_op->data, stream_data_op->data_size, 1, test_fp) == 1);
-        cnt++;
-    }
-    else if (cnt = 50) {
-        (void)fclse(test_fp);
-        test_fp =NULL;
-        cnt++;
-    }
-    return;
-#endif
-
-#if 0
-    fprintf(stder, "[ZZQ] I have received, data_size = %d\n", stream_data_op->data_size);
-    fprintf(stder, "[ZZQ] width = %d, height = %d\n", width, height);
-#endif
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceMsgDisplayH264StreamData *op = spice_msg_in_parsed(in);
 
-    rgb = malloc(4 * width * height);
-    if (rgb == NULL) {
-        fprintf(stderr, "Failed to allocate buffer for rgb\n");
-        goto fail;
-    }
+    display_h264_push(&c->h264, in, &op->base, op->data, op->data_size, NULL);
+}
 
-    if (h264_decode(data, data_size, width, height, rgb) == 0) {
-        if (h264_display(rgb, channel, surface_id, width, height, flags) < 0) {
-            fprintf(stderr, "Failed to display\n");
-            goto fail;
-        }
-    } else {
-        fprintf(stderr, "Failed to decode a h264 frame\n");
-        goto fail;
-    }
+/* coroutine context */
+static void display_handle_h264_data_dirty(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceMsgDisplayH264StreamDataDirty *op = spice_msg_in_parsed(in);
 
-    free(rgb);
-    rgb = NULL;
+    display_h264_push(&c->h264, in, &op->base, op->data, op->data_size, &op->dirty);
+}
 
-    return;
+/* coroutine context: the leading slices of the next frame, decoded while
+ * the server still encodes the rest */
+static void display_handle_h264_data_slice(SpiceChannel *channel, SpiceMsgIn *in)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceMsgDisplayH264StreamDataSlice *op = spice_msg_in_parsed(in);
 
-fail:
-    spice_assert(FALSE);
+    display_h264_push(&c->h264, in, NULL, op->data, op->data_size, NULL);
 }
 
+#define STREAM_PLAYBACK_SYNC_DROP_SEQ_LEN_LIMIT 5
+
 /* coroutine context */
 static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
 {
@@ -1803,6 +1582,9 @@ static void destroy_stream(SpiceChannel *channel, int id)
     case SPICE_VIDEO_CODEC_TYPE_MJPEG:
         stream_mjpeg_cleanup(st);
         break;
+    case SPICE_VIDEO_CODEC_TYPE_H264:
+        stream_h264_cleanup(st);
+        break;
     }
 
     if (st->msg_clip)
@@ -2096,6 +1878,8 @@ static void channel_set_handlers(SpiceChannelClass *klass)
         [ SPICE_MSG_DISPLAY_STREAM_DESTROY_ALL ] = display_handle_stream_destroy_all,
         [ SPICE_MSG_DISPLAY_STREAM_DATA_SIZED ]  = display_handle_stream_data,
         [ SPICE_MSG_DISPLAY_STREAM_ACTIVATE_REPORT ] = display_handle_stream_activate_report,
+        [ SPICE_MSG_DISPLAY_H264_STREAM_DATA_DIRTY ]  = display_handle_h264_data_dirty,
+        [ SPICE_MSG_DISPLAY_H264_STREAM_DATA_SLICE ]  = display_handle_h264_data_slice,
 
         [ SPICE_MSG_DISPLAY_DRAW_FILL ]          = display_handle_draw_fill,
         [ SPICE_MSG_DISPLAY_DRAW_OPAQUE ]        = display_handle_draw_opaque,
@@ -38,6 +38,7 @@ static gboolean smartcard = FALSE;
 static gboolean disable_audio = FALSE;
 static gboolean disable_usbredir = FALSE;
 static gboolean enable_avc = FALSE;
+static gboolean avc_hybrid = FALSE;
 static gint cache_size = 0;
 static gint glz_window_size = 0;
 static gchar *secure_channels = NULL;
@@ -214,6 +215,8 @@ GOptionGroup* spice_get_option_group(void)
           N_("Disable USB redirection support"), NULL },
         { "spice-enable-avc", '\0', 0, G_OPTION_ARG_NONE, &enable_avc,
           N_("Enable H.264/AVC support"), NULL },
+        { "spice-avc-hybrid", '\0', 0, G_OPTION_ARG_NONE, &avc_hybrid,
+          N_("Use H.264/AVC only for video areas (implies --spice-enable-avc)"), NULL },
         /* Backward compats version of spice-usbredir-auto-redirect-filter */
         { "spice-usbredir-filter", '\0', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_CALLBACK, parse_usbredir_filter,
           NULL, NULL },
@@ -313,8 +316,10 @@ void spice_set_session_option(SpiceSession *session)
     }
     if (disable_usbredir)
         g_object_set(session, "enable-usbredir", FALSE, NULL);
-    if (enable_avc)
+    if (enable_avc || avc_hybrid)
         g_object_set(session, "enable-avc", TRUE, NULL);
+    if (avc_hybrid)
+        g_object_set(session, "avc-hybrid", TRUE, NULL);
     if (disable_audio)
         g_object_set(session, "enable-audio", FALSE, NULL);
     if (cache_size)
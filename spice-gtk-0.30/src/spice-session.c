@@ -86,6 +86,8 @@ struct _SpiceSessionPrivate {
 
     /* whether to enable H.264/AVC */
     gboolean          avc;
+    /* whether H.264/AVC is only used for the video areas */
+    gboolean          avc_hybrid;
 
     /* Set when a usbredir channel has requested the keyboard grab to be
        temporarily released (because it is going to invoke policykit) */
@@ -193,6 +195,7 @@ enum {
     PROP_SMARTCARD_DB,
     PROP_USBREDIR,
     PROP_AVC,
+    PROP_AVC_HYBRID,
     PROP_INHIBIT_KEYBOARD_GRAB,
     PROP_DISABLE_EFFECTS,
     PROP_COLOR_DEPTH,
@@ -660,6 +663,9 @@ static void spice_session_get_property(GObject    *gobject,
     case PROP_AVC:
         g_value_set_boolean(value, s->avc);
         break;
+    case PROP_AVC_HYBRID:
+        g_value_set_boolean(value, s->avc_hybrid);
+        break;
     case PROP_INHIBIT_KEYBOARD_GRAB:
         g_value_set_boolean(value, s->inhibit_keyboard_grab);
         break;
@@ -801,6 +807,9 @@ static void spice_session_set_property(GObject      *gobject,
     case PROP_AVC:
         s->avc = g_value_get_boolean(value);
         break;
+    case PROP_AVC_HYBRID:
+        s->avc_hybrid = g_value_get_boolean(value);
+        break;
     case PROP_INHIBIT_KEYBOARD_GRAB:
         s->inhibit_keyboard_grab = g_value_get_boolean(value);
         break;
@@ -1223,6 +1232,15 @@ static void spice_session_class_init(SpiceSessionClass *klass)
                           G_PARAM_READWRITE | G_PARAM_CONSTRUCT |
                           G_PARAM_STATIC_STRINGS));
 
+    g_object_class_install_property
+        (gobject_class, PROP_AVC_HYBRID,
+         g_param_spec_boolean("avc-hybrid",
+                          "Hybrid H.264/AVC",
+                          "Use AVC for the video areas only, with enable-avc",
+                          FALSE,
+                          G_PARAM_READWRITE | G_PARAM_CONSTRUCT |
+                          G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceSession::inhibit-keyboard-grab:
      *
@@ -1548,6 +1566,7 @@ SpiceSession *spice_session_new_from_session(SpiceSession *session)
                  "enable-audio", &c->audio,
                  "enable-usbredir", &c->usbredir,
                  "enable-avc", &c->avc,
+                 "avc-hybrid", &c->avc_hybrid,
                  "ca", &c->ca,
                  NULL);
 
@@ -2737,6 +2756,14 @@ gboolean spice_session_get_avc_enabled(SpiceSession *session)
     return session->priv->avc;
 }
 
+G_GNUC_INTERNAL
+gboolean spice_session_get_avc_hybrid(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), FALSE);
+
+    return session->priv->avc_hybrid;
+}
+
 G_GNUC_INTERNAL
 gboolean spice_session_get_smartcard_enabled(SpiceSession *session)
 {
@@ -139,10 +139,19 @@ typedef enum SpicePathFlags {
 
 typedef enum SpiceVideoCodecType {
     SPICE_VIDEO_CODEC_TYPE_MJPEG = 1,
+    SPICE_VIDEO_CODEC_TYPE_H264,
 
     SPICE_VIDEO_CODEC_TYPE_ENUM_END
 } SpiceVideoCodecType;
 
+typedef enum SpiceAvcMode {
+    SPICE_AVC_MODE_OFF,
+    SPICE_AVC_MODE_FULL,
+    SPICE_AVC_MODE_HYBRID,
+
+    SPICE_AVC_MODE_ENUM_END
+} SpiceAvcMode;
+
 typedef enum SpiceStreamFlags {
     SPICE_STREAM_FLAGS_TOP_DOWN = (1 << 0),
 
@@ -504,6 +513,8 @@ enum {
     SPICE_MSG_DISPLAY_MONITORS_CONFIG,
     SPICE_MSG_DISPLAY_DRAW_COMPOSITE,
     SPICE_MSG_DISPLAY_STREAM_ACTIVATE_REPORT,
+    SPICE_MSG_DISPLAY_H264_STREAM_DATA_DIRTY,
+    SPICE_MSG_DISPLAY_H264_STREAM_DATA_SLICE,
 
     SPICE_MSG_END_DISPLAY
 };
@@ -513,6 +524,7 @@ enum {
     SPICE_MSGC_DISPLAY_STREAM_REPORT,
     SPICE_MSGC_DISPLAY_PREFERRED_COMPRESSION,
     SPICE_MSGC_DISPLAY_AVC,
+    SPICE_MSGC_DISPLAY_H264_KEYFRAME_REQUEST,
 
     SPICE_MSGC_END_DISPLAY
 };
@@ -136,8 +136,14 @@ enum {
     SPICE_DISPLAY_CAP_STREAM_REPORT,
     SPICE_DISPLAY_CAP_LZ4_COMPRESSION,
     SPICE_DISPLAY_CAP_PREF_COMPRESSION,
+    SPICE_DISPLAY_CAP_H264_DIRTY_RECTS,
+    SPICE_DISPLAY_CAP_H264_KEYFRAME_REQUEST,
+    SPICE_DISPLAY_CAP_H264_SLICES,
 };
 
+/* the stream id of the full screen h264 stream, in keyframe requests */
+#define SPICE_H264_FULL_SCREEN_STREAM_ID 0xffffffff
+
 enum {
     SPICE_INPUTS_CAP_KEY_SCANCODE,
 };